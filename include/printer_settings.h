@@ -39,13 +39,39 @@ extern "C" {
 #endif
 
 #include "ps_value.h"
+#include "ps_memory.h"
 #include "ps_slice.h"
 #include "ps_ostream.h"
 #include "ps_parse_json.h"
 
 struct ps_value_t *PS_GetDefaultSearch(void);
+/* The directories on a search path are read once and remembered.
+ * Files added to them later are found after clearing the index. */
+void PS_ClearSearchIndex(void);
+/* Watches the directories definition files and snapshots are loaded
+ * from, where the system supports it.  Definitions and snapshots that
+ * have not changed are then used without reading or checking their
+ * files, and files added to the search path are found.  Once started,
+ * watching lasts as long as the process.  Changes are applied by
+ * PS_New and PS_LoadSnapshot, which several threads may call at once. */
+int PS_WatchDefinitions(void);
 struct ps_value_t *PS_New(const char *printer, const struct ps_value_t *search);
 
+/* PS_New loads the extruder definitions with up to num threads,
+ * counting the caller, while the caller indexes the machine
+ * definition.  The default of 1 loads them one after another.  Fails
+ * for num > 1 without thread support. */
+int PS_SetLoadThreads(size_t num);
+
+/* Snapshots save printer settings from PS_New in a binary file that is
+ * much faster to load.  Loading fails if the snapshot was made for a
+ * different printer or search path, or any definition file it came
+ * from has changed.  PS_NewCached loads the snapshot if it can, and
+ * otherwise creates the settings with PS_New and saves a snapshot. */
+int PS_SaveSnapshot(const struct ps_value_t *ps, const char *file);
+struct ps_value_t *PS_LoadSnapshot(const char *file, const char *printer, const struct ps_value_t *search);
+struct ps_value_t *PS_NewCached(const char *printer, const struct ps_value_t *search, const char *snapshot);
+
 const char *PS_GetPrinter(const struct ps_value_t *ps);
 const struct ps_value_t *PS_GetSearch(const struct ps_value_t *ps);
 
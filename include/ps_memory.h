@@ -0,0 +1,70 @@
+/*
+  Copyright (C) 2018 Paul Maurer
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+  
+  1. Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+  
+  2. Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+  
+  3. Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from this
+  software without specific prior written permission.
+  
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef PS_MEMORY_H
+#define PS_MEMORY_H
+
+#include "ps_value.h"
+
+/* Memory is accounted by what it is used for.  Values are counted by
+ * type, starting at mem_value.  Memory allocated from an arena is
+ * counted as the arena blocks it comes from.  Unused space kept for
+ * object members is counted as mem_arena too. */
+enum ps_mem_t {
+  mem_value,
+  mem_string = mem_value + t_object + 1, /* Long string buffers */
+  mem_list,    /* List heads and elements */
+  mem_object,  /* Object headers and indexes */
+  mem_node,    /* Object members */
+  mem_atom,    /* Member names */
+  mem_stream,  /* Output streams and their buffers */
+  mem_arena,
+  mem_other,
+  mem_total
+};
+
+struct ps_mem_stats_t {
+  size_t num;
+  size_t bytes;
+  size_t peak_bytes;
+};
+
+/* The allocator is called like realloc, with the old size of the
+ * memory, and frees it when new_size is 0.  NULL restores malloc.  Set
+ * it before any other call to the library: it cannot be changed while
+ * the library holds memory, and after the first PS_New the key names,
+ * the definition cache and the search index are held until the
+ * process exits.  It is called by several threads if they use the
+ * library, one at a time.  The stats are totals over all threads,
+ * counted without a lock. */
+int PS_SetAllocator(void *(*alloc)(void *ptr, size_t old_size, size_t new_size, void *data), void *data);
+void PS_GetMemStats(enum ps_mem_t mem, struct ps_mem_stats_t *stats);
+
+#endif
@@ -33,7 +33,41 @@
 
 #include "ps_value.h"
 
+/* Regular files are parsed from a memory mapping, unless definition
+ * files are watched.  A mapped file that is truncated while it is
+ * parsed raises SIGBUS, so files that may be rewritten then should be
+ * replaced by renaming a new file over them instead. */
 struct ps_value_t *PS_ParseJsonFile(FILE *in);
 struct ps_value_t *PS_ParseJsonString(const char *string);
 
+/* Checks the whole file, but parses objects below the top level only
+ * when they are first used, one level at a time.  The text is kept in
+ * memory until all of them have been parsed or freed.  Within an arena
+ * this is the same as PS_ParseJsonFile.  Since reading the value parses
+ * it, it may only be used by one thread until PS_Freeze, which parses
+ * all of it. */
+struct ps_value_t *PS_ParseJsonFileLazy(FILE *in);
+
+/* Event parsing.  Every value is reported with its path, the member
+ * names leading to it from the outermost value (NULL for list items),
+ * and depth, the length of the path.  Scalars are passed to value,
+ * which takes ownership of them even when it fails.  Objects and lists
+ * are bracketed by begin and end.  filter is called before the value of
+ * each object member is parsed: members it returns 0 for are checked
+ * for syntax but skipped without events or allocations.  Callbacks may
+ * be NULL, one returning a negative number stops the parse with -1. */
+struct ps_json_events_t {
+  int (*filter)(const char *const *path, size_t depth, void *ref);
+  int (*begin)(const char *const *path, size_t depth, enum ps_type_t type, void *ref);
+  int (*end)(const char *const *path, size_t depth, enum ps_type_t type, void *ref);
+  int (*value)(const char *const *path, size_t depth, struct ps_value_t *v, void *ref);
+  void *ref;
+};
+
+int PS_ParseJsonEvents(FILE *in, const struct ps_json_events_t *ev);
+int PS_ParseJsonEventsString(const char *string, const struct ps_json_events_t *ev);
+
+/* Builds only the members the filter keeps */
+struct ps_value_t *PS_ParseJsonFileFiltered(FILE *in, int (*filter)(const char *const *path, size_t depth, void *ref), void *ref);
+
 #endif
@@ -59,6 +59,7 @@ struct ps_value_t *PS_NewVariableLen(const char *v, size_t len);
 struct ps_value_t *PS_NewBuiltinFunc(const char *nane);
 struct ps_value_t *PS_NewBuiltinFuncLen(const char *name, size_t len);
 struct ps_value_t *PS_NewList(void);
+struct ps_value_t *PS_NewListCap(size_t cap); /* Grows past cap if needed */
 struct ps_value_t *PS_NewFunction(const struct ps_value_t *func);
 struct ps_value_t *PS_NewObject(void);
 void PS_FreeValue(struct ps_value_t *v);
@@ -73,6 +74,21 @@ int PS_IsScalar(const struct ps_value_t *v);
 size_t PS_ItemCount(const struct ps_value_t *list_func_obj);
 struct ps_value_t *PS_GetItem(const struct ps_value_t *list, ssize_t pos);
 struct ps_value_t *PS_GetMember(const struct ps_value_t *obj, const char *name, int *is_present);
+const struct ps_value_t *PS_GetMemberConst(const struct ps_value_t *obj, const char *name, int *is_present); /* Result must not be modified */
+
+/* Batched lookups: several names in one object, membs receiving the
+ * members in the order of names, or one name in layered objects,
+ * returning the member of the first object that has it.  The results
+ * must not be modified. */
+size_t PS_GetMembers(const struct ps_value_t *obj, size_t num, const char *const *names, const struct ps_value_t **membs);
+const struct ps_value_t *PS_GetLayeredMember(const struct ps_value_t *const *objs, size_t num, const char *name);
+
+/* A handle to a member name, resolved once, saves hashing and
+ * comparing the name on every lookup.  Handles are never freed. */
+struct ps_key_t;
+const struct ps_key_t *PS_KeyHandle(const char *name);
+struct ps_value_t *PS_GetMemberKey(const struct ps_value_t *obj, const struct ps_key_t *key, int *is_present);
+const struct ps_value_t *PS_GetMemberKeyConst(const struct ps_value_t *obj, const struct ps_key_t *key, int *is_present);
 
 struct ps_value_t *PS_AddRef(const struct ps_value_t *v);
 struct ps_value_t *PS_CopyValue(const struct ps_value_t *v);
@@ -88,12 +104,52 @@ int PS_ResizeList(struct ps_value_t *list, size_t new_size, const struct ps_valu
 int PS_AddMember(struct ps_value_t *obj, const char *name, struct ps_value_t *v);
 int PS_RemoveMember(struct ps_value_t *obj, const char *name);
 
+/* Merge walks over the members of both objects in O(n + m) rather
+ * than a lookup per member.  For every member of src, merge is called
+ * with the member of dest by the same name, or NULL, and may change or
+ * replace it.  Members it leaves at NULL are not added, and members of
+ * dest it sets to NULL are removed, merge frees them.  Without merge
+ * copies of the members of src replace those of dest. */
+int PS_UnionObject(struct ps_value_t *dest, const struct ps_value_t *src, int (*merge)(const char *name, struct ps_value_t **memb, const struct ps_value_t *src_memb, void *ref), void *ref);
+/* Removes the members of dest that src also has, if rm is NULL or
+ * returns 1 for them */
+int PS_DifferenceObject(struct ps_value_t *dest, const struct ps_value_t *src, int (*rm)(const char *name, struct ps_value_t *memb, const struct ps_value_t *src_memb, void *ref), void *ref);
+
+/* While an arena is active all new values are allocated from it and
+ * are released together by the outermost PS_ArenaEnd, which returns a
+ * copy of keep (or NULL) on the general heap.  Values created before
+ * PS_ArenaBegin can be read and copied, but must not be modified or
+ * freed until the arena ends.  Arenas nest.  Each thread has its own
+ * arena, values from it must not be passed to other threads. */
+int PS_ArenaBegin(void);
+struct ps_value_t *PS_ArenaEnd(const struct ps_value_t *keep);
+
+/* Makes v and everything reachable from it read only and immortal.
+ * Freeing or adding references to a frozen value does nothing, and
+ * modifying it fails, so any number of threads may read it at once,
+ * e.g. to run PS_EvalAll on the same frozen printer and settings.
+ * Copies of a frozen value can be modified, but only by the thread
+ * that made them. */
+int PS_Freeze(struct ps_value_t *v);
+
 ssize_t PS_WriteValue(struct ps_ostream_t *os, const struct ps_value_t *v);
 ssize_t PS_WriteValuePretty(struct ps_ostream_t *os, const struct ps_value_t *v);
 
+/* func may replace the items, so a shared v is unshared first.  The
+ * iterators below only read v. */
 void PS_ValueForeach(const struct ps_value_t *v, void (*func)(const char *, struct ps_value_t **, void *), void *ref_data);
 
-struct ps_value_iterator_t;
+/* May be declared by the caller and set up with PS_InitValueIterator,
+ * which makes no allocation and needs no cleanup.  Members are
+ * private. */
+struct ps_value_iterator_t {
+  struct ps_value_t *v;
+  size_t count;
+  int init;
+  void *bti[sizeof(size_t) * 8 + 5];
+};
+
+int PS_InitValueIterator(struct ps_value_iterator_t *vi, const struct ps_value_t *v);
 struct ps_value_iterator_t *PS_NewValueIterator(const struct ps_value_t *v);
 void PS_FreeValueIterator(struct ps_value_iterator_t *vi);
 int PS_ValueIteratorNext(struct ps_value_iterator_t *vi);
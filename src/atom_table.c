@@ -0,0 +1,202 @@
+/*
+  Copyright (C) 2018 Paul Maurer
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+  
+  1. Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+  
+  2. Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+  
+  3. Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from this
+  software without specific prior written permission.
+  
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string.h>
+
+#include "atom_table.h"
+#include "ps_arena.h"
+
+struct atom_t {
+  struct atom_t *next;
+  size_t ref_count;
+  size_t hash;
+  char str[];
+};
+
+#define ATOM(a) ((struct atom_t *) ((char *) (a) - offsetof(struct atom_t, str)))
+#define MIN_BUCKETS 256
+
+static struct atom_t **buckets;
+static size_t num_buckets;
+static size_t num_atoms;
+
+size_t AtomHashString(const char *str) {
+  size_t hash = 2166136261u;
+  
+  while (*str)
+    hash = (hash ^ (unsigned char) *str++) * 16777619u;
+
+  return hash;
+}
+
+static struct atom_t *Find(const char *str, size_t hash) {
+  struct atom_t *atom;
+  
+  if (num_buckets == 0)
+    return NULL;
+  
+  for (atom = buckets[hash & (num_buckets - 1)]; atom; atom = atom->next)
+    if (atom->str == str || (atom->hash == hash && strcmp(atom->str, str) == 0))
+      return atom;
+  
+  return NULL;
+}
+
+static int Resize(size_t new_num) {
+  struct atom_t **nb, *atom, *next;
+  size_t count, idx;
+  
+  if ((nb = MemAlloc(new_num * sizeof(*nb), mem_atom)) == NULL) {
+    fprintf(stderr, "Cannot allocate memory for atom table\n");
+    return -1;
+  }
+  memset(nb, 0, new_num * sizeof(*nb));
+  
+  for (count = 0; count < num_buckets; count++) {
+    for (atom = buckets[count]; atom; atom = next) {
+      next = atom->next;
+      idx = atom->hash & (new_num - 1);
+      atom->next = nb[idx];
+      nb[idx] = atom;
+    }
+  }
+  
+  MemFree(buckets, num_buckets * sizeof(*buckets), mem_atom);
+  buckets = nb;
+  num_buckets = new_num;
+  
+  return 0;
+}
+
+const char *AtomIntern(const char *str) {
+  struct atom_t *atom, **head;
+  size_t hash, len;
+  
+  hash = AtomHashString(str);
+  LockShared(lock_atom);
+  if ((atom = Find(str, hash))) {
+    ATOMIC_ADD(atom->ref_count, 1);
+    goto out;
+  }
+  
+  if (num_atoms >= num_buckets && Resize(num_buckets ? 2 * num_buckets : MIN_BUCKETS) < 0)
+    goto err;
+  
+  len = strlen(str);
+  if ((atom = MemAlloc(sizeof(*atom) + len + 1, mem_atom)) == NULL) {
+    fprintf(stderr, "Cannot allocate memory for atom\n");
+    goto err;
+  }
+  atom->ref_count = 0;
+  atom->hash = hash;
+  memcpy(atom->str, str, len + 1);
+  
+  head = &buckets[hash & (num_buckets - 1)];
+  atom->next = *head;
+  *head = atom;
+  num_atoms++;
+  
+ out:
+  UnlockShared(lock_atom);
+  return atom->str;
+  
+ err:
+  UnlockShared(lock_atom);
+  return NULL;
+}
+
+/* The caller holds a reference, so the atom cannot be freed meanwhile */
+const char *AtomAddRef(const char *atom) {
+  ATOMIC_ADD(ATOM(atom)->ref_count, 1);
+  
+  return atom;
+}
+
+size_t AtomHash(const char *atom) {
+  return ATOM(atom)->hash;
+}
+
+/* Returns 0 if the reference was the last one */
+static int DropRef(struct atom_t *atom) {
+  size_t count = ATOMIC_LOAD(atom->ref_count);
+  
+  while (count > 0)
+    if (ATOMIC_CAS(atom->ref_count, count, count - 1))
+      return 1;
+  
+  return 0;
+}
+
+/* Only the last reference needs the lock.  AtomIntern may add a
+ * reference to the atom until it is removed, so it is checked again
+ * under the lock. */
+void AtomRelease(const char *str) {
+  struct atom_t *atom, **cur;
+  
+  if (str == NULL)
+    return;
+  
+  atom = ATOM(str);
+  if (DropRef(atom))
+    return;
+  
+  LockShared(lock_atom);
+  if (DropRef(atom))
+    goto out;
+  
+  for (cur = &buckets[atom->hash & (num_buckets - 1)]; *cur != atom; cur = &(*cur)->next)
+    ;
+  *cur = atom->next;
+  MemFree(atom, sizeof(*atom) + strlen(atom->str) + 1, mem_atom);
+  
+  if (--num_atoms == 0) {
+    MemFree(buckets, num_buckets * sizeof(*buckets), mem_atom);
+    buckets = NULL;
+    num_buckets = 0;
+  }
+  
+ out:
+  UnlockShared(lock_atom);
+}
+
+size_t AtomCount(void) {
+  size_t num;
+  
+  LockShared(lock_atom);
+  num = num_atoms;
+  UnlockShared(lock_atom);
+  
+  return num;
+}
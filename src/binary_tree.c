@@ -34,31 +34,66 @@
 
 #include <string.h>
 
+#include "atom_table.h"
 #include "binary_tree.h"
+#include "ps_arena.h"
 
+/* Keys are atoms, so a key matches a node only if the pointers are
+ * equal.  strcmp is still used to keep the tree in sorted order.
+ *
+ * Nodes are reference counted and shared between copies of a tree.
+ * A tree copies the nodes on the path to a change before making it, so
+ * copying a tree is O(1) and changing a copy is O(log n).  Nodes of a
+ * tree from outside the active arena, and frozen nodes, are used
+ * without a reference and are treated as shared. */
 struct node_t {
-  char *key;
+  const char *key;
   void *data;
+  size_t ref_count;
   int height;
+  char in_arena;
+  char frozen;
   struct node_t *left;
   struct node_t *right;
 };
 
+/* The tree that created the nodes keeps their data when a shared node
+ * is copied, so pointers it handed out stay valid; its copies get
+ * copies of the data.
+ *
+ * Larger trees get an open addressing index from key to node, built
+ * when they are changed or frozen and kept up to date as the tree
+ * changes.  Lookups never build it, so any number of threads may read
+ * a tree.  The tree still gives the order for iteration. */
 struct binary_tree_t {
   struct node_t *root;
   size_t count;
+  struct node_t **index;
+  size_t index_sz;
+  int in_arena;
+  int keep_data;
+  int shared;
+  int frozen;
   void *(*copy_func)(const void *);
   void (*free_func)(void *);
 };
 
+#define MIN_INDEX 16
+#define MIN_ATOM_INDEX 4
+
+static struct pool_t node_pool = POOL_INIT(struct node_t, mem_node);
+
 struct binary_tree_t *NewBinaryTree(void *(*copy_func)(const void *), void (*free_func)(void *)) {
   struct binary_tree_t *bt;
+  int in_arena = ArenaActive();
 
-  if ((bt = malloc(sizeof(*bt))) == NULL) {
+  if ((bt = AllocMem(sizeof(*bt), mem_object, in_arena)) == NULL) {
     fprintf(stderr, "Cannot allocate memory for binary tree root\n");
     goto err;
   }
   memset(bt, 0, sizeof(*bt));
+  bt->in_arena = in_arena;
+  bt->keep_data = 1;
   bt->copy_func = copy_func;
   bt->free_func = free_func;
   
@@ -68,26 +103,47 @@ struct binary_tree_t *NewBinaryTree(void *(*copy_func)(const void *), void (*fre
   return NULL;
 }
 
-static struct node_t *NewNode(const char *key, void *data) {
+/* Trees in an arena borrow their keys, the arena holds a reference to
+ * each atom until it is released.  Another thread may free the values
+ * that interned them meanwhile. */
+static const char *GetKey(const struct binary_tree_t *bt, const char *key) {
+  const char *atom;
+  
+  if (!bt->in_arena)
+    return AtomIntern(key);
+  
+  if ((atom = AtomIntern(key)) == NULL)
+    return NULL;
+  
+  if (ArenaKeepAtom(atom) < 0) {
+    AtomRelease(atom);
+    return NULL;
+  }
+  
+  return atom;
+}
+
+static void PutKey(const struct binary_tree_t *bt, const char *key) {
+  if (!bt->in_arena)
+    AtomRelease(key);
+}
+
+/* Takes ownership of the reference to key */
+static struct node_t *NewNode(const struct binary_tree_t *bt, const char *key, void *data) {
   struct node_t *n;
 
-  if ((n = malloc(sizeof(*n))) == NULL) {
+  if ((n = PoolAlloc(&node_pool, bt->in_arena)) == NULL) {
     fprintf(stderr, "Cannot allocate memory for binary tree node\n");
     goto err;
   }
   memset(n, 0, sizeof(*n));
+  n->key = key;
   n->data = data;
   n->height = -1;
-  
-  if ((n->key = strdup(key)) == NULL) {
-    fprintf(stderr, "Cannot allocate memory for binary tree node key\n");
-    goto err2;
-  }
+  n->in_arena = bt->in_arena;
   
   return n;
   
- err2:
-  free(n);
  err:
   return NULL;
 }
@@ -96,44 +152,197 @@ static void FreeNode(struct node_t *node, void (*free_func)(void *)) {
   if (node == NULL)
     return;
   
-  free(node->key);
+  if (node->frozen || node->ref_count-- > 0)
+    return;
+  
+  AtomRelease(node->key);
   if (free_func)
     free_func(node->data);
   FreeNode(node->left, free_func);
   FreeNode(node->right, free_func);
-  free(node);
+  PoolFree(&node_pool, node, 0);
 }
 
 void FreeBinaryTree(struct binary_tree_t *bt) {
-  if (bt == NULL)
+  if (bt == NULL || bt->in_arena)
     return;
   
   FreeNode(bt->root, bt->free_func);
-  free(bt);
+  MemFree(bt->index, bt->index_sz * sizeof(*bt->index), mem_object);
+  MemFree(bt, sizeof(*bt), mem_object);
+}
+
+static void DropIndex(struct binary_tree_t *bt) {
+  FreeMem(bt->index, bt->index_sz * sizeof(*bt->index), mem_object, bt->in_arena);
+  bt->index = NULL;
+  bt->index_sz = 0;
 }
 
-static struct node_t *CopyNode(struct node_t *src, const struct binary_tree_t *bt) {
-  struct node_t *dest;
+static struct node_t **IndexSlot(const struct binary_tree_t *bt, const char *key) {
+  size_t mask = bt->index_sz - 1, idx;
   
-  if ((dest = NewNode(src->key, src->data)) == NULL)
-    goto err;
+  for (idx = AtomHash(key) & mask; bt->index[idx]; idx = (idx + 1) & mask)
+    if (bt->index[idx]->key == key)
+      break;
+  
+  return &bt->index[idx];
+}
 
-  dest->height = src->height;
-  if (bt->copy_func && (dest->data = bt->copy_func(src->data)) == NULL)
-    goto err2;
+static void IndexAdd(struct node_t **index, size_t index_sz, struct node_t *n) {
+  size_t mask = index_sz - 1, idx;
   
-  if (src->left && (dest->left = CopyNode(src->left, bt)) == NULL)
-    goto err2;
+  for (idx = AtomHash(n->key) & mask; index[idx]; idx = (idx + 1) & mask)
+    ;
+  index[idx] = n;
+}
 
-  if (src->right && (dest->right = CopyNode(src->right, bt)) == NULL)
-    goto err2;
+static void IndexAddNodes(struct node_t **index, size_t index_sz, struct node_t *n) {
+  if (n == NULL)
+    return;
   
-  return dest;
+  IndexAdd(index, index_sz, n);
+  IndexAddNodes(index, index_sz, n->left);
+  IndexAddNodes(index, index_sz, n->right);
+}
+
+/* The index is kept at most half full */
+static int BuildIndex(struct binary_tree_t *bt) {
+  struct node_t **index;
+  size_t index_sz = MIN_INDEX;
   
- err2:
-  FreeNode(dest, bt->free_func);
- err:
-  return NULL;
+  while (index_sz < 2 * (bt->count + 1)) {
+    if (index_sz > SIZE_MAX / 2 / sizeof(*index))
+      return -1;
+    index_sz <<= 1;
+  }
+  
+  if ((index = AllocMem(index_sz * sizeof(*index), mem_object, bt->in_arena)) == NULL)
+    return -1;
+  memset(index, 0, index_sz * sizeof(*index));
+  IndexAddNodes(index, index_sz, bt->root);
+  
+  DropIndex(bt);
+  bt->index = index;
+  bt->index_sz = index_sz;
+  
+  return 0;
+}
+
+/* Points the index at n, which may replace a node with the same key.
+ * If the index cannot grow it is dropped. */
+static void IndexSet(struct binary_tree_t *bt, struct node_t *n) {
+  struct node_t **slot;
+  
+  if (bt->index == NULL)
+    return;
+  
+  slot = IndexSlot(bt, n->key);
+  if (*slot == NULL && 2 * (bt->count + 1) > bt->index_sz) {
+    if (BuildIndex(bt) < 0)
+      DropIndex(bt);
+    return;
+  }
+  
+  *slot = n;
+}
+
+/* Linear probing allows removal without tombstones: later entries of
+ * the same cluster are moved back into the hole */
+static void IndexRemove(struct binary_tree_t *bt, const char *key) {
+  size_t mask = bt->index_sz - 1, hole, idx, home;
+  
+  if (bt->index == NULL)
+    return;
+  
+  hole = IndexSlot(bt, key) - bt->index;
+  if (bt->index[hole] == NULL)
+    return;
+  
+  bt->index[hole] = NULL;
+  for (idx = (hole + 1) & mask; bt->index[idx]; idx = (idx + 1) & mask) {
+    home = AtomHash(bt->index[idx]->key) & mask;
+    if (((idx - home) & mask) >= ((idx - hole) & mask)) {
+      bt->index[hole] = bt->index[idx];
+      bt->index[idx] = NULL;
+      hole = idx;
+    }
+  }
+}
+
+/* Only called where the tree may be changed.  Lookups by atom are
+ * assumed to be hot, and index smaller trees. */
+static void CheckIndex(struct binary_tree_t *bt, size_t min) {
+  if (bt->index || bt->frozen || bt->count < min)
+    return;
+  
+  BuildIndex(bt);
+}
+
+static int IsForeign(const struct binary_tree_t *bt, const struct node_t *n) {
+  return n->frozen || n->in_arena != bt->in_arena;
+}
+
+static int IsShared(const struct binary_tree_t *bt, const struct node_t *n) {
+  return n->ref_count > 0 || IsForeign(bt, n);
+}
+
+static int AddRef(const struct binary_tree_t *bt, struct node_t *n) {
+  if (n == NULL || IsForeign(bt, n))
+    return 0;
+  
+  if (n->ref_count == SIZE_MAX) {
+    fprintf(stderr, "Too many references to binary tree node\n");
+    return -1;
+  }
+  
+  n->ref_count++;
+  return 0;
+}
+
+/* Replaces a shared node with a copy that belongs to bt alone */
+static int MakeUnique(struct binary_tree_t *bt, struct node_t **n) {
+  struct node_t *src = *n, *dest;
+  const char *key;
+  void *data;
+  
+  if (!IsShared(bt, src))
+    return 0;
+  
+  if (src->ref_count == SIZE_MAX - 1 ||
+      (src->left && src->left->ref_count == SIZE_MAX) ||
+      (src->right && src->right->ref_count == SIZE_MAX)) {
+    fprintf(stderr, "Too many references to binary tree node\n");
+    return -1;
+  }
+  
+  data = src->data;
+  if (bt->copy_func && (data = bt->copy_func(src->data)) == NULL)
+    return -1;
+  
+  key = bt->in_arena ? src->key : AtomAddRef(src->key);
+  if ((dest = NewNode(bt, key, data)) == NULL) {
+    PutKey(bt, key);
+    if (bt->free_func && !bt->in_arena)
+      bt->free_func(data);
+    return -1;
+  }
+  
+  if (bt->keep_data && !IsForeign(bt, src)) {
+    dest->data = src->data;
+    src->data = data;
+  }
+  
+  dest->height = src->height;
+  dest->left = src->left;
+  dest->right = src->right;
+  AddRef(bt, dest->left);
+  AddRef(bt, dest->right);
+  if (!IsForeign(bt, src))
+    src->ref_count--;
+  *n = dest;
+  IndexSet(bt, dest);
+  
+  return 0;
 }
 
 struct binary_tree_t *CopyBinaryTree(const struct binary_tree_t *bt) {
@@ -142,11 +351,15 @@ struct binary_tree_t *CopyBinaryTree(const struct binary_tree_t *bt) {
   if ((nbt = NewBinaryTree(bt->copy_func, bt->free_func)) == NULL)
     goto err;
   nbt->count = bt->count;
+  nbt->keep_data = 0;
+  nbt->shared = 1;
+  
+  if (AddRef(nbt, bt->root) < 0)
+    goto err2;
+  nbt->root = bt->root;
+  if (!bt->frozen && bt->in_arena == nbt->in_arena)
+    ((struct binary_tree_t *) bt)->shared = 1;
   
-  if (bt->root)
-    if ((nbt->root = CopyNode(bt->root, bt)) == NULL)
-      goto err2;
-
   return nbt;
 
  err2:
@@ -155,14 +368,78 @@ struct binary_tree_t *CopyBinaryTree(const struct binary_tree_t *bt) {
   return NULL;
 }
 
+/* A tree in the arena that has not been changed still uses only nodes
+ * from outside of it */
+int BinaryTreeInArena(const struct binary_tree_t *bt) {
+  if (bt->root)
+    return bt->root->in_arena;
+  
+  return bt->in_arena;
+}
+
+static int UnshareNode(struct binary_tree_t *bt, struct node_t **n) {
+  if (*n == NULL)
+    return 0;
+  
+  if (MakeUnique(bt, n) < 0)
+    return -1;
+  
+  if (UnshareNode(bt, &(*n)->left) < 0)
+    return -1;
+  
+  return UnshareNode(bt, &(*n)->right);
+}
+
+int UnshareBinaryTree(struct binary_tree_t *bt) {
+  if (!bt->shared)
+    return 0;
+  
+  if (UnshareNode(bt, &bt->root) < 0)
+    return -1;
+  
+  bt->shared = 0;
+  return 0;
+}
+
+static void FreezeNode(struct node_t *n) {
+  if (n == NULL || n->frozen)
+    return;
+  
+  n->frozen = 1;
+  FreezeNode(n->left);
+  FreezeNode(n->right);
+}
+
+/* Frozen nodes are never modified or freed, and are shared without
+ * touching their reference count.  Frozen trees are read often, so
+ * smaller ones get an index too. */
+void BinaryTreeFreeze(struct binary_tree_t *bt) {
+  FreezeNode(bt->root);
+  CheckIndex(bt, MIN_ATOM_INDEX);
+  bt->frozen = 1;
+}
+
+static void ThawNode(struct node_t *n) {
+  if (n == NULL || !n->frozen)
+    return;
+  
+  n->frozen = 0;
+  ThawNode(n->left);
+  ThawNode(n->right);
+}
+
+/* Only for trees that nothing reads any more, so they can be freed */
+void BinaryTreeThaw(struct binary_tree_t *bt) {
+  ThawNode(bt->root);
+  bt->frozen = 0;
+}
+
 size_t BinaryTreeCount(const struct binary_tree_t *bt) {
   return bt->count;
 }
 
-#define STACK_SZ (sizeof(size_t) * 8 + 3)
-
 struct stack_t {
-  struct node_t **stack[STACK_SZ];
+  struct node_t **stack[BT_STACK_SZ];
   int depth;
 };
 
@@ -171,16 +448,20 @@ struct stack_t {
 #define STACK_POP(st) ((st)->stack[--(st)->depth])
 #define STACK_DECR(st) ((st)->depth--)
 
-static int FindNode(struct stack_t *stack, const struct binary_tree_t *bt, const char *key) {
+/* Key must be an atom.  If bt is given, nodes on the path are made
+ * unique to it so they can be modified. */
+static int FindNode(struct stack_t *stack, const struct binary_tree_t *bt, const char *key, struct binary_tree_t *unique) {
   struct node_t **cur = (struct node_t **) &bt->root;
-  int ret;
 
   stack->depth = 0;
   STACK_PUSH(stack, cur);
   while (*cur != NULL) {
-    if ((ret = strcmp(key, (*cur)->key)) == 0)
+    if (unique && MakeUnique(unique, cur) < 0)
+      return -1;
+    
+    if (key == (*cur)->key)
       return 1;
-    else if (ret < 0)
+    else if (strcmp(key, (*cur)->key) < 0)
       cur = &(*cur)->left;
     else
       cur = &(*cur)->right;
@@ -208,15 +489,22 @@ static void FixHeight(struct node_t *n) {
  *      z   to   x      or   x     z
  *     / \      / \         / \   / \
  *    y            y          yl yr
+ *
+ * x is already unique, z and y are made unique before being changed.
  */
-static void RotateLeft(struct node_t **n) {
+static int RotateLeft(struct binary_tree_t *bt, struct node_t **n) {
   struct node_t *x, *y, *z;
   
   x = *n;
+  if (MakeUnique(bt, &x->right) < 0)
+    return -1;
   z = x->right;
   y = z->left;
   
   if (HEIGHT(y) > HEIGHT(z->right)) {
+    if (MakeUnique(bt, &z->left) < 0)
+      return -1;
+    y = z->left;
     x->right = y->left;
     z->left  = y->right;
     y->left  = x;
@@ -232,16 +520,23 @@ static void RotateLeft(struct node_t **n) {
     FixHeight(x);
     FixHeight(z);
   }
+  
+  return 0;
 }
 
-static void RotateRight(struct node_t **n) {
+static int RotateRight(struct binary_tree_t *bt, struct node_t **n) {
   struct node_t *x, *y, *z;
   
   x = *n;
+  if (MakeUnique(bt, &x->left) < 0)
+    return -1;
   z = x->left;
   y = z->right;
   
   if (HEIGHT(y) > HEIGHT(z->left)) {
+    if (MakeUnique(bt, &z->right) < 0)
+      return -1;
+    y = z->right;
     x->left  = y->right;
     z->right = y->left;
     y->right = x;
@@ -257,11 +552,15 @@ static void RotateRight(struct node_t **n) {
     FixHeight(x);
     FixHeight(z);
   }
+  
+  return 0;
 }
 
-static void Rebalance(struct stack_t *stack) {
+/* Nodes on the stack must be unique.  If a rotation cannot be done the
+ * tree is left valid but unbalanced. */
+static void Rebalance(struct binary_tree_t *bt, struct stack_t *stack) {
   struct node_t **n;
-  int lh, rh, oh;
+  int lh, rh, oh, ret = 0;
 
   while (stack->depth > 0) {
     n = STACK_POP(stack);
@@ -269,29 +568,105 @@ static void Rebalance(struct stack_t *stack) {
     lh = HEIGHT((*n)->left);
     rh = HEIGHT((*n)->right);
     if (lh > rh + 1) {
-      RotateRight(n);
+      ret = RotateRight(bt, n);
     } else if (rh > lh + 1) {
-      RotateLeft(n);
+      ret = RotateLeft(bt, n);
     } else {
       (*n)->height = (lh > rh ? lh : rh) + 1;
     }
+    if (ret < 0)
+      FixHeight(*n);
     if ((*n)->height == oh)
       return;
   }
 }
 
-const void *BinaryTreeLookup(const struct binary_tree_t *bt, const char *key, int *is_present) {
+/* Key must be an atom */
+static struct node_t *Find(const struct binary_tree_t *bt, const char *key) {
   struct stack_t st;
   
-  if (FindNode(&st, bt, key)) {
-    if (is_present)
-      *is_present = 1;
-    return (*STACK_CUR(&st))->data;
+  if (bt->index)
+    return *IndexSlot(bt, key);
+  
+  if (FindNode(&st, bt, key, NULL))
+    return *STACK_CUR(&st);
+  
+  return NULL;
+}
+
+/* Key need not be an atom.  The keys of the tree are compared by
+ * string, so the atom table is not needed and stays unlocked. */
+static struct node_t *FindString(const struct binary_tree_t *bt, const char *key) {
+  struct node_t *n;
+  size_t mask, idx, hash;
+  int cmp;
+  
+  if (bt->index) {
+    mask = bt->index_sz - 1;
+    hash = AtomHashString(key);
+    for (idx = hash & mask; (n = bt->index[idx]); idx = (idx + 1) & mask)
+      if (n->key == key || (AtomHash(n->key) == hash && strcmp(n->key, key) == 0))
+	break;
+    
+    return n;
   }
+  
+  n = bt->root;
+  while (n && n->key != key) {
+    if ((cmp = strcmp(key, n->key)) == 0)
+      break;
+    n = cmp < 0 ? n->left : n->right;
+  }
+  
+  return n;
+}
 
+static void *NodeData(const struct node_t *n, int *is_present) {
   if (is_present)
-    *is_present = 0;
-  return NULL;
+    *is_present = n != NULL;
+  
+  return n ? n->data : NULL;
+}
+
+/* Only the nodes of a shared tree need to be copied first.  n must be
+ * a node of bt. */
+static void *MutableData(struct binary_tree_t *bt, struct node_t *n, int *is_present) {
+  struct stack_t st;
+  const char *atom;
+  
+  if (n && (bt->shared || bt->frozen)) {
+    atom = n->key;
+    n = NULL;
+    if (FindNode(&st, bt, atom, bt) > 0)
+      n = *STACK_CUR(&st);
+  }
+  
+  return NodeData(n, is_present);
+}
+
+static void *LookupMutable(struct binary_tree_t *bt, const char *atom, size_t min, int *is_present) {
+  CheckIndex(bt, min);
+  
+  return MutableData(bt, atom ? Find(bt, atom) : NULL, is_present);
+}
+
+const void *BinaryTreeLookup(const struct binary_tree_t *bt, const char *key, int *is_present) {
+  return NodeData(FindString(bt, key), is_present);
+}
+
+/* Like BinaryTreeLookup, but the data returned may be modified */
+void *BinaryTreeLookupMutable(struct binary_tree_t *bt, const char *key, int *is_present) {
+  CheckIndex(bt, MIN_INDEX);
+  
+  return MutableData(bt, FindString(bt, key), is_present);
+}
+
+const void *BinaryTreeLookupAtom(const struct binary_tree_t *bt, const char *atom, int *is_present) {
+  return NodeData(atom ? Find(bt, atom) : NULL, is_present);
+}
+
+void *BinaryTreeLookupAtomMutable(struct binary_tree_t *bt, const char *atom, int *is_present) {
+  return LookupMutable(bt, atom, MIN_ATOM_INDEX, is_present);
 }
 
 int BinaryTreeInsert(struct binary_tree_t *bt, const char *key, void *data) {
@@ -299,10 +674,17 @@ int BinaryTreeInsert(struct binary_tree_t *bt, const char *key, void *data) {
   struct node_t **n;
   int found;
   
-  found = FindNode(&st, bt, key);
+  if ((key = GetKey(bt, key)) == NULL)
+    return -1;
+  
+  if ((found = FindNode(&st, bt, key, bt)) < 0) {
+    PutKey(bt, key);
+    return -1;
+  }
   n = STACK_CUR(&st);
 
   if (found) {
+    PutKey(bt, key);
     if (bt->free_func)
       bt->free_func((*n)->data);
     (*n)->data = data;
@@ -310,55 +692,77 @@ int BinaryTreeInsert(struct binary_tree_t *bt, const char *key, void *data) {
     return 0;
   }
 
-  if ((*n = NewNode(key, data)) == NULL)
+  if ((*n = NewNode(bt, key, data)) == NULL) {
+    PutKey(bt, key);
     return -1;
+  }
   bt->count++;
+  IndexSet(bt, *n);
   
-  Rebalance(&st);
+  Rebalance(bt, &st);
+  CheckIndex(bt, MIN_INDEX);
   return 1;
 }
 
+static void RemoveNode(struct binary_tree_t *bt, struct node_t *n) {
+  PutKey(bt, n->key);
+  if (bt->free_func)
+    bt->free_func(n->data);
+  PoolFree(&node_pool, n, bt->in_arena);
+}
+
 int BinaryTreeRemove(struct binary_tree_t *bt, const char *key) {
   struct stack_t st;
   struct node_t **n, *is, *cur;
   
-  if (!FindNode(&st, bt, key))
+  if ((cur = FindString(bt, key)) == NULL)
     return 0;
+  
+  key = cur->key;
+  if (FindNode(&st, bt, key, bt) < 0)
+    return -1;
 
   bt->count--;
   n = STACK_CUR(&st);
   cur = *n;
   if (cur->right == NULL) {
-    st.depth--;
     *n = cur->left;
-    free(cur->key);
-    if (bt->free_func)
-      bt->free_func(cur->data);
-    free(cur);
+    IndexRemove(bt, cur->key);
+    RemoveNode(bt, cur);
     STACK_DECR(&st);
-    Rebalance(&st);
+    Rebalance(bt, &st);
     return 1;
   }
 
   n = &cur->right;
   STACK_PUSH(&st, n);
+  if (MakeUnique(bt, n) < 0)
+    goto err;
   while ((*n)->left) {
     n = &(*n)->left;
     STACK_PUSH(&st, n);
+    if (MakeUnique(bt, n) < 0)
+      goto err;
   }
   
   is = *n;
-  free(cur->key);
+  IndexRemove(bt, cur->key);
+  PutKey(bt, cur->key);
   if (bt->free_func)
     bt->free_func(cur->data);
   cur->key  = is->key;
   cur->data = is->data;
   *n = is->right;
-  free(is);
+  IndexSet(bt, cur);
+  PoolFree(&node_pool, is, bt->in_arena);
   
   STACK_DECR(&st);
-  Rebalance(&st);
+  Rebalance(bt, &st);
   return 1;
+  
+ err:
+  bt->count++;
+  return -1;
 }
 
 static int VerifyNode(struct node_t *n) {
@@ -405,33 +809,26 @@ void BinaryTreeForeach(struct binary_tree_t *bt, void (*func)(const char *, void
   NodeForeach(bt->root, func, ref_data);
 }
 
-struct binary_tree_iterator_t {
-  struct binary_tree_t *bt;
-  int init;
-  int state[STACK_SZ];
-  struct stack_t stack;
-};
+/* In order traversal keeps the nodes still to be visited after their
+ * left subtree on the stack, the current node is on top */
+static void PushLeft(struct binary_tree_iterator_t *bti, struct node_t *n) {
+  for (; n; n = n->left)
+    bti->stack[bti->depth++] = n;
+}
 
-#define BTI_STATE(bti) ((bti)->state[(bti)->stack.depth - 1])
-#define BTI_PUSH(bti, node)			\
-  do {						\
-    if (*(node)) {				\
-      (bti)->state[(bti)->stack.depth] = 0;	\
-      STACK_PUSH(&(bti)->stack, node);		\
-    }						\
-  } while (0)
-#define BTI_CUR(bti) STACK_CUR(&(bti)->stack)
-#define BTI_POP(bti) STACK_POP(&(bti)->stack)
+void BinaryTreeIteratorInit(struct binary_tree_iterator_t *bti, const struct binary_tree_t *bt) {
+  bti->bt = bt;
+  bti->depth = -1;
+}
 
 struct binary_tree_iterator_t *NewBinaryTreeIterator(const struct binary_tree_t *bt) {
   struct binary_tree_iterator_t *bti;
 
-  if ((bti = malloc(sizeof(*bti))) == NULL) {
+  if ((bti = MemAlloc(sizeof(*bti), mem_other)) == NULL) {
     fprintf(stderr, "Could not allocate memory for binary tree iterator\n");
     goto err;
   }
-  memset(bti, 0, sizeof(*bti));
-  bti->bt = (struct binary_tree_t *) bt;
+  BinaryTreeIteratorInit(bti, bt);
 
   return bti;
   
@@ -440,68 +837,276 @@ struct binary_tree_iterator_t *NewBinaryTreeIterator(const struct binary_tree_t
 }
 
 void FreeBinaryTreeIterator(struct binary_tree_iterator_t *bti) {
-  free(bti);
+  MemFree(bti, sizeof(*bti), mem_other);
 }
 
 void BinaryTreeIteratorReset(struct binary_tree_iterator_t *bti) {
-  bti->init = 0;
-  bti->stack.depth = 0;
+  bti->depth = -1;
 }
 
 int BinaryTreeIteratorNext(struct binary_tree_iterator_t *bti) {
   struct node_t *cur;
   
-  while (1) {
-    if (bti->stack.depth <= 0) {
-      if (bti->init)
-	return 0;
-      bti->init = 1;
-      BTI_PUSH(bti, &bti->bt->root);
-      continue;
-    }
-
-    cur = *BTI_CUR(bti);
-    switch (BTI_STATE(bti)++) {
-    case 0:
-      BTI_PUSH(bti, &cur->left);
-      continue;
-
-    case 1:
-      return 1;
-
-    case 2:
-      BTI_PUSH(bti, &cur->right);
-      continue;
-
-    case 3:
-      bti->stack.depth--;
-      continue;
-    }
+  if (bti->depth < 0) {
+    bti->depth = 0;
+    PushLeft(bti, bti->bt->root);
+  } else if (bti->depth > 0) {
+    cur = bti->stack[--bti->depth];
+    PushLeft(bti, cur->right);
   }
+  
+  return bti->depth > 0;
 }
 
 const char *BinaryTreeIteratorKey(struct binary_tree_iterator_t *bti) {
-  if (bti->stack.depth <= 0)
+  if (bti->depth <= 0)
     return NULL;
   
-  return (*STACK_CUR(&bti->stack))->key;
+  return bti->stack[bti->depth - 1]->key;
 }
 
 const void *BinaryTreeIteratorData(struct binary_tree_iterator_t *bti) {
-  if (bti->stack.depth <= 0)
+  if (bti->depth <= 0)
+    return NULL;
+  
+  return bti->stack[bti->depth - 1]->data;
+}
+
+/* The iterator only reads the nodes, so the current one may still be
+ * shared.  Its path in bt is copied first, the iteration continues
+ * over the old nodes which hold the same keys. */
+void *BinaryTreeIteratorDataMutable(struct binary_tree_iterator_t *bti, struct binary_tree_t *bt) {
+  struct node_t *n;
+  
+  if (bti->depth <= 0)
     return NULL;
   
-  return (*STACK_CUR(&bti->stack))->data;
+  n = bti->stack[bti->depth - 1];
+  if (!bt->shared && !bt->frozen)
+    return n->data;
+  
+  return LookupMutable(bt, n->key, MIN_ATOM_INDEX, NULL);
 }
 
 void BinaryTreeIteratorSetData(struct binary_tree_iterator_t *bti, void *data) {
   struct node_t *n;
   
-  if (bti->stack.depth <= 0)
+  if (bti->depth <= 0)
     return;
   
-  n = *STACK_CUR(&bti->stack);
+  n = bti->stack[bti->depth - 1];
   if (bti->bt->free_func)
     bti->bt->free_func(n->data);
   n->data = data;
 }
+
+/* Links nodes given in order into a balanced tree in O(n) */
+static struct node_t *LinkNodes(struct node_t **nodes, size_t num) {
+  struct node_t *n;
+  size_t mid;
+  
+  if (num == 0)
+    return NULL;
+  
+  mid = num / 2;
+  n = nodes[mid];
+  n->left = LinkNodes(nodes, mid);
+  n->right = LinkNodes(nodes + mid + 1, num - mid - 1);
+  FixHeight(n);
+  
+  return n;
+}
+
+/* Orders the current keys of a merge walk, a missing key sorts last */
+static int CompareKeys(const char *key, const char *skey) {
+  if (key == skey)
+    return 0;
+  if (skey == NULL)
+    return -1;
+  if (key == NULL)
+    return 1;
+  
+  return strcmp(key, skey);
+}
+
+static struct node_t *IteratorNode(struct binary_tree_iterator_t *bti) {
+  return bti->stack[bti->depth - 1];
+}
+
+/* Nodes of a merge walk are made unique to bt first, then relinked
+ * into a new balanced tree together with any new nodes.  If merge is
+ * given it is called for every key of src with a pointer to the data
+ * of bt, or to NULL if bt does not have the key, and may change it.
+ * Keys it leaves at NULL are not added, and keys of bt it sets to NULL
+ * are removed without freeing their data.  Otherwise the data of src
+ * is copied into bt.  On error bt keeps the keys merged so far.  The
+ * index is rebuilt once the tree is relinked. */
+int BinaryTreeUnion(struct binary_tree_t *bt, const struct binary_tree_t *src, int (*merge)(const char *key, void **data, const void *src_data, void *ref), void *ref) {
+  struct binary_tree_iterator_t bti, sbti;
+  struct node_t **nodes, *n;
+  const char *key, *skey;
+  const void *src_data;
+  void *data;
+  size_t num, max;
+  int cmp, ret = 0;
+  
+  n = NULL;
+  if (src->count == 0)
+    return 0;
+  
+  if (UnshareBinaryTree(bt) < 0)
+    goto err;
+  DropIndex(bt);
+  
+  max = bt->count + src->count;
+  if (max < bt->count || max > SIZE_MAX / sizeof(*nodes) ||
+      (nodes = MemAlloc(max * sizeof(*nodes), mem_other)) == NULL) {
+    fprintf(stderr, "Cannot allocate memory for binary tree union\n");
+    goto err;
+  }
+  
+  num = 0;
+  BinaryTreeIteratorInit(&bti, bt);
+  BinaryTreeIteratorInit(&sbti, src);
+  BinaryTreeIteratorNext(&bti);
+  BinaryTreeIteratorNext(&sbti);
+  for (;;) {
+    key = BinaryTreeIteratorKey(&bti);
+    skey = ret < 0 ? NULL : BinaryTreeIteratorKey(&sbti);
+    if (key == NULL && skey == NULL)
+      break;
+    
+    if ((cmp = CompareKeys(key, skey)) <= 0) {
+      n = IteratorNode(&bti);
+      nodes[num++] = n;
+      BinaryTreeIteratorNext(&bti);
+      if (cmp < 0)
+	continue;
+    }
+    
+    src_data = BinaryTreeIteratorData(&sbti);
+    BinaryTreeIteratorNext(&sbti);
+    
+    data = cmp == 0 ? n->data : NULL;
+    if (merge) {
+      if (merge(skey, &data, src_data, ref) < 0)
+	ret = -1;
+    } else {
+      if (bt->copy_func == NULL)
+	data = (void *) src_data;
+      else if ((data = bt->copy_func(src_data)) == NULL)
+	ret = -1;
+      else if (cmp == 0 && bt->free_func)
+	bt->free_func(n->data);
+    }
+    
+    if (cmp == 0) {
+      if (ret < 0)
+	continue;
+      n->data = data;
+      if (merge && data == NULL) {
+	num--;
+	bt->count--;
+	RemoveNode(bt, n);
+      }
+      continue;
+    }
+    
+    /* Data merge made for a new key before failing is not added */
+    if (ret < 0) {
+      if (data && bt->free_func)
+	bt->free_func(data);
+      continue;
+    }
+    
+    if (merge && data == NULL)
+      continue;
+    
+    if ((skey = GetKey(bt, skey)) == NULL || (n = NewNode(bt, skey, data)) == NULL) {
+      if (skey)
+	PutKey(bt, skey);
+      if (bt->free_func)
+	bt->free_func(data);
+      ret = -1;
+      continue;
+    }
+    
+    nodes[num++] = n;
+    bt->count++;
+  }
+  
+  bt->root = LinkNodes(nodes, num);
+  MemFree(nodes, max * sizeof(*nodes), mem_other);
+  CheckIndex(bt, MIN_INDEX);
+  return ret;
+  
+ err:
+  return -1;
+}
+
+/* Removes the keys of src from bt, if rm is NULL or returns 1 for
+ * them.  The kept nodes are relinked like in BinaryTreeUnion. */
+int BinaryTreeDifference(struct binary_tree_t *bt, const struct binary_tree_t *src, int (*rm)(const char *key, void *data, const void *src_data, void *ref), void *ref) {
+  struct binary_tree_iterator_t bti, sbti;
+  struct node_t **nodes, *n;
+  const char *key, *skey;
+  size_t num, max;
+  int cmp, ret = 0, r;
+  
+  if (bt == src) {
+    fprintf(stderr, "Cannot take the difference of a binary tree with itself\n");
+    goto err;
+  }
+  
+  if (bt->count == 0 || src->count == 0)
+    return 0;
+  
+  if (UnshareBinaryTree(bt) < 0)
+    goto err;
+  
+  max = bt->count;
+  if ((nodes = MemAlloc(max * sizeof(*nodes), mem_other)) == NULL) {
+    fprintf(stderr, "Cannot allocate memory for binary tree difference\n");
+    goto err;
+  }
+  
+  num = 0;
+  BinaryTreeIteratorInit(&bti, bt);
+  BinaryTreeIteratorInit(&sbti, src);
+  BinaryTreeIteratorNext(&bti);
+  BinaryTreeIteratorNext(&sbti);
+  while ((key = BinaryTreeIteratorKey(&bti))) {
+    skey = ret < 0 ? NULL : BinaryTreeIteratorKey(&sbti);
+    
+    if ((cmp = CompareKeys(key, skey)) > 0) {
+      BinaryTreeIteratorNext(&sbti);
+      continue;
+    }
+    
+    n = IteratorNode(&bti);
+    BinaryTreeIteratorNext(&bti);
+    r = 0;
+    if (cmp == 0) {
+      r = rm ? rm(key, n->data, BinaryTreeIteratorData(&sbti), ref) : 1;
+      BinaryTreeIteratorNext(&sbti);
+    }
+    
+    if (r <= 0) {
+      if (r < 0)
+	ret = -1;
+      nodes[num++] = n;
+      continue;
+    }
+    
+    bt->count--;
+    IndexRemove(bt, n->key);
+    RemoveNode(bt, n);
+  }
+  
+  bt->root = LinkNodes(nodes, num);
+  MemFree(nodes, max * sizeof(*nodes), mem_other);
+  return ret;
+  
+ err:
+  return -1;
+}
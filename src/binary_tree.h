@@ -36,21 +36,44 @@ struct binary_tree_t;
 struct binary_tree_t *NewBinaryTree(void *(*copy_func)(const void *), void (*free_func)(void *));
 void FreeBinaryTree(struct binary_tree_t *bt);
 struct binary_tree_t *CopyBinaryTree(const struct binary_tree_t *bt);
+int BinaryTreeInArena(const struct binary_tree_t *bt);
+int UnshareBinaryTree(struct binary_tree_t *bt);
+void BinaryTreeFreeze(struct binary_tree_t *bt);
+void BinaryTreeThaw(struct binary_tree_t *bt);
 
 size_t BinaryTreeCount(const struct binary_tree_t *bt);
 int BinaryTreeInsert(struct binary_tree_t *bt, const char *key, void *data);
 const void *BinaryTreeLookup(const struct binary_tree_t *bt, const char *key, int *is_present);
+void *BinaryTreeLookupMutable(struct binary_tree_t *bt, const char *key, int *is_present);
+const void *BinaryTreeLookupAtom(const struct binary_tree_t *bt, const char *atom, int *is_present);
+void *BinaryTreeLookupAtomMutable(struct binary_tree_t *bt, const char *atom, int *is_present);
 int BinaryTreeRemove(struct binary_tree_t *bt, const char *key);
+int BinaryTreeUnion(struct binary_tree_t *bt, const struct binary_tree_t *src, int (*merge)(const char *key, void **data, const void *src_data, void *ref), void *ref);
+int BinaryTreeDifference(struct binary_tree_t *bt, const struct binary_tree_t *src, int (*rm)(const char *key, void *data, const void *src_data, void *ref), void *ref);
 int BinaryTreeVerify(struct binary_tree_t *bt); /* For test */
 void BinaryTreeForeach(struct binary_tree_t *bt, void (*func)(const char *, void **, void *), void *ref_data);
 
-struct binary_tree_iterator_t;
+/* The height of a tree is bounded by the number of bits in its count */
+#define BT_STACK_SZ (sizeof(size_t) * 8 + 3)
+
+struct node_t;
+
+/* May be declared by the caller and set up with BinaryTreeIteratorInit,
+ * which makes no allocation */
+struct binary_tree_iterator_t {
+  const struct binary_tree_t *bt;
+  int depth;
+  struct node_t *stack[BT_STACK_SZ];
+};
+
+void BinaryTreeIteratorInit(struct binary_tree_iterator_t *bti, const struct binary_tree_t *bt);
 struct binary_tree_iterator_t *NewBinaryTreeIterator(const struct binary_tree_t *bt);
 void FreeBinaryTreeIterator(struct binary_tree_iterator_t *bti);
 void BinaryTreeIteratorReset(struct binary_tree_iterator_t *bti);
 int BinaryTreeIteratorNext(struct binary_tree_iterator_t *bti);
 const char *BinaryTreeIteratorKey(struct binary_tree_iterator_t *bti);
 const void *BinaryTreeIteratorData(struct binary_tree_iterator_t *bti);
+void *BinaryTreeIteratorDataMutable(struct binary_tree_iterator_t *bti, struct binary_tree_t *bt);
 void BinaryTreeIteratorSetData(struct binary_tree_iterator_t *bti, void *data);
 
 #endif
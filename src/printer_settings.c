@@ -28,50 +28,128 @@
   POSSIBILITY OF SUCH DAMAGE.
 */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_CREATE)
+#include <pthread.h>
+#define USE_THREADS
+#endif
 
 #include "printer_settings.h"
 #include "ps_path.h"
 #include "ps_parse_json.h"
 #include "ps_eval.h"
 #include "ps_math.h"
-
-struct merge_t {
-  struct ps_value_t *target;
-  char *forbid;
+#include "ps_arena.h"
+#include "ps_frozen.h"
+#include "ps_snapshot.h"
+#include "ps_watch.h"
+
+/* Members of the definition that are looked up for every setting */
+enum {
+  k_set,
+  k_global,
+  k_eval,
+  k_value,
+  k_default,
+  k_type,
+  k_trigger,
+  k_spe,
+  k_num
 };
 
-static void MergeMember(const char *key, struct ps_value_t **v, void *ref) {
-  struct merge_t *merge = (struct merge_t *) ref;
-  struct ps_value_t *mem2, *copy;
-  const struct ps_value_t *mem;
-  struct merge_t mm;
-  
-  if (merge->forbid && strcmp(key, merge->forbid) == 0)
-    return;
+static const char *key_names[k_num] =
+  {"#set", "#global", "#eval", "value", "default_value", "type", "#trigger", "settable_per_extruder"};
+
+static const struct ps_key_t *keys[k_num];
+
+/* Several threads may call PS_New for the first time at once */
+static int InitKeys(void) {
+  int count, ret = 0;
   
-  if ((mem = PS_GetMember(merge->target, key, NULL)) == NULL) {
-    if ((copy = PS_CopyValue(*v)) == NULL)
-      return;
-    if (PS_AddMember(merge->target, key, copy) < 0)
-      PS_FreeValue(copy);
-    return;
+  LockShared(lock_cache);
+  for (count = 0; count < k_num; count++) {
+    if (keys[count] == NULL && (keys[count] = PS_KeyHandle(key_names[count])) == NULL) {
+      ret = -1;
+      break;
+    }
   }
+  UnlockShared(lock_cache);
   
-  if (PS_GetType(mem) != t_object || PS_GetType(*v) != t_object)
-    return;
+  return ret;
+}
+
+/* Members of v are added to those already there, objects are merged
+ * member by member.  ref names a member that is not merged. */
+static int MergeMember(const char *key, struct ps_value_t **memb, const struct ps_value_t *v, void *ref) {
+  const char *forbid = (const char *) ref;
   
-  if ((mem2 = PS_CopyValue(mem)) == NULL)
-    return;
+  if (forbid && strcmp(key, forbid) == 0)
+    return 0;
+  
+  if (*memb == NULL)
+    return (*memb = CopyOutValue(v)) == NULL ? -1 : 0;
+  
+  if (PS_GetType(*memb) != t_object || PS_GetType(v) != t_object)
+    return 0;
+  
+  return PS_UnionObject(*memb, v, MergeMember, ref);
+}
+
+/* Setting properties that are loaded, the rest (label, description,
+ * unit, ...) are only of use to a user interface */
+static const char *used_props[] =
+  {"value", "default_value", "type", "settable_per_extruder", "children"};
+
+static int IsKey(const char *key, const char *name) {
+  return key && strcmp(key, name) == 0;
+}
+
+static int IsUsedProp(const char *key) {
+  size_t count;
+  
+  for (count = 0; count < sizeof(used_props) / sizeof(used_props[0]); count++)
+    if (IsKey(key, used_props[count]))
+      return 1;
+  
+  return 0;
+}
+
+/* Filters the members of a definition file.  Settings are found in
+ * settings -> name (-> children -> name)* and overrides -> name, the
+ * members of which are setting properties. */
+static int KeepDefinitionMember(const char *const *path, size_t depth, void *ref) {
+  size_t count;
+  
+  (void) ref;
+  
+  if (depth < 3)
+    return 1;
+  
+  if (IsKey(path[0], "overrides"))
+    return depth > 3 || IsUsedProp(path[2]);
+  
+  if (!IsKey(path[0], "settings"))
+    return 1;
+  
+  for (count = 2; count < depth - 1; count += 2)
+    if (!IsKey(path[count], "children"))
+      return 1;
+  
+  if (count != depth - 1)
+    return 1;
   
-  mm.target = mem2;
-  mm.forbid = merge->forbid;
-  PS_ValueForeach(*v, MergeMember, &mm);
-  PS_AddMember(merge->target, key, mem2);
+  return IsUsedProp(path[depth - 1]);
 }
 
 struct index_t {
@@ -82,7 +160,6 @@ struct index_t {
 static void BuildIndex(const char *key, struct ps_value_t **data, void *ref) {
   struct index_t *index = (struct index_t *) ref;
   const struct ps_value_t *ovmem, *child;
-  struct merge_t merge;
   struct ps_value_t *copy;
   
   if ((ovmem = PS_GetMember(index->ov, key, NULL)))
@@ -93,9 +170,10 @@ static void BuildIndex(const char *key, struct ps_value_t **data, void *ref) {
   if (copy == NULL)
     return;
   
-  merge.target = copy;
-  merge.forbid = "children";
-  PS_ValueForeach(*data, MergeMember, &merge);
+  if (PS_UnionObject(copy, *data, MergeMember, "children") < 0) {
+    PS_FreeValue(copy);
+    return;
+  }
   
   if ((child = PS_GetMember(*data, "children", NULL)))
     PS_ValueForeach(child, BuildIndex, ref);
@@ -136,53 +214,380 @@ static int IndexSettings(struct ps_value_t *pdef) {
   return -1;
 }
 
-static struct ps_value_t *LoadFileChain(const char *file, const struct ps_value_t *search) {
-  struct ps_value_t *final, *pdef, *v, *str;
-  struct merge_t merge;
+/* Appends [path, mtime, size, misses] of a loaded definition file to
+ * files, so snapshots can tell whether it has changed or whether a file
+ * was added at one of the misses, the paths searched before it */
+static int AddFileInfo(struct ps_value_t *files, const struct stat *st, const struct ps_value_t *final, const char *file, const struct ps_value_t *ext, const struct ps_value_t *search) {
+  struct ps_value_t *info, *v;
+  
+  if ((info = PS_NewListCap(4)) == NULL)
+    goto err;
+  
+  if ((v = PS_PathToString(final)) == NULL)
+    goto err2;
+  if (PS_AppendToList(info, v) < 0)
+    goto err3;
+  if (PS_AppendToList(info, PS_NewInteger(st->st_mtime)) < 0)
+    goto err2;
+  if (PS_AppendToList(info, PS_NewInteger(st->st_size)) < 0)
+    goto err2;
+  if (PS_AppendToList(info, PS_SearchMisses(file, ext, search, final)) < 0)
+    goto err2;
+  
+  if (PS_AppendToList(files, info) < 0)
+    goto err2;
+  
+  return 0;
+  
+ err3:
+  PS_FreeValue(v);
+ err2:
+  PS_FreeValue(info);
+ err:
+  return -1;
+}
+
+/* Parsed definition files are kept frozen, by path, for later loads.
+ * Each entry is [dev, ino, mtime, ctime, size, definition, watched,
+ * users].
+ * Printers copy what they use out of a definition, and users counts
+ * the cache and the loads still reading it, so the last of them frees
+ * a definition that was replaced or forgotten.  While watching,
+ * entries that are watched are used without checking the file, until
+ * it changes. */
+static struct ps_value_t *def_cache;
+static unsigned long num_changes;
+
+enum {
+  c_dev,
+  c_ino,
+  c_mtime,
+  c_ctime,
+  c_size,
+  c_def,
+  c_watched,
+  c_users,
+  c_num
+};
+
+/* Any write to a file moves its ctime on, even one that keeps the size
+ * and sets the old mtime back */
+static int64_t ChangeTime(const struct stat *st) {
+#ifdef HAVE_STRUCT_STAT_ST_CTIM
+  return (int64_t) st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+#else
+  return (int64_t) st->st_ctime * 1000000000;
+#endif
+}
+
+static int IsSameFile(const struct ps_value_t *ent, const struct stat *st) {
+  return
+    PS_AsInteger(PS_GetItem(ent, c_dev)) == (int64_t) st->st_dev &&
+    PS_AsInteger(PS_GetItem(ent, c_ino)) == (int64_t) st->st_ino &&
+    PS_AsInteger(PS_GetItem(ent, c_mtime)) == (int64_t) st->st_mtime &&
+    PS_AsInteger(PS_GetItem(ent, c_ctime)) == ChangeTime(st) &&
+    PS_AsInteger(PS_GetItem(ent, c_size)) == (int64_t) st->st_size;
+}
+
+/* Freezes def into a new entry with one user, the caller.  def is freed
+ * on failure. */
+static struct ps_value_t *NewEntry(const struct stat *st, struct ps_value_t *def) {
+  struct ps_value_t *ent;
+  
+  if ((ent = PS_NewListCap(c_num)) == NULL)
+    goto err;
+  
+  if (PS_AppendToList(ent, PS_NewInteger(st->st_dev)) < 0 ||
+      PS_AppendToList(ent, PS_NewInteger(st->st_ino)) < 0 ||
+      PS_AppendToList(ent, PS_NewInteger(st->st_mtime)) < 0 ||
+      PS_AppendToList(ent, PS_NewInteger(ChangeTime(st))) < 0 ||
+      PS_AppendToList(ent, PS_NewInteger(st->st_size)) < 0)
+    goto err2;
+  if (PS_AppendToList(ent, def) < 0)
+    goto err2;
+  if (PS_AppendToList(ent, PS_NewBoolean(0)) < 0 ||
+      PS_AppendToList(ent, PS_NewInteger(1)) < 0 ||
+      PS_Freeze(def) < 0)
+    goto err3;
+  
+  return ent;
+  
+ err2:
+  PS_FreeValue(def);
+ err3:
+  PS_FreeValue(ent);
+ err:
+  return NULL;
+}
+
+static void AddUsers(struct ps_value_t *ent, int64_t add) {
+  PS_SetItem(ent, c_users, PS_NewInteger(PS_AsInteger(PS_GetItem(ent, c_users)) + add));
+}
+
+/* Callers hold lock_cache, with no arena active */
+static struct ps_value_t *UseEntry(struct ps_value_t *ent) {
+  AddUsers(ent, 1);
+  return PS_AddRef(ent);
+}
+
+/* Callers hold lock_cache, with no arena active */
+static void ReleaseEntry(struct ps_value_t *ent) {
+  struct ps_value_t *def;
+  
+  AddUsers(ent, -1);
+  if (PS_AsInteger(PS_GetItem(ent, c_users)) == 0) {
+    def = (struct ps_value_t *) PS_GetItem(ent, c_def);
+    /* Frozen, so not freed with the entry */
+    PS_SetItem(ent, c_def, PS_NewNull());
+    FreeFrozenValue(def);
+  }
+  PS_FreeValue(ent);
+}
+
+/* Releases an entry from FindDefinition, FindWatched or LoadDefinition */
+static void ReleaseDefinition(struct ps_value_t *ent) {
+  int depth;
+  
+  depth = ArenaSuspend();
+  LockShared(lock_cache);
+  ReleaseEntry(ent);
+  UnlockShared(lock_cache);
+  ArenaResume(depth);
+}
+
+/* Callers hold lock_cache */
+static void UncacheDefinition(const char *path) {
+  struct ps_value_t *ent;
+  
+  if ((ent = PS_AddRef(PS_GetMember(def_cache, path, NULL))) == NULL)
+    return;
+  
+  PS_RemoveMember(def_cache, path);
+  ReleaseEntry(ent);
+}
+
+/* Callers hold lock_cache */
+static int CacheDefinition(const char *path, struct ps_value_t *ent, int watched) {
+  if (def_cache == NULL && (def_cache = PS_NewObject()) == NULL)
+    goto err;
+  
+  UncacheDefinition(path);
+  PS_SetItem(ent, c_watched, PS_NewBoolean(watched));
+  if (PS_AddMember(def_cache, path, UseEntry(ent)) < 0)
+    goto err2;
+  
+  return 0;
+  
+ err2:
+  ReleaseEntry(ent);
+ err:
+  return -1;
+}
+
+/* Callers hold lock_cache */
+static struct ps_value_t *FindDefinition(const char *path, const struct stat *st, int watched) {
+  struct ps_value_t *ent;
+  
+  if ((ent = PS_GetMember(def_cache, path, NULL)) == NULL || !IsSameFile(ent, st))
+    return NULL;
+  
+  if (watched)
+    PS_SetItem(ent, c_watched, PS_NewBoolean(1));
+  return UseEntry(ent);
+}
+
+/* Returns the entry of the frozen definition in the file, parsed only
+ * if it is not cached or has changed since.  watched is set if the
+ * directory of the file was watched before it was opened. */
+static struct ps_value_t *LoadDefinition(FILE *in, const char *path, const struct stat *st, int watched) {
+  struct ps_value_t *def, *ent, *cached;
+  unsigned long changes;
+  int depth;
+  
+  depth = ArenaSuspend();
+  
+  LockShared(lock_cache);
+  ent = FindDefinition(path, st, watched);
+  changes = num_changes;
+  UnlockShared(lock_cache);
+  if (ent)
+    goto out;
+  
+  if ((def = PS_ParseJsonFileFiltered(in, KeepDefinitionMember, NULL)) == NULL)
+    goto out;
+  if ((ent = NewEntry(st, def)) == NULL)
+    goto out;
+  
+  /* Another thread may have parsed the same file meanwhile */
+  LockShared(lock_cache);
+  if ((cached = FindDefinition(path, st, 0))) {
+    ReleaseEntry(ent);
+    ent = cached;
+  } else {
+    /* Not caching only costs the next load.  A change seen while
+     * parsing may have been to this file. */
+    CacheDefinition(path, ent, watched && changes == num_changes);
+  }
+  UnlockShared(lock_cache);
+  
+ out:
+  ArenaResume(depth);
+  return ent;
+}
+
+static int IsUnder(const char *path, const char *dir, const char *name) {
+  size_t len = strlen(dir);
+  
+  if (strncmp(path, dir, len) != 0)
+    return 0;
+  
+  return name == NULL || strcmp(path + len, name) == 0;
+}
+
+/* Drops the cached definition of dir/name, or stops trusting those
+ * under dir, or all of them if dir is NULL, so they are checked again.
+ * Callers hold lock_cache. */
+static void ForgetDefinitions(const char *dir, const char *name) {
+  struct ps_value_iterator_t vi;
+  struct ps_value_t *path;
+  
+  if (dir && name) {
+    if ((path = PS_NewString(dir)) && PS_AppendToString(path, name) == 0) {
+      UncacheDefinition(PS_GetString(path));
+      PS_FreeValue(path);
+      return;
+    }
+    PS_FreeValue(path);
+    dir = NULL;
+  }
+  
+  if (def_cache == NULL || PS_InitValueIterator(&vi, def_cache) < 0)
+    return;
+  
+  while (PS_ValueIteratorNext(&vi))
+    if (dir == NULL || IsUnder(PS_ValueIteratorKey(&vi), dir, NULL))
+      PS_SetItem(PS_ValueIteratorData(&vi), c_watched, PS_NewBoolean(0));
+}
+
+/* While watching, the definition of file is found from the index of
+ * the search path and the cache alone, without any system call */
+static struct ps_value_t *FindWatched(const char *file, const struct ps_value_t *ext, const struct ps_value_t *search, struct ps_value_t *files) {
+  struct ps_value_t *final, *path, *ent, *found = NULL;
+  struct stat st;
+  int depth;
+  
+  if ((final = PS_FindSearch(file, ext, search)) == NULL)
+    return NULL;
+  if ((path = PS_PathToString(final)) == NULL)
+    goto done;
+  
+  depth = ArenaSuspend();
+  LockShared(lock_cache);
+  if ((ent = PS_GetMember(def_cache, PS_GetString(path), NULL)) &&
+      PS_AsBoolean(PS_GetItem(ent, c_watched))) {
+    memset(&st, 0, sizeof(st));
+    st.st_mtime = PS_AsInteger(PS_GetItem(ent, c_mtime));
+    st.st_size = PS_AsInteger(PS_GetItem(ent, c_size));
+    found = UseEntry(ent);
+  }
+  UnlockShared(lock_cache);
+  ArenaResume(depth);
+  
+  if (found && AddFileInfo(files, &st, final, file, ext, search) < 0) {
+    ReleaseDefinition(found);
+    found = NULL;
+  }
+  
+  PS_FreeValue(path);
+ done:
+  PS_FreeValue(final);
+  return found;
+}
+
+/* Merges the definition files of file and those it inherits from */
+static struct ps_value_t *ReadFileChain(const char *file, const struct ps_value_t *search, struct ps_value_t *files) {
+  struct ps_value_t *final, *pdef, *str, *path, *ent, *inherits = NULL;
+  const struct ps_value_t *v;
+  struct stat st;
   FILE *in;
+  int watched;
 
-  v = NULL;
-  final = NULL;
   if ((pdef = PS_NewObject()) == NULL)
     goto err;
   if ((str = PS_NewString(".def.json")) == NULL)
     goto err2;
   
   while (file) {
+    if (WatchActive() && (ent = FindWatched(file, str, search, files)))
+      goto merge;
+    
     if ((in = PS_OpenSearch(file, "r", str, search, &final)) == NULL)
       goto err3;
-    PS_FreeValue(v);
-    if ((v = PS_ParseJsonFile(in)) == NULL)
+    /* Changes from here on are seen */
+    watched = WatchActive() && WatchDirectory(PS_GetString(PS_GetMember(final, "directory", NULL))) == 0;
+    if (fstat(fileno(in), &st) < 0) {
+      perror("Cannot stat definition file");
+      goto err4;
+    }
+    if (AddFileInfo(files, &st, final, file, str, search) < 0)
+      goto err4;
+    if ((path = PS_PathToString(final)) == NULL)
+      goto err4;
+    ent = LoadDefinition(in, PS_GetString(path), &st, watched);
+    PS_FreeValue(path);
+    PS_FreeValue(final);
+    fclose(in);
+    if (ent == NULL)
+      goto err3;
+    
+  merge:
+    v = PS_GetItem(ent, c_def);
+    PS_FreeValue(inherits);
+    inherits = NULL;
+    if (PS_UnionObject(pdef, v, MergeMember, NULL) < 0 ||
+	((file = PS_GetString(PS_GetMember(v, "inherits", NULL))) &&
+	 (inherits = PS_NewString(file)) == NULL)) {
+      ReleaseDefinition(ent);
       goto err3;
-    merge.target = pdef;
-    merge.forbid = NULL;
-    PS_ValueForeach(v, MergeMember, &merge);
-    file = PS_GetString(PS_GetMember(v, "inherits", NULL));
+    }
+    ReleaseDefinition(ent);
+    file = PS_GetString(inherits);
   }
 
-  if (IndexSettings(pdef) < 0)
-    goto err2;
-  
   PS_FreeValue(str);
-  PS_FreeValue(final);
-  PS_FreeValue(v);
   return pdef;
   
+ err4:
+  PS_FreeValue(final);
+  fclose(in);
  err3:
+  PS_FreeValue(inherits);
   PS_FreeValue(str);
  err2:
   PS_FreeValue(pdef);
  err:
-  PS_FreeValue(final);
-  PS_FreeValue(v);
   return NULL;
 }
 
+static struct ps_value_t *LoadFileChain(const char *file, const struct ps_value_t *search, struct ps_value_t *files) {
+  struct ps_value_t *pdef;
+  
+  if ((pdef = ReadFileChain(file, search, files)) == NULL)
+    return NULL;
+  
+  if (IndexSettings(pdef) < 0) {
+    PS_FreeValue(pdef);
+    return NULL;
+  }
+  
+  return pdef;
+}
+
 static void CopySettablePerExtruder(const char *key, struct ps_value_t **data, void *ref_data) {
   struct ps_value_t *ext = (struct ps_value_t *) ref_data;
   struct ps_value_t *spe, *cp;
 
-  if ((spe = PS_GetMember(*data, "settable_per_extruder", NULL)) == NULL)
+  if ((spe = PS_GetMemberKey(*data, keys[k_spe], NULL)) == NULL)
     return;
 
   if (!PS_AsBoolean(spe))
@@ -196,57 +601,196 @@ static void CopySettablePerExtruder(const char *key, struct ps_value_t **data, v
     return;
   }
   
-  if (PS_AddMember(PS_GetMember(ext, "#set", NULL), key, cp) < 0) {
+  if (PS_AddMember(PS_GetMemberKey(ext, keys[k_set], NULL), key, cp) < 0) {
     PS_FreeValue(cp);
     fprintf(stderr, "Could not insert settable_per_extruder value\n");
     return;
   }
 }
 
-struct ext_ref {
+/* Number of threads that load extruder definitions, including the
+ * thread calling PS_New */
+static size_t load_threads = 1;
+
+struct ext_job_t {
+  const char *key;
+  const char *file;
   struct ps_value_t *search;
+  struct ps_value_t *files;
   struct ps_value_t *def;
 };
 
-static void LoadExtruder(const char *key, struct ps_value_t **data, void *ref_data) {
-  struct ext_ref *ref = (struct ext_ref *) ref_data;
-  struct ps_value_t *v;
+/* Extruders are loaded by the threads, and the caller once it is done
+ * with the machine definition, each taking the next job */
+struct ext_load_t {
+  struct ext_job_t *jobs;
+  size_t num_jobs;
+  size_t next;
+#ifdef USE_THREADS
+  pthread_t *threads;
+#endif
+  size_t num_threads;
+};
+
+static void *RunJobs(void *ref) {
+  struct ext_load_t *load = (struct ext_load_t *) ref;
+  struct ext_job_t *job;
+  
+  while (1) {
+    LockShared(lock_job);
+    job = load->next < load->num_jobs ? &load->jobs[load->next++] : NULL;
+    UnlockShared(lock_job);
+    if (job == NULL)
+      break;
+    
+    job->def = LoadFileChain(job->file, job->search, job->files);
+  }
+  
+  return NULL;
+}
+
+/* Threads get their own copy of the search path, as copying values
+ * touches their reference counts */
+static struct ps_value_t *CopySearch(const struct ps_value_t *search) {
+  struct ps_value_t *copy;
+  size_t count;
+  
+  if (search == NULL)
+    return NULL;
+  
+  if ((copy = PS_NewListCap(PS_ItemCount(search))) == NULL)
+    return NULL;
+  
+  for (count = 0; count < PS_ItemCount(search); count++) {
+    if (PS_AppendToList(copy, PS_NewString(PS_GetString(PS_GetItem(search, count)))) < 0) {
+      PS_FreeValue(copy);
+      return NULL;
+    }
+  }
+  
+  return copy;
+}
+
+static void StartThreads(struct ext_load_t *load) {
+#ifdef USE_THREADS
+  size_t num;
+  
+  if (load_threads <= 1 || ArenaActive())
+    return;
+  
+  num = load_threads - 1;
+  if (num > load->num_jobs)
+    num = load->num_jobs;
   
-  if ((v = LoadFileChain(PS_GetString(*data), ref->search)) == NULL)
+  if ((load->threads = MemAlloc(load->num_jobs * sizeof(*load->threads), mem_other)) == NULL)
     return;
   
-  PS_ValueForeach(PS_GetMember(PS_GetMember(ref->def, "#global", NULL), "#set", NULL),
-		  CopySettablePerExtruder,
-		  v);
+  for (load->num_threads = 0; load->num_threads < num; load->num_threads++)
+    if (pthread_create(&load->threads[load->num_threads], NULL, RunJobs, load) != 0)
+      break;
+  
+  if (load->num_threads == 0)
+    MemFree(load->threads, load->num_jobs * sizeof(*load->threads), mem_other);
+#endif
+}
+
+static int StartExtruders(struct ext_load_t *load, const struct ps_value_t *trains, const struct ps_value_t *search) {
+  struct ps_value_iterator_t vi;
+  struct ext_job_t *job;
+  
+  memset(load, 0, sizeof(*load));
+  if ((load->jobs = MemAlloc(PS_ItemCount(trains) * sizeof(*load->jobs), mem_other)) == NULL)
+    goto err;
+  
+  if (PS_InitValueIterator(&vi, trains) < 0)
+    goto err2;
+  while (PS_ValueIteratorNext(&vi)) {
+    job = &load->jobs[load->num_jobs];
+    job->key = PS_ValueIteratorKey(&vi);
+    job->file = PS_GetString(PS_ValueIteratorData(&vi));
+    job->search = NULL;
+    job->def = NULL;
+    if ((job->files = PS_NewList()) == NULL)
+      goto err2;
+    if (search && (job->search = CopySearch(search)) == NULL) {
+      PS_FreeValue(job->files);
+      goto err2;
+    }
+    load->num_jobs++;
+  }
+  
+  StartThreads(load);
+  return 0;
   
-  if (PS_AddMember(ref->def, key, v) < 0)
-    PS_FreeValue(v);
+ err2:
+  while (load->num_jobs > 0) {
+    job = &load->jobs[--load->num_jobs];
+    PS_FreeValue(job->files);
+    PS_FreeValue(job->search);
+  }
+  MemFree(load->jobs, PS_ItemCount(trains) * sizeof(*load->jobs), mem_other);
+ err:
+  return -1;
+}
+
+/* Waits for the extruders and adds them to ps in order, or discards
+ * them if ps is NULL */
+static void FinishExtruders(struct ext_load_t *load, const struct ps_value_t *trains, struct ps_value_t *ps, struct ps_value_t *files) {
+  struct ext_job_t *job;
+  size_t count, idx;
+  
+  RunJobs(load);
+  
+#ifdef USE_THREADS
+  if (load->num_threads > 0) {
+    for (count = 0; count < load->num_threads; count++)
+      pthread_join(load->threads[count], NULL);
+    MemFree(load->threads, load->num_jobs * sizeof(*load->threads), mem_other);
+  }
+#endif
+  
+  for (count = 0; count < load->num_jobs; count++) {
+    job = &load->jobs[count];
+    if (ps && job->def) {
+      PS_ValueForeach(PS_GetMemberKey(PS_GetMemberKey(ps, keys[k_global], NULL), keys[k_set], NULL),
+		      CopySettablePerExtruder,
+		      job->def);
+      if (PS_AddMember(ps, job->key, job->def) < 0)
+	PS_FreeValue(job->def);
+    } else {
+      PS_FreeValue(job->def);
+    }
+    
+    for (idx = 0; ps && idx < PS_ItemCount(job->files); idx++)
+      PS_AppendCopyToList(files, PS_GetItem(job->files, idx));
+    PS_FreeValue(job->files);
+    PS_FreeValue(job->search);
+  }
+  
+  MemFree(load->jobs, PS_ItemCount(trains) * sizeof(*load->jobs), mem_other);
 }
 
 static struct ps_value_t *NewDepend(const struct ps_value_t *ps) {
   struct ps_value_t *dep, *v;
-  struct ps_value_iterator_t *vi;
+  struct ps_value_iterator_t vi;
   
   if ((dep = PS_NewObject()) == NULL)
     goto err;
   
-  if ((vi = PS_NewValueIterator(ps)) == NULL)
+  if (PS_InitValueIterator(&vi, ps) < 0)
     goto err2;
   
-  while (PS_ValueIteratorNext(vi)) {
+  while (PS_ValueIteratorNext(&vi)) {
     if ((v = PS_NewObject()) == NULL)
+      goto err2;
+    if (PS_AddMember(dep, PS_ValueIteratorKey(&vi), v) < 0)
       goto err3;
-    if (PS_AddMember(dep, PS_ValueIteratorKey(vi), v) < 0)
-      goto err4;
   }
 
-  PS_FreeValueIterator(vi);
   return dep;
 
- err4:
-  PS_FreeValue(v);
  err3:
-  PS_FreeValueIterator(vi);
+  PS_FreeValue(v);
  err2:
   PS_FreeValue(dep);
  err:
@@ -255,24 +799,24 @@ static struct ps_value_t *NewDepend(const struct ps_value_t *ps) {
 }
 
 static int AddTriggers(struct ps_value_t *ps, const struct ps_value_t *dep, const char *ext, const char *name) {
-  struct ps_value_iterator_t *vi_ext, *vi_set;
+  struct ps_value_iterator_t vi_ext, vi_set;
   struct ps_value_t *set, *trig, *trig_ext;
   const char *dep_ext, *dep_name;
   
-  if ((vi_ext = PS_NewValueIterator(dep)) == NULL)
+  if (PS_InitValueIterator(&vi_ext, dep) < 0)
     goto err;
   
-  while (PS_ValueIteratorNext(vi_ext)) {
-    dep_ext = PS_ValueIteratorKey(vi_ext);
+  while (PS_ValueIteratorNext(&vi_ext)) {
+    dep_ext = PS_ValueIteratorKey(&vi_ext);
     
-    if ((vi_set = PS_NewValueIterator(PS_ValueIteratorData(vi_ext))) == NULL)
-      goto err2;
+    if (PS_InitValueIterator(&vi_set, PS_ValueIteratorData(&vi_ext)) < 0)
+      goto err;
 
-    while (PS_ValueIteratorNext(vi_set)) {
-      dep_name = PS_ValueIteratorKey(vi_set);
+    while (PS_ValueIteratorNext(&vi_set)) {
+      dep_name = PS_ValueIteratorKey(&vi_set);
       
-      if ((set = PS_GetMember(PS_GetMember(PS_GetMember(ps, dep_ext, NULL), "#set", NULL), dep_name, NULL)) == NULL) {
-	if ((set = PS_GetMember(PS_GetMember(PS_GetMember(ps, "#global", NULL), "#set", NULL), dep_name, NULL)) == NULL) {
+      if ((set = PS_GetMember(PS_GetMemberKey(PS_GetMember(ps, dep_ext, NULL), keys[k_set], NULL), dep_name, NULL)) == NULL) {
+	if ((set = PS_GetMember(PS_GetMemberKey(PS_GetMemberKey(ps, keys[k_global], NULL), keys[k_set], NULL), dep_name, NULL)) == NULL) {
 	  if (!PS_CtxIsConstant(dep_name))
 	    fprintf(stderr, "Warning: Unknown dependancy %s->%s\n", dep_ext, dep_name);
 	  continue;
@@ -281,119 +825,248 @@ static int AddTriggers(struct ps_value_t *ps, const struct ps_value_t *dep, cons
 	dep_ext = "#global";
       }
       
-      if ((trig = PS_GetMember(set, "#trigger", NULL)) == NULL) {
+      if ((trig = PS_GetMemberKey(set, keys[k_trigger], NULL)) == NULL) {
 	if ((trig = PS_NewObject()) == NULL)
-	  goto err3;
+	  goto err;
 
 	if (PS_AddMember(set, "#trigger", trig) < 0) {
 	  PS_FreeValue(trig);
-	  goto err3;
+	  goto err;
 	}
       }
 
       if ((trig_ext = PS_GetMember(trig, ext, NULL)) == NULL) {
 	if ((trig_ext = PS_NewObject()) == NULL)
-	  goto err3;
+	  goto err;
 
 	if (PS_AddMember(trig, ext, trig_ext) < 0) {
 	  PS_FreeValue(trig_ext);
-	  goto err3;
+	  goto err;
 	}
       }
       
       if (PS_AddMember(trig_ext, name, PS_NewBoolean(1)) < 0)
-	goto err3;
+	goto err;
     }
-    
-    PS_FreeValueIterator(vi_set);
   }
   
-  PS_FreeValueIterator(vi_ext);
   return 0;
 
- err3:
-  PS_FreeValueIterator(vi_set);
- err2:
-  PS_FreeValueIterator(vi_ext);
  err:
   return -1;
 }
 
 static int BuildDeps(struct ps_value_t *ps) {
-  struct ps_value_iterator_t *vi_ext, *vi_set;
+  struct ps_value_iterator_t vi_ext, vi_set;
   struct ps_value_t *set, *v, *expr, *dep;
   const char *ext;
   
-  if ((vi_ext = PS_NewValueIterator(ps)) == NULL)
+  if (PS_InitValueIterator(&vi_ext, ps) < 0)
     goto err;
   
-  while (PS_ValueIteratorNext(vi_ext)) {
-    ext = PS_ValueIteratorKey(vi_ext);
+  while (PS_ValueIteratorNext(&vi_ext)) {
+    ext = PS_ValueIteratorKey(&vi_ext);
     
-    if ((vi_set = PS_NewValueIterator(PS_GetMember(PS_ValueIteratorData(vi_ext), "#set", NULL))) == NULL)
-      goto err2;
+    if (PS_InitValueIterator(&vi_set, PS_GetMemberKey(PS_ValueIteratorData(&vi_ext), keys[k_set], NULL)) < 0)
+      goto err;
 
-    while (PS_ValueIteratorNext(vi_set)) {
-      set = PS_ValueIteratorData(vi_set);
+    while (PS_ValueIteratorNext(&vi_set)) {
+      set = PS_ValueIteratorData(&vi_set);
       
-      if ((v = PS_GetMember(set, "value", NULL)) == NULL)
+      if ((v = PS_GetMemberKey(set, keys[k_value], NULL)) == NULL)
 	continue;
       
       if ((dep = NewDepend(ps)) == NULL)
-	goto err3;
+	goto err;
       
       if ((expr = PS_ParseForEval(v, ext, dep)) == NULL) {
 	fprintf(stderr, "Error parsing for eval '%s'\n", PS_GetString(v));
-	goto err4;
+	goto err2;
       }
       
       if (PS_AddMember(set, "#eval", expr) < 0)
-	goto err5;
+	goto err3;
       
       if (PS_AddMember(set, "#dep", dep) < 0)
-	goto err4;
+	goto err2;
 
-      if (AddTriggers(ps, dep, ext, PS_ValueIteratorKey(vi_set)) < 0)
-	goto err3;
+      if (AddTriggers(ps, dep, ext, PS_ValueIteratorKey(&vi_set)) < 0)
+	goto err;
     }
-    
-    PS_FreeValueIterator(vi_set);
   }
 
-  PS_FreeValueIterator(vi_ext);
   return 0;
 
- err5:
-  PS_FreeValue(expr);
- err4:
-  PS_FreeValue(dep);
  err3:
-  PS_FreeValueIterator(vi_set);
+  PS_FreeValue(expr);
  err2:
-  PS_FreeValueIterator(vi_ext);
+  PS_FreeValue(dep);
  err:
   return -1;
 }
 
+/* While watching, snapshots that were checked after the directories
+ * of their files were watched need not be checked again.  Each entry
+ * is [trusted, path...], by snapshot file.  Callers hold lock_cache. */
+static struct ps_value_t *checked_snapshots;
+
+static void ForgetSnapshots(const char *dir, const char *name) {
+  struct ps_value_iterator_t vi;
+  const struct ps_value_t *ent;
+  struct ps_value_t *rm;
+  const char *key;
+  size_t count;
+  int found;
+  
+  if (checked_snapshots == NULL)
+    return;
+  if (dir == NULL)
+    goto err;
+  
+  if ((rm = PS_NewList()) == NULL)
+    goto err;
+  if (PS_InitValueIterator(&vi, checked_snapshots) < 0)
+    goto err2;
+  
+  while (PS_ValueIteratorNext(&vi)) {
+    key = PS_ValueIteratorKey(&vi);
+    ent = PS_ValueIteratorData(&vi);
+    found = IsUnder(key, dir, name);
+    for (count = 1; !found && count < PS_ItemCount(ent); count++)
+      found = IsUnder(PS_GetString(PS_GetItem(ent, count)), dir, name);
+    if (found && PS_AppendToList(rm, PS_NewString(key)) < 0)
+      goto err2;
+  }
+  
+  for (count = 0; count < PS_ItemCount(rm); count++)
+    PS_RemoveMember(checked_snapshots, PS_GetString(PS_GetItem(rm, count)));
+  PS_FreeValue(rm);
+  return;
+  
+ err2:
+  PS_FreeValue(rm);
+ err:
+  PS_FreeValue(checked_snapshots);
+  checked_snapshots = NULL;
+}
+
+static void Changed(const char *dir, const char *name, int names, void *ref) {
+  int depth;
+  
+  (void) ref;
+  
+  depth = ArenaSuspend();
+  
+  if (dir == NULL)
+    PS_ClearSearchIndex();
+  else if (names || name == NULL)
+    PS_ForgetDirectory(dir);
+  
+  LockShared(lock_cache);
+  num_changes++;
+  ForgetDefinitions(dir, name);
+  ForgetSnapshots(dir, name);
+  UnlockShared(lock_cache);
+  
+  ArenaResume(depth);
+}
+
+static int WatchFileDirectory(const char *file) {
+  struct ps_value_t *p;
+  int ret;
+  
+  if ((p = PS_PathFromString(file)) == NULL)
+    return -1;
+  
+  ret = WatchDirectory(PS_GetString(PS_GetMember(p, "directory", NULL)));
+  PS_FreeValue(p);
+  return ret;
+}
+
+static int RememberPath(struct ps_value_t *ent, const char *path) {
+  if (WatchFileDirectory(path) < 0)
+    return -1;
+  
+  return PS_AppendToList(ent, PS_NewString(path));
+}
+
+/* Watches the directories of a snapshot that was checked, of its files
+ * and of the paths searched before them.  If it was already remembered,
+ * they were watched before this check, so it can be trusted from now
+ * on. */
+static void RememberSnapshot(const char *file, const struct ps_value_t *ps, int trusted, unsigned long changes) {
+  const struct ps_value_t *files, *info;
+  struct ps_value_t *ent;
+  const char *path;
+  size_t count, miss;
+  int depth;
+  
+  files = PS_GetMember(PS_GetMemberKey(ps, keys[k_global], NULL), "#files", NULL);
+  
+  depth = ArenaSuspend();
+  
+  if ((ent = PS_NewList()) == NULL)
+    goto err;
+  if (PS_AppendToList(ent, PS_NewBoolean(trusted)) < 0 ||
+      WatchFileDirectory(file) < 0)
+    goto err2;
+  
+  for (count = 0; (path = PS_GetString(PS_GetItem(info = PS_GetItem(files, count), 0))); count++) {
+    if (RememberPath(ent, path) < 0)
+      goto err2;
+    for (miss = 0; (path = PS_GetString(PS_GetItem(PS_GetItem(info, 3), miss))); miss++)
+      if (RememberPath(ent, path) < 0)
+	goto err2;
+  }
+  
+  LockShared(lock_cache);
+  if (changes != num_changes ||
+      (checked_snapshots == NULL && (checked_snapshots = PS_NewObject()) == NULL) ||
+      PS_AddMember(checked_snapshots, file, ent) < 0)
+    PS_FreeValue(ent);
+  UnlockShared(lock_cache);
+  
+  ArenaResume(depth);
+  return;
+  
+ err2:
+  PS_FreeValue(ent);
+ err:
+  ArenaResume(depth);
+}
+
+int PS_WatchDefinitions(void) {
+  if (WatchStart() < 0)
+    return -1;
+  
+  /* Directories read before were not watched */
+  PS_ClearSearchIndex();
+  return 0;
+}
+
 struct ps_value_t *PS_New(const char *printer, const struct ps_value_t *search) {
   struct ps_value_t *ps;
-  struct ps_value_t *v;
-  size_t num_extr;
+  struct ps_value_t *v, *files;
   struct ps_value_t *c;
-  struct ext_ref ref;
+  struct ext_load_t load;
 
+  if (InitKeys() < 0)
+    goto err;
+  
+  WatchChanges(Changed, NULL);
+  
   if ((ps = PS_NewObject()) == NULL)
     goto err;
   
-  if ((v = LoadFileChain(printer, search)) == NULL)
+  if ((files = PS_NewList()) == NULL)
     goto err2;
-  if (PS_AddMember(ps, "#global", v) < 0)
+  if ((v = ReadFileChain(printer, search, files)) == NULL ||
+      PS_AddMember(v, "#files", files) < 0) {
+    PS_FreeValue(files);
     goto err3;
-  
-  if (PS_AddBuiltin(PS_GetMember(PS_GetMember(ps, "#global", NULL), "#set", NULL), "default_value") < 0) {
-    fprintf(stderr, "Could not load builtin symbols\n");
-    goto err2;
   }
+  if (PS_AddMember(ps, "#global", v) < 0)
+    goto err3;
   
   if ((c = PS_GetMember(PS_GetMember(v, "metadata", NULL), "machine_extruder_trains", NULL)) == NULL) {
     fprintf(stderr, "Could not find metadata -> machine_extruder_trains in printer definition\n");
@@ -404,15 +1077,27 @@ struct ps_value_t *PS_New(const char *printer, const struct ps_value_t *search)
     goto err2;
   }
   
-  num_extr = PS_ItemCount(c);
-  if (num_extr == 0) {
+  if (PS_ItemCount(c) == 0) {
     fprintf(stderr, "At least one extruder is required\n");
     goto err2;
   }
-
-  ref.search = (struct ps_value_t *) search;
-  ref.def = ps;
-  PS_ValueForeach(c, LoadExtruder, &ref);
+  
+  /* Extruders may load while the machine settings are indexed */
+  if (StartExtruders(&load, c, search) < 0)
+    goto err2;
+  
+  if (IndexSettings(v) < 0) {
+    FinishExtruders(&load, c, NULL, NULL);
+    goto err2;
+  }
+  
+  if (PS_AddBuiltin(PS_GetMemberKey(v, keys[k_set], NULL), "default_value") < 0) {
+    fprintf(stderr, "Could not load builtin symbols\n");
+    FinishExtruders(&load, c, NULL, NULL);
+    goto err2;
+  }
+  
+  FinishExtruders(&load, c, ps, files);
   
   if (BuildDeps(ps) < 0)
     goto err2;
@@ -420,13 +1105,13 @@ struct ps_value_t *PS_New(const char *printer, const struct ps_value_t *search)
   if ((v = PS_NewString(printer)) == NULL)
     goto err2;
 
-  if (PS_AddMember(PS_GetMember(ps, "#global", NULL), "#filename", v) < 0)
+  if (PS_AddMember(PS_GetMemberKey(ps, keys[k_global], NULL), "#filename", v) < 0)
     goto err3;
 
   if ((v = PS_CopyValue(search)) == NULL)
     goto err3;
   
-  if (PS_AddMember(PS_GetMember(ps, "#global", NULL), "#search", v) < 0)
+  if (PS_AddMember(PS_GetMemberKey(ps, keys[k_global], NULL), "#search", v) < 0)
     goto err3;
   
   return ps;
@@ -439,38 +1124,104 @@ struct ps_value_t *PS_New(const char *printer, const struct ps_value_t *search)
   return NULL;
 }
 
+int PS_SetLoadThreads(size_t num) {
+#ifndef USE_THREADS
+  if (num > 1) {
+    fprintf(stderr, "Threads are not supported\n");
+    return -1;
+  }
+#endif
+  
+  load_threads = num;
+  return 0;
+}
+
+int PS_SaveSnapshot(const struct ps_value_t *ps, const char *file) {
+  const struct ps_value_t *global;
+  
+  if (ps == NULL || file == NULL || InitKeys() < 0)
+    return -1;
+  
+  global = PS_GetMemberKey(ps, keys[k_global], NULL);
+  if (PS_GetPrinter(ps) == NULL) {
+    fprintf(stderr, "Snapshots can only be saved from printer settings returned by PS_New\n");
+    return -1;
+  }
+  
+  return SaveSnapshot(file, ps, PS_GetPrinter(ps), PS_GetSearch(ps), PS_GetMember(global, "#files", NULL));
+}
+
+struct ps_value_t *PS_LoadSnapshot(const char *file, const char *printer, const struct ps_value_t *search) {
+  const struct ps_value_t *ent;
+  struct ps_value_t *ps;
+  unsigned long changes;
+  int seen, trusted;
+  
+  if (file == NULL || printer == NULL || InitKeys() < 0)
+    return NULL;
+  
+  if (!WatchActive())
+    return LoadSnapshot(file, printer, search, 1);
+  
+  WatchChanges(Changed, NULL);
+  
+  LockShared(lock_cache);
+  ent = PS_GetMember(checked_snapshots, file, NULL);
+  seen = ent != NULL;
+  trusted = PS_AsBoolean(PS_GetItem(ent, 0));
+  changes = num_changes;
+  UnlockShared(lock_cache);
+  
+  if ((ps = LoadSnapshot(file, printer, search, !trusted)) && !trusted)
+    RememberSnapshot(file, ps, seen, changes);
+  
+  return ps;
+}
+
+struct ps_value_t *PS_NewCached(const char *printer, const struct ps_value_t *search, const char *snapshot) {
+  struct ps_value_t *ps;
+  
+  if ((ps = PS_LoadSnapshot(snapshot, printer, search)))
+    return ps;
+  
+  if ((ps = PS_New(printer, search)) == NULL)
+    return NULL;
+  
+  /* Failing to save only costs the next load */
+  if (snapshot)
+    PS_SaveSnapshot(ps, snapshot);
+  return ps;
+}
+
 const char *PS_GetPrinter(const struct ps_value_t *ps) {
-  return PS_GetString(PS_GetMember(PS_GetMember(ps, "#global", NULL), "#filename", NULL));
+  return PS_GetString(PS_GetMember(PS_GetMemberKey(ps, keys[k_global], NULL), "#filename", NULL));
 }
 
 const struct ps_value_t *PS_GetSearch(const struct ps_value_t *ps) {
-  return PS_GetMember(PS_GetMember(ps, "#global", NULL), "#search", NULL);
+  return PS_GetMember(PS_GetMemberKey(ps, keys[k_global], NULL), "#search", NULL);
 }
 
 struct ps_value_t *PS_ListExtruders(const struct ps_value_t *ps) {
   struct ps_value_t *ext, *v;
-  struct ps_value_iterator_t *vi;
+  struct ps_value_iterator_t vi;
   
-  if ((ext = PS_NewList()) == NULL)
+  if ((ext = PS_NewListCap(PS_ItemCount(ps))) == NULL)
     goto err;
   
-  if ((vi = PS_NewValueIterator(ps)) == NULL)
+  if (PS_InitValueIterator(&vi, ps) < 0)
     goto err2;
   
-  while (PS_ValueIteratorNext(vi)) {
-    if ((v = PS_NewString(PS_ValueIteratorKey(vi))) == NULL)
-      goto err3;
+  while (PS_ValueIteratorNext(&vi)) {
+    if ((v = PS_NewString(PS_ValueIteratorKey(&vi))) == NULL)
+      goto err2;
     if (PS_AppendToList(ext, v) < 0)
-      goto err4;
+      goto err3;
   }
 
-  PS_FreeValueIterator(vi);
   return ext;
 
- err4:
-  PS_FreeValue(v);
  err3:
-  PS_FreeValueIterator(vi);
+  PS_FreeValue(v);
  err2:
   PS_FreeValue(ext);
  err:
@@ -481,48 +1232,41 @@ struct ps_value_t *PS_ListExtruders(const struct ps_value_t *ps) {
 struct ps_value_t *PS_GetDefaults(const struct ps_value_t *ps) {
   struct ps_value_t *c, *d;
   struct ps_value_t *g, *v, *dd;
-  struct ps_value_iterator_t *ex, *vi;
+  struct ps_value_iterator_t ex, vi;
 
   if ((g = PS_NewObject()) == NULL)
     goto err;
   
-  if ((ex = PS_NewValueIterator(ps)) == NULL)
+  if (PS_InitValueIterator(&ex, ps) < 0)
     goto err2;
 
-  while (PS_ValueIteratorNext(ex)) {
-    if ((c = PS_GetMember(PS_ValueIteratorData(ex), "#set", NULL)) == NULL)
-      goto err3;
+  while (PS_ValueIteratorNext(&ex)) {
+    if ((c = PS_GetMemberKey(PS_ValueIteratorData(&ex), keys[k_set], NULL)) == NULL)
+      goto err2;
     
     if ((v = PS_NewObject()) == NULL)
-      goto err3;
+      goto err2;
     
-    if ((vi = PS_NewValueIterator(c)) == NULL)
-      goto err4;
+    if (PS_InitValueIterator(&vi, c) < 0)
+      goto err3;
     
-    while (PS_ValueIteratorNext(vi)) {
-      if ((d = PS_GetMember(PS_ValueIteratorData(vi), "default_value", NULL)) == NULL)
+    while (PS_ValueIteratorNext(&vi)) {
+      if ((d = PS_GetMemberKey(PS_ValueIteratorData(&vi), keys[k_default], NULL)) == NULL)
 	continue;
       if ((dd = PS_CopyValue(d)) == NULL)
-	goto err5;
-      if (PS_AddMember(v, PS_ValueIteratorKey(vi), dd) < 0)
+	goto err3;
+      if (PS_AddMember(v, PS_ValueIteratorKey(&vi), dd) < 0)
 	PS_FreeValue(dd);
     }
-    PS_FreeValueIterator(vi);
 
-    if (PS_AddMember(g, PS_ValueIteratorKey(ex), v) < 0)
-      goto err4;
+    if (PS_AddMember(g, PS_ValueIteratorKey(&ex), v) < 0)
+      goto err3;
   }
 
-  PS_FreeValueIterator(ex);
-  
   return g;
   
- err5:
-  PS_FreeValueIterator(vi);
- err4:
-  PS_FreeValue(v);
  err3:
-  PS_FreeValueIterator(ex);
+  PS_FreeValue(v);
  err2:
   PS_FreeValue(g);
  err:
@@ -530,34 +1274,31 @@ struct ps_value_t *PS_GetDefaults(const struct ps_value_t *ps) {
 }
 
 const struct ps_value_t *PS_GetSettingProperties(const struct ps_value_t *ps, const char *extruder, const char *setting) {
-  return PS_GetMember(PS_GetMember(PS_GetMember(ps, extruder, NULL), "#set", NULL), setting, NULL);
+  return PS_GetMember(PS_GetMemberKey(PS_GetMember(ps, extruder, NULL), keys[k_set], NULL), setting, NULL);
 }
 
 struct ps_value_t *PS_BlankSettings(const struct ps_value_t *ps) {
   struct ps_value_t *obj, *v;
-  struct ps_value_iterator_t *vi;
+  struct ps_value_iterator_t vi;
 
   if ((obj = PS_NewObject()) == NULL)
     goto err;
   
-  if ((vi = PS_NewValueIterator(ps)) == NULL)
+  if (PS_InitValueIterator(&vi, ps) < 0)
     goto err2;
 
-  while (PS_ValueIteratorNext(vi)) {
+  while (PS_ValueIteratorNext(&vi)) {
     if ((v = PS_NewObject()) == NULL)
-      goto err3;
+      goto err2;
 
-    if (PS_AddMember(obj, PS_ValueIteratorKey(vi), v) < 0)
-      goto err4;
+    if (PS_AddMember(obj, PS_ValueIteratorKey(&vi), v) < 0)
+      goto err3;
   }
   
-  PS_FreeValueIterator(vi);
   return obj;
   
- err4:
-  PS_FreeValue(v);
  err3:
-  PS_FreeValueIterator(vi);
+  PS_FreeValue(v);
  err2:
   PS_FreeValue(obj);
  err:
@@ -584,101 +1325,43 @@ int PS_AddSetting(struct ps_value_t *set, const char *ext, const char *name, con
   return -1;
 }
 
-int PS_MergeSettings(struct ps_value_t *dest, struct ps_value_t *src) {
-  struct ps_value_t *set, *v, *mem;
-  struct ps_value_iterator_t *vi_ext, *vi_set;
-  const char *ext, *name;
+static int MergeExt(const char *ext, struct ps_value_t **memb, const struct ps_value_t *v, void *ref) {
+  (void) ext;
+  (void) ref;
   
-  if ((vi_ext = PS_NewValueIterator(src)) == NULL)
-    goto err;
-
-  while (PS_ValueIteratorNext(vi_ext)) {
-    ext = PS_ValueIteratorKey(vi_ext);
-    
-    if ((vi_set = PS_NewValueIterator(PS_ValueIteratorData(vi_ext))) == NULL)
-      goto err2;
-    
-    while (PS_ValueIteratorNext(vi_set)) {
-      name = PS_ValueIteratorKey(vi_set);
-      set = PS_ValueIteratorData(vi_set);
-      
-      if ((v = PS_CopyValue(set)) == NULL)
-	goto err3;
-      
-      if ((mem = PS_GetMember(dest, ext, NULL)) == NULL) {
-	if ((mem = PS_NewObject()) == NULL)
-	  goto err4;
-
-	if (PS_AddMember(dest, ext, mem) < 0)
-	  goto err5;
-      }
-      
-      if (PS_AddMember(mem, name, v) < 0)
-	goto err4;
-    }
-
-    PS_FreeValueIterator(vi_set);
-  }
+  if (*memb)
+    return PS_UnionObject(*memb, v, NULL, NULL);
   
-  PS_FreeValueIterator(vi_ext);
-  return 0;
+  if (PS_ItemCount(v) == 0)
+    return 0;
+  
+  return (*memb = PS_CopyValue(v)) == NULL ? -1 : 0;
+}
 
- err5:
-  PS_FreeValue(mem);
- err4:
-  PS_FreeValue(v);
- err3:
-  PS_FreeValueIterator(vi_set);
- err2:
-  PS_FreeValueIterator(vi_ext);
- err:
-  return -1;
+int PS_MergeSettings(struct ps_value_t *dest, struct ps_value_t *src) {
+  return PS_UnionObject(dest, src, MergeExt, NULL);
 }
 
-int PS_PruneSettings(struct ps_value_t *settings, const struct ps_value_t *dflt) {
-  struct ps_value_iterator_t *vi_ext, *vi_set;
-  const char *ext, *set;
-  struct ps_value_t *ve, *vs;
-  size_t count = 0;
-  
-  if ((vi_ext = PS_NewValueIterator(dflt)) == NULL)
-    goto err;
+static int IsDefault(const char *name, struct ps_value_t *memb, const struct ps_value_t *dflt, void *ref) {
+  (void) name;
+  (void) ref;
   
-  while (PS_ValueIteratorNext(vi_ext)) {
-    ext = PS_ValueIteratorKey(vi_ext);
-
-    if ((ve = PS_GetMember(settings, ext, NULL)) == NULL)
-      continue;
-    
-    if ((vi_set = PS_NewValueIterator(PS_ValueIteratorData(vi_ext))) == NULL)
-      goto err2;
+  return PS_AsBoolean(PS_Call2(PS_EQ, memb, dflt));
+}
 
-    while (PS_ValueIteratorNext(vi_set)) {
-      set = PS_ValueIteratorKey(vi_set);
-      
-      if ((vs = PS_GetMember(ve, set, NULL)) == NULL)
-	continue;
-      
-      if (PS_AsBoolean(PS_Call2(PS_EQ, vs, PS_ValueIteratorData(vi_set))))
-	PS_RemoveMember(ve, set);
-      else
-	count++;
-    }
-    
-    PS_FreeValueIterator(vi_set);
-    
-    if (PS_ItemCount(ve) == 0)
-      PS_RemoveMember(settings, ext);
-  }
+/* Extruders left without settings are removed too */
+static int PruneExt(const char *ext, struct ps_value_t *memb, const struct ps_value_t *dflt, void *ref) {
+  (void) ext;
+  (void) ref;
   
-  PS_FreeValueIterator(vi_ext);
-  
-  return 0;
+  if (PS_DifferenceObject(memb, dflt, IsDefault, NULL) < 0)
+    return -1;
   
- err2:
-  PS_FreeValueIterator(vi_ext);
- err:
-  return -1;
+  return PS_ItemCount(memb) == 0;
+}
+
+int PS_PruneSettings(struct ps_value_t *settings, const struct ps_value_t *dflt) {
+  return PS_DifferenceObject(settings, dflt, PruneExt, NULL);
 }
 
 struct queue_t {
@@ -696,7 +1379,7 @@ static int Enqueue(struct queue_t ***tail, struct ps_value_t *members, const cha
   if (PS_GetMember(PS_GetMember(members, ext, NULL), name, NULL))
     return 0;
   
-  if ((q = malloc(sizeof(*q))) == NULL)
+  if ((q = MemAlloc(sizeof(*q), mem_other)) == NULL)
     goto err;
   memset(q, 0, sizeof(*q));
 
@@ -712,7 +1395,7 @@ static int Enqueue(struct queue_t ***tail, struct ps_value_t *members, const cha
   return 0;
   
  err2:
-  free(q);
+  MemFree(q, sizeof(*q), mem_other);
  err:
   return -1;
 }
@@ -735,7 +1418,7 @@ static void Dequeue(struct queue_t **queue, struct ps_value_t *members, const ch
   printf("Preparing to eval %s->%s\n", *ext, *name);
 #endif
   
-  free(q);
+  MemFree(q, sizeof(*q), mem_other);
 }
 
 static void FreeQueue(struct queue_t *queue) {
@@ -743,7 +1426,7 @@ static void FreeQueue(struct queue_t *queue) {
 
   while (queue) {
     next = queue->next;
-    free(queue);
+    MemFree(queue, sizeof(*queue), mem_other);
     queue = next;
   }
 }
@@ -783,8 +1466,8 @@ static int CheckType(const struct ps_value_t *type, const struct ps_value_t *val
 static int EvalCtx(const struct ps_value_t *ps, struct ps_context_t *ctx) {
   struct queue_t *queue, **tail;
   struct ps_value_t *members, *result, *set, *dflt, *trig;
-  struct ps_value_iterator_t *vi_ext;
-  struct ps_value_iterator_t *vi_set;
+  struct ps_value_iterator_t vi_ext;
+  struct ps_value_iterator_t vi_set;
   const char *ext, *name;
   int count;
 
@@ -793,34 +1476,30 @@ static int EvalCtx(const struct ps_value_t *ps, struct ps_context_t *ctx) {
   if ((members = PS_BlankSettings(ps)) == NULL)
     goto err;
   
-  if ((vi_ext = PS_NewValueIterator(ps)) == NULL)
+  if (PS_InitValueIterator(&vi_ext, ps) < 0)
     goto err2;
   
-  while (PS_ValueIteratorNext(vi_ext)) {
-    ext = PS_ValueIteratorKey(vi_ext);
+  while (PS_ValueIteratorNext(&vi_ext)) {
+    ext = PS_ValueIteratorKey(&vi_ext);
     
-    if ((vi_set = PS_NewValueIterator(PS_GetMember(PS_ValueIteratorData(vi_ext), "#set", NULL))) == NULL)
-      goto err3;
+    if (PS_InitValueIterator(&vi_set, PS_GetMemberKey(PS_ValueIteratorData(&vi_ext), keys[k_set], NULL)) < 0)
+      goto err2;
 
-    while (PS_ValueIteratorNext(vi_set)) {
-      set = PS_ValueIteratorData(vi_set);
-      name = PS_ValueIteratorKey(vi_set);
+    while (PS_ValueIteratorNext(&vi_set)) {
+      set = PS_ValueIteratorData(&vi_set);
+      name = PS_ValueIteratorKey(&vi_set);
 
-      if (!PS_GetMember(set, "#eval", NULL))
+      if (!PS_GetMemberKey(set, keys[k_eval], NULL))
 	continue;
       
       if (PS_CtxIsHard(ctx, ext, name))
 	continue;
       
       if (Enqueue(&tail, members, ext, name) < 0)
-	goto err4;
+	goto err2;
     }
-    
-    PS_FreeValueIterator(vi_set);
   }
   
-  PS_FreeValueIterator(vi_ext);
-
   count = 0;
   while (queue) {
     if (count++ >= 100000) {
@@ -830,19 +1509,19 @@ static int EvalCtx(const struct ps_value_t *ps, struct ps_context_t *ctx) {
     Dequeue(&queue, members, &ext, &name);
 
     PS_CtxPush(ctx, ext);
-    set = PS_GetMember(PS_GetMember(PS_GetMember(ps, ext, NULL), "#set", NULL), name, NULL);
-    if ((result = PS_Eval(PS_GetMember(set, "#eval", NULL), ctx)) == NULL) {
+    set = PS_GetMember(PS_GetMemberKey(PS_GetMember(ps, ext, NULL), keys[k_set], NULL), name, NULL);
+    if ((result = PS_Eval(PS_GetMemberKey(set, keys[k_eval], NULL), ctx)) == NULL) {
       PS_CtxPop(ctx);
       fprintf(stderr, "Unable to evaluate expression for %s->%s\n", ext, name);
       continue;
     }
     PS_CtxPop(ctx);
     
-    dflt = PS_GetMember(set, "default_value", NULL);
+    dflt = PS_GetMemberKey(set, keys[k_default], NULL);
     if (dflt && PS_AsBoolean(PS_Call2(PS_EQ, result, dflt))) {
       PS_FreeValue(result);
       result = NULL;
-    } else if (CheckType(PS_GetMember(set, "type", NULL), result) < 0) {
+    } else if (CheckType(PS_GetMemberKey(set, keys[k_type], NULL), result) < 0) {
       fprintf(stderr, "Invalid type for %s->%s\n", ext, name);
       result = NULL;
     }
@@ -852,35 +1531,28 @@ static int EvalCtx(const struct ps_value_t *ps, struct ps_context_t *ctx) {
       goto err2;
     }
 
-    if ((trig = PS_GetMember(set, "#trigger", NULL)) == NULL)
+    if ((trig = PS_GetMemberKey(set, keys[k_trigger], NULL)) == NULL)
       continue;
     
-    if ((vi_ext = PS_NewValueIterator(trig)) == NULL)
+    if (PS_InitValueIterator(&vi_ext, trig) < 0)
       goto err2;
     
-    while (PS_ValueIteratorNext(vi_ext)) {
-      ext = PS_ValueIteratorKey(vi_ext);
+    while (PS_ValueIteratorNext(&vi_ext)) {
+      ext = PS_ValueIteratorKey(&vi_ext);
       
-      if ((vi_set = PS_NewValueIterator(PS_ValueIteratorData(vi_ext))) == NULL)
-	goto err3;
+      if (PS_InitValueIterator(&vi_set, PS_ValueIteratorData(&vi_ext)) < 0)
+	goto err2;
       
-      while (PS_ValueIteratorNext(vi_set)) {
-	if (Enqueue(&tail, members, ext, PS_ValueIteratorKey(vi_set)) < 0)
-	  goto err4;
+      while (PS_ValueIteratorNext(&vi_set)) {
+	if (Enqueue(&tail, members, ext, PS_ValueIteratorKey(&vi_set)) < 0)
+	  goto err2;
       }
-      
-      PS_FreeValueIterator(vi_set);
     }
     
-    PS_FreeValueIterator(vi_ext);
   }
   
   return 0;
     
- err4:
-  PS_FreeValueIterator(vi_set);
- err3:
-  PS_FreeValueIterator(vi_ext);
  err2:
   FreeQueue(queue);
   PS_FreeValue(members);
@@ -888,65 +1560,78 @@ static int EvalCtx(const struct ps_value_t *ps, struct ps_context_t *ctx) {
   return -1;
 }
 
-struct bcast_spe_t {
-  struct ps_value_t *ps_set;
-  struct ps_value_t *settings;
-};
-
-static void BcastSpe(const char *key, struct ps_value_t **data, void *ref_data) {
-  struct bcast_spe_t *ref = (struct bcast_spe_t *) ref_data;
-  struct ps_value_t *spe, *cp;
-  struct ps_value_iterator_t *vi;
-  const char *vi_key;
+static int SelectSpe(const char *key, struct ps_value_t **memb, const struct ps_value_t *v, void *ref) {
+  const struct ps_value_t *ps_set = (const struct ps_value_t *) ref;
   
-  if ((spe = PS_GetMember(PS_GetMember(ref->ps_set, key, NULL), "settable_per_extruder", NULL)) == NULL)
-    return;
-
-  if (!PS_AsBoolean(spe))
-    return;
+  if (!PS_AsBoolean(PS_GetMemberKey(PS_GetMember(ps_set, key, NULL), keys[k_spe], NULL)))
+    return 0;
   
-  if ((vi = PS_NewValueIterator(ref->settings)) == NULL)
-    return;
-
   fprintf(stderr, "Note: Broadcasting %s to all extruders\n", key);
-  
-  while (PS_ValueIteratorNext(vi)) {
-    vi_key = PS_ValueIteratorKey(vi);
-
-    if (strcmp(vi_key, "#global") == 0)
-      continue;
+  return (*memb = PS_CopyValue(v)) == NULL ? -1 : 0;
+}
 
-    if (PS_GetMember(PS_ValueIteratorData(vi), key, NULL))
-      continue;
+static int CopyMissing(const char *key, struct ps_value_t **memb, const struct ps_value_t *v, void *ref) {
+  (void) key;
+  (void) ref;
+  
+  if (*memb == NULL && (*memb = PS_CopyValue(v)) == NULL)
+    return -1;
+  
+  return 0;
+}
 
-    if ((cp = PS_CopyValue(*data)) == NULL) {
-      fprintf(stderr, "Could not copy value for settable_per_extruder broadcast\n");
+/* Global settings that are settable per extruder apply to every
+ * extruder that does not set them itself */
+static int BcastSpe(const struct ps_value_t *ps, struct ps_value_t *set) {
+  struct ps_value_t *spe;
+  struct ps_value_iterator_t vi;
+  const struct ps_value_t *global;
+  
+  if ((global = PS_GetMemberKey(set, keys[k_global], NULL)) == NULL)
+    return 0;
+  
+  if ((spe = PS_NewObject()) == NULL)
+    goto err;
+  
+  if (PS_UnionObject(spe, global, SelectSpe, PS_GetMemberKey(PS_GetMemberKey(ps, keys[k_global], NULL), keys[k_set], NULL)) < 0)
+    goto err2;
+  
+  if (PS_ItemCount(spe) == 0) {
+    PS_FreeValue(spe);
+    return 0;
+  }
+  
+  if (PS_InitValueIterator(&vi, set) < 0)
+    goto err2;
+  
+  while (PS_ValueIteratorNext(&vi)) {
+    if (strcmp(PS_ValueIteratorKey(&vi), "#global") == 0)
       continue;
-    }
-
-    if (PS_AddMember(PS_ValueIteratorData(vi), key, cp) < 0) {
+    
+    if (PS_UnionObject(PS_ValueIteratorData(&vi), spe, CopyMissing, NULL) < 0) {
       fprintf(stderr, "Could not insert value for settable_per_extruder broadcast\n");
-      PS_FreeValue(cp);
+      goto err2;
     }
   }
   
-  PS_FreeValueIterator(vi);
+  PS_FreeValue(spe);
+  return 0;
+  
+ err2:
+  PS_FreeValue(spe);
+ err:
+  return -1;
 }
 
-struct ps_value_t *PS_EvalAllDflt(const struct ps_value_t *ps, const struct ps_value_t *settings, const struct ps_value_t *dflt) {
+static struct ps_value_t *EvalAll(const struct ps_value_t *ps, const struct ps_value_t *settings, const struct ps_value_t *dflt) {
   struct ps_context_t *ctx;
   struct ps_value_t *set, *eval;
-  struct bcast_spe_t bcast;
-
-  if (dflt == NULL)
-    return PS_EvalAll(ps, settings);
 
   if ((set = PS_CopyValue(settings)) == NULL)
     goto err;
   
-  bcast.ps_set = PS_GetMember(PS_GetMember(ps, "#global", NULL), "#set", NULL);
-  bcast.settings = set;
-  PS_ValueForeach(PS_GetMember(set, "#global", NULL), BcastSpe, &bcast);
+  if (BcastSpe(ps, set) < 0)
+    goto err2;
   
   if ((ctx = PS_NewCtx(set, dflt)) == NULL)
     goto err2;
@@ -969,17 +1654,23 @@ struct ps_value_t *PS_EvalAllDflt(const struct ps_value_t *ps, const struct ps_v
   return NULL;
 }
 
-struct ps_value_t *PS_EvalAll(const struct ps_value_t *ps, const struct ps_value_t *settings) {
-  struct ps_value_t *dflt;
-  struct ps_value_t *eval;
+/* All temporaries of the evaluation come from an arena, only the
+ * result is copied out */
+struct ps_value_t *PS_EvalAllDflt(const struct ps_value_t *ps, const struct ps_value_t *settings, const struct ps_value_t *dflt) {
+  struct ps_value_t *eval = NULL;
   
-  if ((dflt = PS_GetDefaults(ps)) == NULL)
-    goto err;
+  if (PS_ArenaBegin() < 0)
+    return NULL;
   
-  eval = PS_EvalAllDflt(ps, settings, dflt);
-  PS_FreeValue(dflt);
-  return eval;
+  if (dflt == NULL)
+    dflt = PS_GetDefaults(ps);
+  
+  if (dflt)
+    eval = EvalAll(ps, settings, dflt);
+  
+  return PS_ArenaEnd(eval);
+}
 
- err:
-  return NULL;
+struct ps_value_t *PS_EvalAll(const struct ps_value_t *ps, const struct ps_value_t *settings) {
+  return PS_EvalAllDflt(ps, settings, NULL);
 }
@@ -0,0 +1,636 @@
+/*
+  Copyright (C) 2018 Paul Maurer
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+  
+  1. Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+  
+  2. Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+  
+  3. Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from this
+  software without specific prior written permission.
+  
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include <string.h>
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_CREATE)
+#include <pthread.h>
+#define USE_THREADS
+#endif
+
+#ifndef USE_THREADS
+#define THREAD_LOCAL
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+#define THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#error "Thread local storage is needed for the arenas"
+#endif
+
+#if defined(USE_THREADS) && !defined(__GNUC__)
+#error "Atomic operations are needed for threads"
+#endif
+
+#include "atom_table.h"
+#include "ps_arena.h"
+
+#define ALIGN 16
+#define MIN_BLOCK_SZ (16 * 1024)
+#define MAX_BLOCK_SZ (1024 * 1024)
+
+struct block_t {
+  struct block_t *next;
+  size_t size;
+  size_t used;
+  size_t pad;
+  char data[];
+};
+
+struct atom_list_t {
+  const char *atom;
+  struct atom_list_t *next;
+};
+
+struct arena_t {
+  int depth;
+  size_t next_size;
+  struct block_t *blocks;
+  struct block_t *spare;
+  struct atom_list_t *atoms;
+};
+
+#define SLAB_SZ (4 * 1024)
+#define POOL_BATCH 64
+#define MAX_POOLS 8
+
+struct pool_slab_t {
+  struct pool_slab_t *next;
+  size_t pad;
+  char data[];
+};
+
+/* Objects freed by a thread are kept on a free list of its own, and
+ * moved from and to the pool in batches */
+struct pool_cache_t {
+  struct pool_t *pool;
+  void *free;
+  size_t num;
+};
+
+/* Every thread has its own arena and pool free lists */
+static THREAD_LOCAL struct arena_t arena;
+static THREAD_LOCAL struct pool_cache_t caches[MAX_POOLS];
+static struct pool_t *pools;
+
+static void *(*allocator)(void *, size_t, size_t, void *);
+static void *alloc_data;
+static struct ps_mem_stats_t stats[mem_total + 1];
+
+#ifdef USE_THREADS
+static pthread_mutex_t locks[lock_num] = {
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_MUTEX_INITIALIZER
+};
+
+/* Frees the spare block of a thread and returns its free objects to
+ * the pools when it exits */
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+static pthread_key_t exit_key;
+static int have_exit_key;
+#endif
+
+/* The counters are changed atomically by any thread */
+static void AddBytes(struct ps_mem_stats_t *st, size_t add) {
+  size_t bytes, peak;
+  
+  bytes = ATOMIC_ADD(st->bytes, add);
+  peak = ATOMIC_LOAD(st->peak_bytes);
+  while (bytes > peak && !ATOMIC_CAS(st->peak_bytes, peak, bytes))
+    ;
+}
+
+static void AccountOne(struct ps_mem_stats_t *st, size_t old_size, size_t new_size) {
+  if (old_size == 0)
+    ATOMIC_ADD(st->num, 1);
+  if (new_size == 0)
+    ATOMIC_ADD(st->num, (size_t) -1);
+  AddBytes(st, new_size - old_size);
+}
+
+static void Account(enum ps_mem_t mem, size_t old_size, size_t new_size) {
+  AccountOne(&stats[mem], old_size, new_size);
+  AccountOne(&stats[mem_total], old_size, new_size);
+}
+
+static void *CallAllocator(void *ptr, size_t old_size, size_t new_size) {
+  if (allocator)
+    return allocator(ptr, old_size, new_size, alloc_data);
+  
+  if (new_size == 0) {
+    free(ptr);
+    return NULL;
+  }
+  
+  return realloc(ptr, new_size);
+}
+
+/* Callers hold lock_mem if an allocator is set */
+static void *Realloc(void *ptr, size_t old_size, size_t new_size, enum ps_mem_t mem) {
+  void *nptr;
+  
+  if ((nptr = CallAllocator(ptr, old_size, new_size)) == NULL && new_size > 0)
+    return NULL;
+  
+  Account(mem, old_size, new_size);
+  return nptr;
+}
+
+void LockShared(enum lock_t lock) {
+#ifdef USE_THREADS
+  pthread_mutex_lock(&locks[lock]);
+#endif
+}
+
+void UnlockShared(enum lock_t lock) {
+#ifdef USE_THREADS
+  pthread_mutex_unlock(&locks[lock]);
+#endif
+}
+
+/* Only an allocator that was set is called one thread at a time,
+ * realloc is safe for threads */
+static void *SharedRealloc(void *ptr, size_t old_size, size_t new_size, enum ps_mem_t mem) {
+  void *nptr;
+  
+  if (allocator == NULL)
+    return Realloc(ptr, old_size, new_size, mem);
+  
+  LockShared(lock_mem);
+  nptr = Realloc(ptr, old_size, new_size, mem);
+  UnlockShared(lock_mem);
+  
+  return nptr;
+}
+
+static void ReleaseThread(void);
+static void PoolRelease(struct pool_t *pool);
+
+/* Free objects that other threads keep hold the slabs of their pools */
+int PS_SetAllocator(void *(*alloc)(void *ptr, size_t old_size, size_t new_size, void *data), void *data) {
+  struct pool_t *pool;
+  int ret = -1;
+  
+  LockShared(lock_mem);
+  ReleaseThread();
+  for (pool = pools; pool; pool = pool->next)
+    PoolRelease(pool);
+  
+  if (ATOMIC_LOAD(stats[mem_total].num) > 0) {
+    fprintf(stderr, "Cannot change allocator while memory is allocated\n");
+    goto out;
+  }
+  
+  allocator = alloc;
+  alloc_data = data;
+  ret = 0;
+  
+ out:
+  UnlockShared(lock_mem);
+  return ret;
+}
+
+void PS_GetMemStats(enum ps_mem_t mem, struct ps_mem_stats_t *st) {
+  if ((unsigned) mem > mem_total) {
+    memset(st, 0, sizeof(*st));
+    return;
+  }
+  
+  st->num = ATOMIC_LOAD(stats[mem].num);
+  st->bytes = ATOMIC_LOAD(stats[mem].bytes);
+  st->peak_bytes = ATOMIC_LOAD(stats[mem].peak_bytes);
+}
+
+void *MemAlloc(size_t size, enum ps_mem_t mem) {
+  if (size == 0)
+    size = 1;
+  
+  return SharedRealloc(NULL, 0, size, mem);
+}
+
+void *MemRealloc(void *ptr, size_t old_size, size_t new_size, enum ps_mem_t mem) {
+  if (ptr == NULL)
+    return MemAlloc(new_size, mem);
+  
+  if (new_size == 0)
+    new_size = 1;
+  
+  return SharedRealloc(ptr, old_size, new_size, mem);
+}
+
+void MemFree(void *ptr, size_t size, enum ps_mem_t mem) {
+  if (ptr == NULL)
+    return;
+  
+  if (size == 0)
+    size = 1;
+  
+  SharedRealloc(ptr, size, 0, mem);
+}
+
+/* Moves memory that is used for something else now */
+void MemReclass(size_t size, enum ps_mem_t from, enum ps_mem_t to) {
+  if (size == 0)
+    size = 1;
+  
+  Account(from, size, 0);
+  Account(to, 0, size);
+}
+
+char *MemStrdup(const char *str, enum ps_mem_t mem) {
+  size_t len = strlen(str) + 1;
+  char *dup;
+  
+  if ((dup = MemAlloc(len, mem)) == NULL)
+    return NULL;
+  
+  memcpy(dup, str, len);
+  return dup;
+}
+
+int ArenaEnter(void) {
+  if (arena.depth == INT_MAX) {
+    fprintf(stderr, "Arenas nested too deeply\n");
+    return -1;
+  }
+  
+  if (arena.depth++ == 0)
+    arena.next_size = MIN_BLOCK_SZ;
+  
+  return 0;
+}
+
+int ArenaLeave(void) {
+  if (arena.depth <= 0) {
+    fprintf(stderr, "No arena to leave\n");
+    return 0;
+  }
+  
+  return --arena.depth;
+}
+
+static int CacheTake(struct pool_cache_t *cache, void **ptr);
+static void PoolPut(struct pool_t *pool, void *ptr);
+
+/* Gives back what the calling thread keeps for itself.  Callers hold
+ * lock_mem. */
+static void ReleaseThread(void) {
+  struct pool_cache_t *cache;
+  void *ptr;
+  
+  if (arena.spare) {
+    Realloc(arena.spare, sizeof(*arena.spare) + arena.spare->size, 0, mem_arena);
+    arena.spare = NULL;
+  }
+  
+  for (cache = caches; cache < caches + MAX_POOLS && cache->pool; cache++)
+    while (CacheTake(cache, &ptr))
+      PoolPut(cache->pool, ptr);
+}
+
+#ifdef USE_THREADS
+static void ExitThread(void *ptr) {
+  (void) ptr;
+  
+  LockShared(lock_mem);
+  ReleaseThread();
+  UnlockShared(lock_mem);
+}
+
+static void MakeExitKey(void) {
+  have_exit_key = pthread_key_create(&exit_key, ExitThread) == 0;
+}
+#endif
+
+/* Called once the thread keeps memory for itself */
+static void KeepForThread(void) {
+#ifdef USE_THREADS
+  pthread_once(&exit_once, MakeExitKey);
+  if (have_exit_key)
+    pthread_setspecific(exit_key, &arena);
+#endif
+}
+
+/* Keep the largest block around for the next arena of the thread */
+void ArenaRelease(void) {
+  struct block_t *block, *next;
+  struct atom_list_t *al;
+  
+  if (arena.depth > 0)
+    return;
+  
+  for (al = arena.atoms; al; al = al->next)
+    AtomRelease(al->atom);
+  arena.atoms = NULL;
+  
+  for (block = arena.blocks; block; block = next) {
+    next = block->next;
+    if (arena.spare == NULL || block->size > arena.spare->size) {
+      if (arena.spare)
+	MemFree(arena.spare, sizeof(*block) + arena.spare->size, mem_arena);
+      arena.spare = block;
+    } else {
+      MemFree(block, sizeof(*block) + block->size, mem_arena);
+    }
+  }
+  arena.blocks = NULL;
+  
+  if (arena.spare)
+    KeepForThread();
+}
+
+int ArenaActive(void) {
+  return arena.depth > 0;
+}
+
+int ArenaSuspend(void) {
+  int depth = arena.depth;
+  
+  if (depth > 0)
+    arena.depth = 0;
+  return depth;
+}
+
+void ArenaResume(int depth) {
+  if (depth > 0)
+    arena.depth = depth;
+}
+
+static struct block_t *NewBlock(size_t size) {
+  struct block_t *block;
+  
+  if (arena.spare && arena.spare->size >= size) {
+    block = arena.spare;
+    arena.spare = NULL;
+  } else {
+    if ((block = MemAlloc(sizeof(*block) + size, mem_arena)) == NULL) {
+      perror("Cannot allocate memory for arena block");
+      return NULL;
+    }
+    block->size = size;
+  }
+  block->used = 0;
+  
+  return block;
+}
+
+void *ArenaAlloc(size_t size) {
+  struct block_t *block;
+  void *ptr;
+  
+  size = (size + ALIGN - 1) & ~((size_t) ALIGN - 1);
+  block = arena.blocks;
+  if (block == NULL || block->size - block->used < size) {
+    if (size > arena.next_size / 4) {
+      /* Large allocations get a block of their own */
+      if ((block = NewBlock(size)) == NULL)
+	return NULL;
+      if (arena.blocks) {
+	block->next = arena.blocks->next;
+	arena.blocks->next = block;
+      } else {
+	block->next = NULL;
+	arena.blocks = block;
+      }
+      block->used = size;
+      return block->data;
+    }
+    
+    if ((block = NewBlock(arena.next_size)) == NULL)
+      return NULL;
+    block->next = arena.blocks;
+    arena.blocks = block;
+    if (arena.next_size < MAX_BLOCK_SZ)
+      arena.next_size <<= 1;
+  }
+  
+  ptr = block->data + block->used;
+  block->used += size;
+  
+  return ptr;
+}
+
+/* Takes over a reference to the atom, released with the arena */
+int ArenaKeepAtom(const char *atom) {
+  struct atom_list_t *al;
+  
+  if ((al = ArenaAlloc(sizeof(*al))) == NULL)
+    return -1;
+  
+  al->atom = atom;
+  al->next = arena.atoms;
+  arena.atoms = al;
+  
+  return 0;
+}
+
+void *AllocMem(size_t size, enum ps_mem_t mem, int in_arena) {
+  if (in_arena)
+    return ArenaAlloc(size);
+  
+  return MemAlloc(size, mem);
+}
+
+void FreeMem(void *ptr, size_t size, enum ps_mem_t mem, int in_arena) {
+  if (!in_arena)
+    MemFree(ptr, size, mem);
+}
+
+/* Callers hold lock_mem */
+static int NewSlab(struct pool_t *pool) {
+  struct pool_slab_t *slab;
+  size_t pos;
+  
+  if (!pool->init) {
+    pool->next = pools;
+    pools = pool;
+    pool->init = 1;
+  }
+  
+  if ((slab = Realloc(NULL, 0, sizeof(*slab) + SLAB_SZ, mem_arena)) == NULL) {
+    perror("Cannot allocate memory for pool slab");
+    return -1;
+  }
+  slab->next = pool->slabs;
+  pool->slabs = slab;
+  
+  for (pos = 0; pos + pool->size <= SLAB_SZ; pos += pool->size) {
+    *(void **) (slab->data + pos) = pool->free;
+    pool->free = slab->data + pos;
+  }
+  
+  return 0;
+}
+
+/* Objects taken from the pool are counted as live until they are put
+ * back, even while a thread keeps them on its free list.  Callers hold
+ * lock_mem. */
+static void *PoolTake(struct pool_t *pool) {
+  void *ptr;
+  
+  if (pool->free == NULL && NewSlab(pool) < 0)
+    return NULL;
+  
+  ptr = pool->free;
+  pool->free = *(void **) ptr;
+  pool->live++;
+  
+  return ptr;
+}
+
+static void PoolPut(struct pool_t *pool, void *ptr) {
+  *(void **) ptr = pool->free;
+  pool->free = ptr;
+  pool->live--;
+}
+
+/* Returns the free list of the thread for pool, NULL if it has too
+ * many pools */
+static struct pool_cache_t *PoolCache(struct pool_t *pool) {
+  struct pool_cache_t *cache;
+  
+  for (cache = caches; cache < caches + MAX_POOLS; cache++) {
+    if (cache->pool == pool)
+      return cache;
+    
+    if (cache->pool == NULL) {
+      cache->pool = pool;
+      KeepForThread();
+      return cache;
+    }
+  }
+  
+  return NULL;
+}
+
+static int CacheTake(struct pool_cache_t *cache, void **ptr) {
+  if ((*ptr = cache->free) == NULL)
+    return 0;
+  
+  cache->free = *(void **) *ptr;
+  cache->num--;
+  return 1;
+}
+
+static void CachePut(struct pool_cache_t *cache, void *ptr) {
+  *(void **) ptr = cache->free;
+  cache->free = ptr;
+  cache->num++;
+}
+
+/* Only an empty free list of the thread needs lock_mem */
+void *PoolAlloc(struct pool_t *pool, int in_arena) {
+  struct pool_cache_t *cache;
+  void *ptr;
+  size_t count;
+  
+  if (in_arena)
+    return ArenaAlloc(pool->size);
+  
+  if ((cache = PoolCache(pool)) == NULL) {
+    LockShared(lock_mem);
+    ptr = PoolTake(pool);
+    UnlockShared(lock_mem);
+  } else {
+    if (cache->free == NULL) {
+      LockShared(lock_mem);
+      for (count = 0; count < POOL_BATCH && (ptr = PoolTake(pool)); count++)
+	CachePut(cache, ptr);
+      UnlockShared(lock_mem);
+    }
+    CacheTake(cache, &ptr);
+  }
+  
+  if (ptr == NULL)
+    return NULL;
+  
+  AddBytes(&stats[mem_arena], -pool->size);
+  AccountOne(&stats[pool->mem], 0, pool->size);
+  return ptr;
+}
+
+/* A free list that grew to two batches gives one back */
+void PoolFree(struct pool_t *pool, void *ptr, int in_arena) {
+  struct pool_cache_t *cache;
+  
+  if (ptr == NULL || in_arena)
+    return;
+  
+  AccountOne(&stats[pool->mem], pool->size, 0);
+  AddBytes(&stats[mem_arena], pool->size);
+  
+  if ((cache = PoolCache(pool)) == NULL) {
+    LockShared(lock_mem);
+    PoolPut(pool, ptr);
+    UnlockShared(lock_mem);
+    return;
+  }
+  
+  CachePut(cache, ptr);
+  if (cache->num < 2 * POOL_BATCH)
+    return;
+  
+  LockShared(lock_mem);
+  while (cache->num > POOL_BATCH && CacheTake(cache, &ptr))
+    PoolPut(pool, ptr);
+  UnlockShared(lock_mem);
+}
+
+/* Only possible once every object is back on the free list of the
+ * pool.  Callers hold lock_mem. */
+static void PoolRelease(struct pool_t *pool) {
+  struct pool_slab_t *slab, *next;
+  
+  if (pool->live > 0)
+    return;
+  
+  for (slab = pool->slabs; slab; slab = next) {
+    next = slab->next;
+    Realloc(slab, sizeof(*slab) + SLAB_SZ, 0, mem_arena);
+  }
+  pool->slabs = NULL;
+  pool->free = NULL;
+}
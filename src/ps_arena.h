@@ -0,0 +1,120 @@
+/*
+  Copyright (C) 2018 Paul Maurer
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+  
+  1. Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+  
+  2. Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+  
+  3. Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from this
+  software without specific prior written permission.
+  
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef PS_ARENA_H
+#define PS_ARENA_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "ps_memory.h"
+
+/* While an arena is active, values are allocated from large blocks
+ * that are all released together when the outermost arena ends.
+ * Freeing memory that belongs to the arena does nothing.  The arena
+ * belongs to the calling thread. */
+
+int ArenaEnter(void);
+int ArenaLeave(void); /* Returns remaining depth, call ArenaRelease at 0 */
+void ArenaRelease(void);
+int ArenaActive(void);
+
+/* Allocations between these are made as if no arena was active */
+int ArenaSuspend(void);
+void ArenaResume(int depth);
+
+void *ArenaAlloc(size_t size);
+int ArenaKeepAtom(const char *atom);
+
+/* All memory is allocated through these so it can be accounted, the
+ * size must be given again when memory is freed */
+void *MemAlloc(size_t size, enum ps_mem_t mem);
+void *MemRealloc(void *ptr, size_t old_size, size_t new_size, enum ps_mem_t mem);
+void MemFree(void *ptr, size_t size, enum ps_mem_t mem);
+void MemReclass(size_t size, enum ps_mem_t from, enum ps_mem_t to);
+char *MemStrdup(const char *str, enum ps_mem_t mem);
+
+void *AllocMem(size_t size, enum ps_mem_t mem, int in_arena);
+void FreeMem(void *ptr, size_t size, enum ps_mem_t mem, int in_arena);
+
+/* With thread support the pools, an allocator that was set and
+ * changes to the atom table are locked, so any thread may use them.
+ * Without it these do nothing. */
+enum lock_t {
+  lock_mem,
+  lock_atom,
+  lock_cache,
+  lock_job,
+  lock_search,
+  lock_watch,
+  lock_changes,
+  lock_num
+};
+
+void LockShared(enum lock_t lock);
+void UnlockShared(enum lock_t lock);
+
+/* Counters shared by threads are changed without a lock.  ATOMIC_CAS
+ * stores new if var is still old, else loads var into old. */
+#ifdef __GNUC__
+#define ATOMIC_LOAD(var) __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+#define ATOMIC_ADD(var, val) __atomic_add_fetch(&(var), (val), __ATOMIC_ACQ_REL)
+#define ATOMIC_CAS(var, old, new) __atomic_compare_exchange_n(&(var), &(old), (new), 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
+#else
+#define ATOMIC_LOAD(var) (var)
+#define ATOMIC_ADD(var, val) ((var) += (val))
+#define ATOMIC_CAS(var, old, new) ((var) == (old) ? ((var) = (new), 1) : ((old) = (var), 0))
+#endif
+
+/* Many small objects of one size are carved from slabs and kept on a
+ * free list for reuse.  Each object is counted as mem, the free space
+ * in the slabs as mem_arena.  Slabs are kept until the allocator
+ * changes.  Every thread keeps a free list of its own and only takes
+ * lock_mem to move a batch of objects from or to the pool, objects may
+ * be freed by a different thread than allocated them. */
+struct pool_slab_t;
+
+struct pool_t {
+  size_t size;
+  enum ps_mem_t mem;
+  size_t live;
+  int init;
+  void *free;
+  struct pool_slab_t *slabs;
+  struct pool_t *next;
+};
+
+#define POOL_INIT(type, mem) {(sizeof(type) + sizeof(void *) - 1) & ~(sizeof(void *) - 1), mem, 0, 0, NULL, NULL, NULL}
+
+void *PoolAlloc(struct pool_t *pool, int in_arena);
+void PoolFree(struct pool_t *pool, void *ptr, int in_arena);
+
+#endif
@@ -37,6 +37,7 @@
 
 #include "ps_context.h"
 #include "binary_tree.h"
+#include "ps_arena.h"
 
 struct list_t {
   char *ext;
@@ -80,17 +81,17 @@ static struct ps_value_t *BuildConst(void) {
 static struct list_t *NewList(const char *ext) {
   struct list_t *list;
 
-  if ((list = malloc(sizeof(*list))) == NULL)
+  if ((list = MemAlloc(sizeof(*list), mem_other)) == NULL)
     goto err;
   memset(list, 0, sizeof(*list));
   
-  if ((list->ext = strdup(ext)) == NULL)
+  if ((list->ext = MemStrdup(ext, mem_other)) == NULL)
     goto err2;
   
   return list;
   
  err2:
-  free(list);
+  MemFree(list, sizeof(*list), mem_other);
  err:
   return NULL;
 }
@@ -99,35 +100,32 @@ static void FreeList(struct list_t *list) {
   if (list == NULL)
     return;
   
-  free(list->ext);
-  free(list);
+  MemFree(list->ext, strlen(list->ext) + 1, mem_other);
+  MemFree(list, sizeof(*list), mem_other);
 }
 
 static struct ps_value_t *BlankExtObjFromTemplate(struct ps_value_t *template) {
   struct ps_value_t *obj, *v;
-  struct ps_value_iterator_t *vi;
+  struct ps_value_iterator_t vi;
 
   if ((obj = PS_NewObject()) == NULL)
     goto err;
   
-  if ((vi = PS_NewValueIterator(template)) == NULL)
+  if (PS_InitValueIterator(&vi, template) < 0)
     goto err2;
 
-  while (PS_ValueIteratorNext(vi)) {
+  while (PS_ValueIteratorNext(&vi)) {
     if ((v = PS_NewObject()) == NULL)
-      goto err3;
+      goto err2;
 
-    if (PS_AddMember(obj, PS_ValueIteratorKey(vi), v) < 0)
-      goto err4;
+    if (PS_AddMember(obj, PS_ValueIteratorKey(&vi), v) < 0)
+      goto err3;
   }
   
-  PS_FreeValueIterator(vi);
   return obj;
   
- err4:
-  PS_FreeValue(v);
  err3:
-  PS_FreeValueIterator(vi);
+  PS_FreeValue(v);
  err2:
   PS_FreeValue(obj);
  err:
@@ -136,58 +134,48 @@ static struct ps_value_t *BlankExtObjFromTemplate(struct ps_value_t *template) {
 
 static const char *GetFirstExt(struct ps_value_t *template) {
   const char *ext;
-  struct ps_value_iterator_t *vi;
+  struct ps_value_iterator_t vi;
 
-  if ((vi = PS_NewValueIterator(template)) == NULL)
+  if (PS_InitValueIterator(&vi, template) < 0)
     return NULL;
 
-  if (!PS_ValueIteratorNext(vi))
+  if (!PS_ValueIteratorNext(&vi))
     return NULL;
   
-  ext = PS_ValueIteratorKey(vi);
-  PS_FreeValueIterator(vi);
+  ext = PS_ValueIteratorKey(&vi);
   return ext;
 }
 
-static int MarkHard(struct ps_value_t *hard, const struct ps_value_t *hard_settings) {
-  struct ps_value_iterator_t *vi_ext, *vi_set;
-  const char *ext, *name;
+static int MarkSetting(const char *name, struct ps_value_t **memb, const struct ps_value_t *v, void *ref) {
+  (void) name;
+  (void) v;
+  (void) ref;
   
-  if ((vi_ext = PS_NewValueIterator(hard_settings)) == NULL)
-    goto err;
+  if (*memb == NULL && (*memb = PS_NewBoolean(1)) == NULL)
+    return -1;
   
-  while (PS_ValueIteratorNext(vi_ext)) {
-    ext = PS_ValueIteratorKey(vi_ext);
-    
-    if ((vi_set = PS_NewValueIterator(PS_ValueIteratorData(vi_ext))) == NULL)
-      goto err2;
-    
-    while (PS_ValueIteratorNext(vi_set)) {
-      name = PS_ValueIteratorKey(vi_set);
-      
-      if (PS_AddMember(PS_GetMember(hard, ext, NULL), name, PS_NewBoolean(1)) < 0)
-	goto err3;
-    }
+  return 0;
+}
 
-    PS_FreeValueIterator(vi_set);
-  }
+static int MarkExt(const char *ext, struct ps_value_t **memb, const struct ps_value_t *v, void *ref) {
+  (void) ext;
+  (void) ref;
   
-  PS_FreeValueIterator(vi_ext);
-  return 0;
+  if (*memb == NULL)
+    return -1;
   
- err3:
-  PS_FreeValueIterator(vi_set);
- err2:
-  PS_FreeValueIterator(vi_ext);
- err:
-  return -1;
+  return PS_UnionObject(*memb, v, MarkSetting, NULL);
+}
+
+static int MarkHard(struct ps_value_t *hard, const struct ps_value_t *hard_settings) {
+  return PS_UnionObject(hard, hard_settings, MarkExt, NULL);
 }
 
 struct ps_context_t *PS_NewCtx(const struct ps_value_t *hard_settings, const struct ps_value_t *dflt) {
   struct ps_context_t *ctx;
   const char *ext;
   
-  if ((ctx = malloc(sizeof(*ctx))) == NULL)
+  if ((ctx = MemAlloc(sizeof(*ctx), mem_other)) == NULL)
     goto err;
   memset(ctx, 0, sizeof(*ctx));
   
@@ -223,7 +211,7 @@ struct ps_context_t *PS_NewCtx(const struct ps_value_t *hard_settings, const str
  err3:
   PS_FreeValue(ctx->dflt);
  err2:
-  free(ctx);
+  MemFree(ctx, sizeof(*ctx), mem_other);
  err:
   fprintf(stderr, "Error: Could not create constant value object\n");
   return NULL;
@@ -246,7 +234,7 @@ void PS_FreeCtx(struct ps_context_t *ctx) {
   PS_FreeValue(ctx->over);
   PS_FreeValue(ctx->hard);
   PS_FreeValue(ctx->dflt);
-  free(ctx);
+  MemFree(ctx, sizeof(*ctx), mem_other);
 }
 
 struct ps_value_t *PS_BlankExtObj(struct ps_context_t *ctx) {
@@ -258,14 +246,14 @@ const struct ps_value_t *PS_CtxGetValues(struct ps_context_t *ctx) {
 }
 
 int PS_CtxIsHard(struct ps_context_t *ctx, const char *ext, const char *name) {
-  return PS_GetMember(PS_GetMember(ctx->hard, ext, NULL), name, NULL) != NULL;
+  return PS_GetMemberConst(PS_GetMemberConst(ctx->hard, ext, NULL), name, NULL) != NULL;
 }
 
 int PS_CtxAddValue(struct ps_context_t *ctx, const char *ext, const char *name, struct ps_value_t *v) {
-  if (PS_GetMember(PS_GetMember(ctx->hard, ext, NULL), name, NULL))
+  if (PS_GetMemberConst(PS_GetMemberConst(ctx->hard, ext, NULL), name, NULL))
     return 0;
   
-  if (!PS_GetMember(PS_GetMember(ctx->dflt, ext, NULL), name, NULL))
+  if (!PS_GetMemberConst(PS_GetMemberConst(ctx->dflt, ext, NULL), name, NULL))
     fprintf(stderr, "Warning: Adding setting without default value, possible typo %s->%s\n", ext, name);
 
   if (!v)
@@ -274,18 +262,25 @@ int PS_CtxAddValue(struct ps_context_t *ctx, const char *ext, const char *name,
   return PS_AddMember(PS_GetMember(ctx->over, ext, NULL), name, v);
 }
 
+/* Looks name up in the layers over->ext, dflt->ext, over->#global,
+ * dflt->#global and the constants, in that order */
 static const struct ps_value_t *RawLookup(struct ps_context_t *ctx, const char *ext, const char *name, int quiet) {
-  const struct ps_value_t *v;
-  if ((v = PS_GetMember(PS_GetMember(ctx->over, ext, NULL), name, NULL)))
-    return v;
-
-  if ((v = PS_GetMember(PS_GetMember(ctx->dflt, ext, NULL), name, NULL)))
-    return v;
-  
-  if (strcmp(ext, "#global") != 0 && (v = RawLookup(ctx, "#global", name, 1)))
-    return v;
+  const char *exts[2] = {ext, "#global"};
+  const struct ps_value_t *over[2], *dflt[2], *layers[5], *v;
+  size_t num_ext, num, count;
+  
+  num_ext = strcmp(ext, "#global") == 0 ? 1 : 2;
+  PS_GetMembers(ctx->over, num_ext, exts, over);
+  PS_GetMembers(ctx->dflt, num_ext, exts, dflt);
+  
+  num = 0;
+  for (count = 0; count < num_ext; count++) {
+    layers[num++] = over[count];
+    layers[num++] = dflt[count];
+  }
+  layers[num++] = ctx->const_val;
   
-  if ((v = PS_GetMember(ctx->const_val, name, NULL)))
+  if ((v = PS_GetLayeredMember(layers, num, name)))
     return v;
   
   if (!quiet)
@@ -302,32 +297,29 @@ const struct ps_value_t *PS_CtxLookup(struct ps_context_t *ctx, const char *name
 
 struct ps_value_t *PS_CtxLookupAll(struct ps_context_t *ctx, const char *name) {
   struct ps_value_t *list, *v;
-  struct ps_value_iterator_t *vi;
+  struct ps_value_iterator_t vi;
   
   if ((list = PS_NewList()) == NULL)
     goto err;
   
-  if ((vi = PS_NewValueIterator(ctx->dflt)) == NULL)
+  if (PS_InitValueIterator(&vi, ctx->dflt) < 0)
     goto err2;
 
-  if (!PS_ValueIteratorNext(vi))
-    goto err3;
+  if (!PS_ValueIteratorNext(&vi))
+    goto err2;
   
-  while (PS_ValueIteratorNext(vi)) {
-    if ((v = PS_AddRef(RawLookup(ctx, PS_ValueIteratorKey(vi), name, 0))) == NULL)
-      goto err3;
+  while (PS_ValueIteratorNext(&vi)) {
+    if ((v = PS_AddRef(RawLookup(ctx, PS_ValueIteratorKey(&vi), name, 0))) == NULL)
+      goto err2;
 
     if (PS_AppendToList(list, v) < 0)
-      goto err4;
+      goto err3;
   }
 
-  PS_FreeValueIterator(vi);
   return list;
   
- err4:
-  PS_FreeValue(v);
  err3:
-  PS_FreeValueIterator(vi);
+  PS_FreeValue(v);
  err2:
   PS_FreeValue(list);
  err:
@@ -336,30 +328,27 @@ struct ps_value_t *PS_CtxLookupAll(struct ps_context_t *ctx, const char *name) {
 
 struct ps_value_t *PS_CtxFirstTrue(struct ps_context_t *ctx, const char *name) {
   struct ps_value_t *v = NULL;
-  struct ps_value_iterator_t *vi;
+  struct ps_value_iterator_t vi;
   
-  if ((vi = PS_NewValueIterator(ctx->dflt)) == NULL)
+  if (PS_InitValueIterator(&vi, ctx->dflt) < 0)
     goto err;
 
-  if (!PS_ValueIteratorNext(vi))
-    goto err2;
+  if (!PS_ValueIteratorNext(&vi))
+    goto err;
   
-  while (PS_ValueIteratorNext(vi)) {
-    if (PS_AsBoolean(RawLookup(ctx, PS_ValueIteratorKey(vi), name, 0))) {
-      v = PS_NewString(PS_ValueIteratorKey(vi));
+  while (PS_ValueIteratorNext(&vi)) {
+    if (PS_AsBoolean(RawLookup(ctx, PS_ValueIteratorKey(&vi), name, 0))) {
+      v = PS_NewString(PS_ValueIteratorKey(&vi));
       break;
     }
   }
   
-  PS_FreeValueIterator(vi);
   if (v == NULL) {
     fprintf(stderr, "Warning: No suitable extruder found, returning extruder '0'\n");
     v = PS_NewString("0");
   }
   return v;
   
- err2:
-  PS_FreeValueIterator(vi);
  err:
   return NULL;
 }
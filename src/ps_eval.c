@@ -33,13 +33,13 @@
 #include <stdint.h>
 
 #include <ctype.h>
-#include <errno.h>
 #include <string.h>
 
 #include "ps_math.h"
 #include "ps_eval.h"
 #include "ps_ostream.h"
 #include "ps_stack.h"
+#include "ps_number.h"
 
 #define UNA 9
 #define EXP 8
@@ -256,7 +256,7 @@ static struct ps_value_t *FuncEval(const struct ps_value_t *v, struct ps_context
     if (strcmp(name, macro_prop[count].name) == 0)
       return macro_prop[count].func(v, ctx);
   
-  if ((ve = PS_NewList()) == NULL)
+  if ((ve = PS_NewListCap(PS_ItemCount(v) - 1)) == NULL)
     goto err2;
   
   for (count = 1; count < PS_ItemCount(v); count++) {
@@ -392,7 +392,7 @@ static int VerifyFunc(struct ps_value_t **v, const char *ext, struct ps_value_t
 
 static int AddDep(struct ps_value_t *v, const char *ext, struct ps_value_t *dep) {
   struct ps_value_t *t, *c;
-  struct ps_value_iterator_t *vi;
+  struct ps_value_iterator_t vi;
   
   if ((t = PS_NewBoolean(1)) == NULL)
     goto err;
@@ -403,26 +403,23 @@ static int AddDep(struct ps_value_t *v, const char *ext, struct ps_value_t *dep)
     return 0;
   }
   
-  if ((vi = PS_NewValueIterator(dep)) == NULL)
+  if (PS_InitValueIterator(&vi, dep) < 0)
     goto err2;
   
-  if (PS_ValueIteratorNext(vi)) {
-    while (PS_ValueIteratorNext(vi)) {
+  if (PS_ValueIteratorNext(&vi)) {
+    while (PS_ValueIteratorNext(&vi)) {
       if ((c = PS_CopyValue(t)) == NULL)
+	goto err2;
+      if (PS_AddMember(PS_ValueIteratorData(&vi), PS_GetString(v), c) < 0)
 	goto err3;
-      if (PS_AddMember(PS_ValueIteratorData(vi), PS_GetString(v), c) < 0)
-	goto err4;
     }
   }
 
-  PS_FreeValueIterator(vi);
   PS_FreeValue(t);
   return 0;
 
- err4:
-  PS_FreeValue(c);
  err3:
-  PS_FreeValueIterator(vi);
+  PS_FreeValue(c);
  err2:
   PS_FreeValue(t);
  err:
@@ -486,9 +483,9 @@ static struct ps_value_t *ParseString(const char *str, const char **end) {
 }
 
 static struct ps_value_t *ParseAtom(enum expr_type_t type, const char *str, const char **end) {
-  long long numi;
+  int64_t numi;
   double numf;
-  char *num_end;
+  int is_float;
   size_t len;
 
   len = *end - str;
@@ -500,17 +497,11 @@ static struct ps_value_t *ParseAtom(enum expr_type_t type, const char *str, cons
     return PS_NewBoolean(*str == 't');
     
   case e_number:
-    errno = 0;
-    numi = strtoll(str, &num_end, 0);
-    if (errno == 0 && num_end == *end)
-      return PS_NewInteger(numi);
-
-    errno = 0;
-    numf = strtod(str, &num_end);
-    if (errno == 0 && num_end == *end)
+    if (ParseNumber(str, *end, &is_float, &numi, &numf) != *end)
+      return NULL;
+    if (is_float)
       return PS_NewFloat(numf);
-    
-    return NULL;
+    return PS_NewInteger(numi);
 
   case e_string:
     return ParseString(str, end);
@@ -651,6 +642,7 @@ static int AddOper(struct ps_value_t *stack, struct ps_value_t *oper, enum expr_
   size_t cur_level, level;
   int num_args, count;
   const char *str;
+  enum ps_grouping_t grp;
   
   cur_level = PS_StackLength(stack);
   str = PS_GetString(oper);
@@ -661,8 +653,9 @@ static int AddOper(struct ps_value_t *stack, struct ps_value_t *oper, enum expr_
 
   /* Handle open parenthesis */
   if (strcmp(str, "(") == 0 || strcmp(str, "[") == 0) {
+    grp = strcmp(str, "[") == 0 ? pg_square : pg_paren;
     PS_FreeValue(oper);
-    if ((prev_type != e_bareword || strcmp(str, "[") == 0) && prev_type != e_operator && prev_type != e_init) {
+    if ((prev_type != e_bareword || grp == pg_square) && prev_type != e_operator && prev_type != e_init) {
       fprintf(stderr, "Open parenthesis/bracket cannot follow %s\n", expr_name[prev_type]);
       goto err;
     }
@@ -682,7 +675,7 @@ static int AddOper(struct ps_value_t *stack, struct ps_value_t *oper, enum expr_
       return 0;
     }
     
-    if (PS_OpenGrouping(stack, strcmp(str, "[") == 0 ? pg_square : pg_paren, NULL) < 0)
+    if (PS_OpenGrouping(stack, grp, NULL) < 0)
       goto err;
     
     PS_FreeValue(prev);
@@ -217,37 +217,34 @@ int PS_OutFile_ReadToStream(struct ps_out_file_t *of, struct ps_ostream_t *os) {
 
 static int SetSearchEnv(const struct ps_value_t *search) {
   struct ps_ostream_t *os;
-  struct ps_value_iterator_t *vi;
+  struct ps_value_iterator_t vi;
   int is_first;
   
   if ((os = PS_NewStrOStream()) == NULL)
     goto err;
   
-  if ((vi = PS_NewValueIterator(search)) == NULL)
+  if (PS_InitValueIterator(&vi, search) < 0)
     goto err2;
 
   is_first = 1;
-  while (PS_ValueIteratorNext(vi)) {
+  while (PS_ValueIteratorNext(&vi)) {
     if (!is_first && PS_WriteChar(os, ';') < 0)
-	goto err3;
+	goto err2;
     is_first = 0;
     
-    if (PS_WriteStr(os, PS_GetString(PS_ValueIteratorData(vi))) < 0)
-      goto err3;
+    if (PS_WriteStr(os, PS_GetString(PS_ValueIteratorData(&vi))) < 0)
+      goto err2;
   }
 
   printf("Setting " PS_ENV_VAR "=%s\n", PS_OStreamContents(os));
   if (!SetEnvironmentVariable(PS_ENV_VAR, PS_OStreamContents(os))) {
     fprintf(stderr, "Could not set " PS_ENV_VAR " environment variable\n");
-    goto err3;
+    goto err2;
   }
   
-  PS_FreeValueIterator(vi);
   PS_FreeOStream(os);
   return 0;
   
- err3:
-  PS_FreeValueIterator(vi);
  err2:
   PS_FreeOStream(os);
  err:
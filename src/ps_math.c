@@ -41,7 +41,7 @@
 struct ps_value_t *PS_Call1(const ps_func_t func, const struct ps_value_t *v1) {
   struct ps_value_t *list, *cp, *ret;
 
-  if ((list = PS_NewList()) == NULL)
+  if ((list = PS_NewListCap(1)) == NULL)
     goto err;
 
   if ((cp = PS_AddRef(v1)) == NULL)
@@ -66,7 +66,7 @@ struct ps_value_t *PS_Call1(const ps_func_t func, const struct ps_value_t *v1) {
 struct ps_value_t *PS_Call2(const ps_func_t func, const struct ps_value_t *v1, const struct ps_value_t *v2) {
   struct ps_value_t *list, *cp, *ret;
 
-  if ((list = PS_NewList()) == NULL)
+  if ((list = PS_NewListCap(2)) == NULL)
     goto err;
 
   if ((cp = PS_AddRef(v1)) == NULL)
@@ -367,7 +367,7 @@ static int PS_EqList(const struct ps_value_t *va, const struct ps_value_t *vb) {
 }
 
 static int PS_EqObject(const struct ps_value_t *va, const struct ps_value_t *vb) {
-  struct ps_value_iterator_t *via, *vib;
+  struct ps_value_iterator_t via, vib;
   int ret = -1;
   
   if (PS_ItemCount(va) != PS_ItemCount(vb)) {
@@ -375,26 +375,22 @@ static int PS_EqObject(const struct ps_value_t *va, const struct ps_value_t *vb)
     goto err;
   }
   
-  if ((via = PS_NewValueIterator(va)) == NULL)
+  if (PS_InitValueIterator(&via, va) < 0)
     goto err;
 
-  if ((vib = PS_NewValueIterator(vb)) == NULL)
-    goto err2;
+  if (PS_InitValueIterator(&vib, vb) < 0)
+    goto err;
 
-  while (PS_ValueIteratorNext(via) && PS_ValueIteratorNext(vib)) {
-    ret = PS_EqRawAB(PS_ValueIteratorData(via), PS_ValueIteratorData(vib));
+  while (PS_ValueIteratorNext(&via) && PS_ValueIteratorNext(&vib)) {
+    ret = PS_EqRawAB(PS_ValueIteratorData(&via), PS_ValueIteratorData(&vib));
     
     if (ret < 1)
-      goto err3;
+      goto err;
   }
 
   ret = 1;
   /* Fall through */
 
- err3:
-  PS_FreeValueIterator(vib);
- err2:
-  PS_FreeValueIterator(via);
  err:
   return ret;
 }
@@ -644,11 +640,11 @@ struct ps_value_t *PS_Map(const struct ps_value_t *v) {
     }
   }
   
-  if ((ret = PS_NewList()) == NULL)
+  if ((ret = PS_NewListCap(num)) == NULL)
     goto err;
   
   for (count = 0; count < num; count++) {
-    if ((arg_list = PS_NewList()) == NULL)
+    if ((arg_list = PS_NewListCap(len - 1)) == NULL)
       goto err2;
     
     for (arg_count = 1; arg_count < len; arg_count++) {
@@ -0,0 +1,266 @@
+/*
+  Copyright (C) 2018 Paul Maurer
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+  
+  1. Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+  
+  2. Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+  
+  3. Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from this
+  software without specific prior written permission.
+  
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* For strtod_l */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <locale.h>
+#include <string.h>
+
+#ifdef HAVE_XLOCALE_H
+#include <xlocale.h>
+#endif
+
+#if defined(HAVE_NEWLOCALE) && defined(HAVE_STRTOD_L)
+#define USE_C_LOCALE
+#endif
+
+#include "ps_number.h"
+#include "ps_arena.h"
+
+/* Mantissas up to this take another decimal digit without overflow */
+#define MAX_MANT ((UINT64_MAX - 9) / 10)
+
+/* Integers up to this, and the powers of ten below, are exact doubles */
+#define EXACT_MANT (UINT64_C(1) << 53)
+#define EXACT_POW 22
+
+static const double exact_pow10[EXACT_POW + 1] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static int IsDigit(char ch) {
+  return ch >= '0' && ch <= '9';
+}
+
+static int HexValue(char ch) {
+  if (ch >= '0' && ch <= '9')
+    return ch - '0';
+  if (ch >= 'a' && ch <= 'f')
+    return ch - 'a' + 10;
+  if (ch >= 'A' && ch <= 'F')
+    return ch - 'A' + 10;
+  
+  return -1;
+}
+
+/* Returns 1 and sets *i if the magnitude fits */
+static int SetInteger(uint64_t mant, int neg, int64_t *i) {
+  if (mant > (uint64_t) INT64_MAX + neg)
+    return 0;
+  
+  *i = neg ? -(int64_t) (mant - 1) - 1 : (int64_t) mant;
+  return 1;
+}
+
+static const char *ParseHex(const char *cur, const char *end, int neg, int *is_float, int64_t *i, double *f) {
+  uint64_t mant = 0;
+  double fmant = 0.0;
+  int overflow = 0, d;
+  
+  for (; cur < end && (d = HexValue(*cur)) >= 0; cur++) {
+    if (mant > UINT64_MAX >> 4)
+      overflow = 1;
+    mant = mant << 4 | d;
+    fmant = fmant * 16 + d;
+  }
+  
+  if (!overflow && SetInteger(mant, neg, i))
+    return cur;
+  
+  *is_float = 1;
+  *f = neg ? -fmant : fmant;
+  return cur;
+}
+
+#ifdef USE_C_LOCALE
+static locale_t c_locale;
+
+static locale_t CLocale(void) {
+  locale_t loc, old = (locale_t) 0;
+  
+  if ((loc = ATOMIC_LOAD(c_locale)))
+    return loc;
+  
+  if ((loc = newlocale(LC_NUMERIC_MASK, "C", (locale_t) 0)) == (locale_t) 0)
+    return loc;
+  
+  /* Another thread may have made one meanwhile */
+  while (!ATOMIC_CAS(c_locale, old, loc) && old == (locale_t) 0)
+    ;
+  if (old) {
+    freelocale(loc);
+    return old;
+  }
+  return loc;
+}
+#endif
+
+/* strtod is correct for any input.  strtod_l is given the C locale,
+ * plain strtod the decimal point of the current locale, which other
+ * threads may change meanwhile.  Only needed when the fast path cannot
+ * be exact. */
+static int SlowFloat(const char *str, const char *end, double *f) {
+  const char *point = ".";
+  size_t point_len, size;
+  char temp[128], *buf = temp, *cur;
+#ifdef USE_C_LOCALE
+  locale_t loc;
+  
+  if ((loc = CLocale()) == (locale_t) 0)
+#endif
+    point = localeconv()->decimal_point;
+  
+  point_len = strlen(point);
+  size = end - str + point_len + 1;
+  if (size > sizeof(temp) && (buf = MemAlloc(size, mem_other)) == NULL) {
+    fprintf(stderr, "Could not allocate memory to convert number\n");
+    return -1;
+  }
+  
+  if (size > sizeof(temp) && (buf = MemAlloc(size, mem_other)) == NULL) {
+    fprintf(stderr, "Could not allocate memory to convert number\n");
+    return -1;
+  }
+  
+  for (cur = buf; str < end; str++) {
+    if (*str == '.') {
+      memcpy(cur, point, point_len);
+      cur += point_len;
+    } else {
+      *cur++ = *str;
+    }
+  }
+  *cur = '\0';
+  
+#ifdef USE_C_LOCALE
+  if (loc)
+    *f = strtod_l(buf, NULL, loc);
+  else
+#endif
+    *f = strtod(buf, NULL);
+  
+  if (buf != temp)
+    MemFree(buf, size, mem_other);
+  return 0;
+}
+
+const char *ParseNumber(const char *str, const char *end, int *is_float, int64_t *i, double *f) {
+  const char *cur = str, *digits, *exp_cur;
+  uint64_t mant = 0;
+  size_t num_digits;
+  long exp10 = 0, exp;
+  int neg = 0, exp_neg, inexact = 0;
+  double val;
+  
+  *is_float = 0;
+  *i = 0;
+  *f = 0.0;
+  
+  if (cur < end && (*cur == '-' || *cur == '+'))
+    neg = *cur++ == '-';
+  
+  if (end - cur > 2 && cur[0] == '0' && (cur[1] == 'x' || cur[1] == 'X') && HexValue(cur[2]) >= 0)
+    return ParseHex(cur + 2, end, neg, is_float, i, f);
+  
+  /* Digits past the 19th only shift the exponent, or round */
+  for (digits = cur; cur < end && IsDigit(*cur); cur++) {
+    if (mant <= MAX_MANT)
+      mant = mant * 10 + *cur - '0';
+    else {
+      exp10++;
+      inexact |= *cur != '0';
+    }
+  }
+  num_digits = cur - digits;
+  
+  if (cur < end && *cur == '.') {
+    *is_float = 1;
+    for (digits = ++cur; cur < end && IsDigit(*cur); cur++) {
+      if (mant <= MAX_MANT) {
+	mant = mant * 10 + *cur - '0';
+	exp10--;
+      } else {
+	inexact |= *cur != '0';
+      }
+    }
+    num_digits += cur - digits;
+  }
+  
+  if (num_digits == 0) {
+    *is_float = 0;
+    return str;
+  }
+  
+  if (cur < end && (*cur == 'e' || *cur == 'E')) {
+    exp_cur = cur + 1;
+    exp_neg = 0;
+    if (exp_cur < end && (*exp_cur == '-' || *exp_cur == '+'))
+      exp_neg = *exp_cur++ == '-';
+    if (exp_cur < end && IsDigit(*exp_cur)) {
+      for (exp = 0; exp_cur < end && IsDigit(*exp_cur); exp_cur++)
+	if (exp < 100000)
+	  exp = exp * 10 + *exp_cur - '0';
+      exp10 += exp_neg ? -exp : exp;
+      *is_float = 1;
+      cur = exp_cur;
+    }
+  }
+  
+  if (!*is_float && !inexact && exp10 == 0 && SetInteger(mant, neg, i))
+    return cur;
+  *is_float = 1;
+  
+  /* Both the mantissa and the power of ten are exact, so one rounding
+   * gives the correctly rounded result */
+  if (mant == 0) {
+    val = 0.0;
+  } else if (!inexact && mant <= EXACT_MANT && exp10 >= -EXACT_POW && exp10 <= EXACT_POW) {
+    val = exp10 < 0 ? mant / exact_pow10[-exp10] : mant * exact_pow10[exp10];
+  } else if (!inexact && exp10 > EXACT_POW && exp10 <= 2 * EXACT_POW && mant <= EXACT_MANT / exact_pow10[exp10 - EXACT_POW]) {
+    val = mant * exact_pow10[exp10 - EXACT_POW] * exact_pow10[EXACT_POW];
+  } else {
+    if (SlowFloat(str, cur, f) < 0)
+      return str;
+    return cur;
+  }
+  
+  *f = neg ? -val : val;
+  return cur;
+}
@@ -36,6 +36,7 @@
 #include <string.h>
 
 #include "ps_ostream.h"
+#include "ps_arena.h"
 
 struct ps_ostream_t {
   int is_file;
@@ -52,7 +53,7 @@ struct ps_ostream_t {
 struct ps_ostream_t *PS_NewFileOStream(FILE *out) {
   struct ps_ostream_t *os;
 
-  if ((os = malloc(sizeof(*os))) == NULL) {
+  if ((os = MemAlloc(sizeof(*os), mem_stream)) == NULL) {
     perror("Cannot allocate memory for file ps_ostream");
     goto err;
   }
@@ -70,13 +71,13 @@ struct ps_ostream_t *PS_NewFileOStream(FILE *out) {
 struct ps_ostream_t *PS_NewStrOStream(void) {
   struct ps_ostream_t *os;
 
-  if ((os = malloc(sizeof(*os))) == NULL) {
+  if ((os = MemAlloc(sizeof(*os), mem_stream)) == NULL) {
     perror("Cannot allocate memory for string ps_ostream");
     goto err;
   }
   memset(os, 0, sizeof(*os));
 
-  if ((os->str = malloc(INIT_STR_SZ)) == NULL) {
+  if ((os->str = MemAlloc(INIT_STR_SZ, mem_stream)) == NULL) {
     perror("Cannot allocate memory for string ps_ostream string");
     goto err2;
   }
@@ -87,7 +88,7 @@ struct ps_ostream_t *PS_NewStrOStream(void) {
   return os;
 
  err2:
-  free(os);
+  MemFree(os, sizeof(*os), mem_stream);
  err:
   return NULL;
 }
@@ -97,8 +98,8 @@ void PS_OStreamReset(struct ps_ostream_t *os) {
 }
 
 void PS_FreeOStream(struct ps_ostream_t *os) {
-  free(os->str);
-  free(os);
+  MemFree(os->str, os->alloc, mem_stream);
+  MemFree(os, sizeof(*os), mem_stream);
 }
 
 int EnsureSpace(struct ps_ostream_t *os, size_t len) {
@@ -118,7 +119,7 @@ int EnsureSpace(struct ps_ostream_t *os, size_t len) {
       return -1;
   }
   
-  if ((nstr = realloc(os->str, new_alloc)) == NULL)
+  if ((nstr = MemRealloc(os->str, os->alloc, new_alloc, mem_stream)) == NULL)
     return -1;
 
   os->str = nstr;
@@ -28,6 +28,10 @@
   POSSIBILITY OF SUCH DAMAGE.
 */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -35,10 +39,48 @@
 #include <ctype.h>
 #include <string.h>
 
+#if defined(__GNUC__) && defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#ifdef HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
 #include "ps_value.h"
 #include "ps_ostream.h"
+#include "ps_parse_json.h"
+#include "ps_arena.h"
+#include "ps_number.h"
+#include "ps_lazy.h"
+#include "ps_watch.h"
 
 #define BUF_SZ 4096
+#define MAX_DEPTH 256
+
+/* The extent of an object or list in the text and the index of the
+ * entry after everything in it */
+struct tape_entry_t {
+  size_t start;
+  size_t end;
+  size_t next;
+};
+
+struct ps_tape_t {
+  size_t ref_count;
+  char *text;
+  size_t len;
+  size_t text_alloc;
+  struct tape_entry_t *ent;
+  size_t num;
+  size_t num_alloc;
+};
 
 struct buffer {
   FILE *in;
@@ -48,9 +90,16 @@ struct buffer {
   size_t line;
   char *line_start;
   struct ps_ostream_t *os;
+  const struct ps_json_events_t *ev;
+  int skip;
+  size_t depth;
+  const char *path[MAX_DEPTH];
+  struct ps_tape_t *tape;
+  int lazy; /* Replay the tape, rather than recording it */
+  size_t tape_idx;
 };
 
-static struct ps_value_t *ParseValue(struct buffer *buf);
+static int ParseValue(struct buffer *buf);
 
 #define PRINT_ERR \
   fprintf(stderr, "Error parsing json at %zu:%zu\n", buf->line + 1, buf->loc - buf->line_start)
@@ -89,25 +138,221 @@ static size_t FillBuf(struct buffer *buf) {
 
 #define IS_EOF (buf->end == buf->buf)
 
+/* Vector scanning, a block at a time.  Masks have SCAN_BITS bits per
+ * byte of the block, set for the bytes that match. */
+#if defined(__GNUC__) && defined(__AVX2__)
+#define SCAN_BLOCK 32
+#define SCAN_BITS 1
+#define SCAN_FULL 0xFFFFFFFFu
+typedef uint32_t scan_mask_t;
+
+static scan_mask_t StringMask(const char *p) {
+  __m256i x = _mm256_loadu_si256((const __m256i *) p);
+  __m256i m;
+  
+  m = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')),
+		      _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\\')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_setzero_si256()));
+  return _mm256_movemask_epi8(m);
+}
+
+static scan_mask_t WhiteMask(const char *p, scan_mask_t *nl) {
+  __m256i x = _mm256_loadu_si256((const __m256i *) p);
+  __m256i t = _mm256_sub_epi8(x, _mm256_set1_epi8('\t'));
+  __m256i m;
+  
+  /* '\t' to '\r' or ' ' */
+  m = _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(4)), t);
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')));
+  *nl = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n')));
+  return _mm256_movemask_epi8(m);
+}
+#elif defined(__GNUC__) && defined(__SSE2__)
+#define SCAN_BLOCK 16
+#define SCAN_BITS 1
+#define SCAN_FULL 0xFFFFu
+typedef uint32_t scan_mask_t;
+
+static scan_mask_t StringMask(const char *p) {
+  __m128i x = _mm_loadu_si128((const __m128i *) p);
+  __m128i m;
+  
+  m = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('"')),
+		   _mm_cmpeq_epi8(x, _mm_set1_epi8('\\')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('\n')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_setzero_si128()));
+  return _mm_movemask_epi8(m);
+}
+
+static scan_mask_t WhiteMask(const char *p, scan_mask_t *nl) {
+  __m128i x = _mm_loadu_si128((const __m128i *) p);
+  __m128i t = _mm_sub_epi8(x, _mm_set1_epi8('\t'));
+  __m128i m;
+  
+  /* '\t' to '\r' or ' ' */
+  m = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(4)), t);
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8(' ')));
+  *nl = _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8('\n')));
+  return _mm_movemask_epi8(m);
+}
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)
+#define SCAN_BLOCK 16
+#define SCAN_BITS 4
+#define SCAN_FULL UINT64_MAX
+typedef uint64_t scan_mask_t;
+
+/* Narrows a byte mask to 4 bits per byte */
+static scan_mask_t NeonMask(uint8x16_t m) {
+  return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+}
+
+static scan_mask_t StringMask(const char *p) {
+  uint8x16_t x = vld1q_u8((const uint8_t *) p);
+  uint8x16_t m;
+  
+  m = vorrq_u8(vceqq_u8(x, vdupq_n_u8('"')), vceqq_u8(x, vdupq_n_u8('\\')));
+  m = vorrq_u8(m, vceqq_u8(x, vdupq_n_u8('\n')));
+  m = vorrq_u8(m, vceqq_u8(x, vdupq_n_u8(0)));
+  return NeonMask(m);
+}
+
+static scan_mask_t WhiteMask(const char *p, scan_mask_t *nl) {
+  uint8x16_t x = vld1q_u8((const uint8_t *) p);
+  uint8x16_t m;
+  
+  /* '\t' to '\r' or ' ' */
+  m = vcleq_u8(vsubq_u8(x, vdupq_n_u8('\t')), vdupq_n_u8(4));
+  m = vorrq_u8(m, vceqq_u8(x, vdupq_n_u8(' ')));
+  *nl = NeonMask(vceqq_u8(x, vdupq_n_u8('\n')));
+  return NeonMask(m);
+}
+#endif
+
+#ifdef SCAN_BLOCK
+#define MASK_FIRST(m) (__builtin_ctzll(m) / SCAN_BITS)
+#define MASK_LAST(m) ((63 - __builtin_clzll(m)) / SCAN_BITS)
+#define MASK_COUNT(m) (__builtin_popcountll(m) / SCAN_BITS)
+#endif
+
+/* White space as isspace in the C locale */
+static int IsWhite(char ch) {
+  return ch == ' ' || (ch >= '\t' && ch <= '\r');
+}
+
+/* Returns the first '"', '\\', newline or nul in [p, end), or end */
+static const char *FindStringEnd(const char *p, const char *end) {
+#ifdef SCAN_BLOCK
+  scan_mask_t m;
+  
+  for (; end - p >= SCAN_BLOCK; p += SCAN_BLOCK)
+    if ((m = StringMask(p)))
+      return p + MASK_FIRST(m);
+#endif
+  
+  for (; p < end; p++)
+    if (*p == '"' || *p == '\\' || *p == '\n' || *p == '\0')
+      break;
+  return p;
+}
+
+/* Returns the first non white space in [p, end), or end, counting the
+ * newlines before it and setting last_nl to the last one */
+static const char *FindNonWhite(const char *p, const char *end, size_t *lines, const char **last_nl) {
+#ifdef SCAN_BLOCK
+  scan_mask_t white, nl, stop;
+  
+  for (; end - p >= SCAN_BLOCK; p += SCAN_BLOCK) {
+    white = WhiteMask(p, &nl);
+    if ((stop = ~white & SCAN_FULL))
+      nl &= (stop & -stop) - 1;
+    if (nl) {
+      *lines += MASK_COUNT(nl);
+      *last_nl = p + MASK_LAST(nl);
+    }
+    if (stop)
+      return p + MASK_FIRST(stop);
+  }
+#endif
+  
+  for (; p < end && IsWhite(*p); p++) {
+    if (*p == '\n') {
+      (*lines)++;
+      *last_nl = p;
+    }
+  }
+  return p;
+}
+
+/* Skips white space in a buffer holding the whole input up to the first
+ * non white space, or the last white space, leaving eof to ADV */
+static void SkipWhiteMem(struct buffer *buf) {
+  const char *last_nl = NULL;
+  char *loc;
+  
+  if (buf->in || IS_EOF || !IsWhite(*buf->loc))
+    return;
+  
+  loc = (char *) FindNonWhite(buf->loc + 1, buf->end, &buf->line, &last_nl);
+  if (loc >= buf->end)
+    loc = buf->end - 1;
+  if (last_nl)
+    buf->line_start = (char *) last_nl;
+  buf->loc = loc;
+}
+
 #define SKIP_WHITE(eof_statements)		\
   do {						\
+    SkipWhiteMem(buf);				\
     while (!IS_EOF && isspace(*buf->loc))	\
       ADV(eof_statements);			\
   } while (0)
 
+/* Moves to loc, which must be in a buffer holding the whole input */
+static void Seek(struct buffer *buf, char *loc) {
+  if (loc == buf->loc)
+    return;
+  
+  buf->loc = loc;
+  if (loc >= buf->end)
+    FillBuf(buf);
+  else if (*loc == '\n') {
+    buf->line++;
+    buf->line_start = loc;
+  }
+}
+
+static int IsBare(char ch) {
+  return isalnum(ch) || ch == '.' || ch == '-' || ch == '+';
+}
+
+/* Compares the word in [str, end) */
+static int IsWord(const char *str, const char *end, const char *word) {
+  return (size_t) (end - str) == strlen(word) && memcmp(str, word, end - str) == 0;
+}
+
 static struct ps_value_t *ParseBare(struct buffer *buf) {
   char ch, temp[1024], *cur = temp, *end = temp + sizeof(temp) - 5;
   const char *str, *strend, *stop;
-  int is_float = 0;
+  int is_float;
   double f;
-  long long i;
-  struct ps_value_t *v;
+  int64_t i;
 
+  /* The whole input is in memory, parse the word in place */
+  if (buf->in == NULL) {
+    for (cur = buf->loc; cur < buf->end && IsBare(*cur); cur++)
+      ;
+    str = buf->loc;
+    strend = cur;
+    Seek(buf, cur);
+    goto parse;
+  }
+  
   PS_OStreamReset(buf->os);
   
   while (1) {
     ch = *buf->loc;
-    if (!isalnum(ch) && ch != '.' && ch != '-' && ch != '+')
+    if (!IsBare(ch))
       break;
     
     if (cur >= end) {
@@ -115,9 +360,6 @@ static struct ps_value_t *ParseBare(struct buffer *buf) {
       cur = temp;
     }
     
-    if (ch == '.' || ch == 'e' || ch == 'E')
-      is_float = 1;
-    
     *cur++ = ch;
     
     ADV(goto loop_done);
@@ -127,42 +369,30 @@ static struct ps_value_t *ParseBare(struct buffer *buf) {
   PS_WriteBuf(buf->os, temp, cur - temp);
   str = PS_OStreamContents(buf->os);
   strend = str + PS_OStreamLength(buf->os);
-  if (strcmp(str, "null") == 0)
+  
+ parse:
+  if (IsWord(str, strend, "null"))
     return PS_NewNull();
 
-  if (strcmp(str, "false") == 0)
+  if (IsWord(str, strend, "false"))
     return PS_NewBoolean(0);
 
-  if (strcmp(str, "true") == 0)
+  if (IsWord(str, strend, "true"))
     return PS_NewBoolean(1);
   
-  if (is_float) {
-    f = strtod(str, (char **) &stop);
-    if (stop != strend) {
-      PRINT_ERR;
-      if (stop == str)
-	fprintf(stderr, "Illegal bareword\n");
-      else
-	fprintf(stderr, "Unexpected garbage after float\n");
-      return NULL;
-    }
-    if ((v = PS_NewFloat(f)) == NULL)
-      return NULL;
-    return v;
-  }
-
-  i = strtoll(str, (char **) &stop, 0);
+  stop = ParseNumber(str, strend, &is_float, &i, &f);
   if (stop != strend) {
     PRINT_ERR;
     if (stop == str)
       fprintf(stderr, "Illegal bareword\n");
     else
-      fprintf(stderr, "Unexpected garbage after integer\n");
+      fprintf(stderr, "Unexpected garbage after %s\n", is_float ? "float" : "integer");
     return NULL;
   }
-  if ((v = PS_NewInteger(i)) == NULL)
-    return NULL;
-  return v;
+  
+  if (is_float)
+    return PS_NewFloat(f);
+  return PS_NewInteger(i);
 }
 
 static char *ParseHex4(struct buffer *buf, char *cur) {
@@ -206,11 +436,34 @@ static char *ParseHex4(struct buffer *buf, char *cur) {
   return NULL;
 }
 
+/* Finds a string without escapes in a buffer holding the whole input,
+ * moving past it.  Returns NULL if the string needs ParseString. */
+static const char *ScanString(struct buffer *buf, size_t *len) {
+  char *start, *cur;
+  
+  if (buf->in)
+    return NULL;
+  
+  start = buf->loc + 1;
+  cur = (char *) FindStringEnd(start, buf->end);
+  if (cur >= buf->end || *cur != '"')
+    return NULL;
+  
+  *len = cur - start;
+  Seek(buf, cur + 1);
+  return start;
+}
+
 static int ParseString(struct buffer *buf, struct ps_ostream_t *os) {
   char temp[1024], *cur = temp, *end = temp + sizeof(temp) - 5;
+  const char *str;
+  size_t len;
 
   PS_OStreamReset(os);
   
+  if ((str = ScanString(buf, &len)))
+    return PS_WriteBuf(os, str, len) < 0 ? -1 : 0;
+  
   while (1) {
     ADV(goto eof);
     
@@ -250,52 +503,141 @@ static int ParseString(struct buffer *buf, struct ps_ostream_t *os) {
   return -1;
 }
 
-static struct ps_value_t *ParseList(struct buffer *buf) {
-  struct ps_value_t *v, *sub;
+/* Records the start of an object or list, or steps over its entry when
+ * replaying */
+static int TapeBegin(struct buffer *buf, size_t *idx) {
+  struct ps_tape_t *tape = buf->tape;
+  struct tape_entry_t *ent;
+  size_t num_alloc;
+  
+  if (tape == NULL)
+    return 0;
+  
+  if (buf->lazy) {
+    *idx = buf->tape_idx++;
+    return 0;
+  }
   
-  if ((v = PS_NewList()) == NULL)
+  if (tape->num >= tape->num_alloc) {
+    num_alloc = tape->num_alloc ? 2 * tape->num_alloc : 256;
+    if ((ent = MemRealloc(tape->ent, tape->num_alloc * sizeof(*ent), num_alloc * sizeof(*ent), mem_other)) == NULL) {
+      fprintf(stderr, "Could not allocate memory for json tape\n");
+      return -1;
+    }
+    tape->ent = ent;
+    tape->num_alloc = num_alloc;
+  }
+  
+  *idx = tape->num++;
+  tape->ent[*idx].start = buf->loc - buf->buf;
+  return 0;
+}
+
+/* Must be called with loc at the closing bracket */
+static void TapeEnd(struct buffer *buf, size_t idx) {
+  if (buf->tape == NULL || buf->lazy)
+    return;
+  
+  buf->tape->ent[idx].end = buf->loc - buf->buf + 1;
+  buf->tape->ent[idx].next = buf->tape->num;
+}
+
+static int Push(struct buffer *buf, const char *key) {
+  if (buf->depth >= MAX_DEPTH) {
+    PRINT_ERR;
+    fprintf(stderr, "Json nested too deeply\n");
+    return -1;
+  }
+  
+  buf->path[buf->depth++] = key;
+  return 0;
+}
+
+/* Returns 1 if the member at the end of the path is to be parsed into
+ * events, 0 if it is to be skipped */
+static int Filter(struct buffer *buf) {
+  int ret;
+  
+  if (buf->skip || buf->ev->filter == NULL)
+    return 1;
+  
+  if ((ret = buf->ev->filter(buf->path, buf->depth, buf->ev->ref)) < 0)
+    return -1;
+  return ret != 0;
+}
+
+static int Begin(struct buffer *buf, enum ps_type_t type) {
+  if (buf->skip || buf->ev->begin == NULL)
+    return 0;
+  
+  return buf->ev->begin(buf->path, buf->depth, type, buf->ev->ref);
+}
+
+static int End(struct buffer *buf, enum ps_type_t type) {
+  if (buf->skip || buf->ev->end == NULL)
+    return 0;
+  
+  return buf->ev->end(buf->path, buf->depth, type, buf->ev->ref);
+}
+
+static int Value(struct buffer *buf, struct ps_value_t *v) {
+  if (buf->ev->value == NULL) {
+    PS_FreeValue(v);
+    return 0;
+  }
+  
+  return buf->ev->value(buf->path, buf->depth, v, buf->ev->ref);
+}
+
+static int ParseList(struct buffer *buf) {
+  size_t idx;
+  
+  if (TapeBegin(buf, &idx) < 0)
+    goto err;
+  if (Begin(buf, t_list) < 0)
     goto err;
   
   ADV(goto eof);
   SKIP_WHITE(goto eof);
   if (*buf->loc != ']') {
     while (1) {
-      if ((sub = ParseValue(buf)) == NULL)
-	goto err2;
-      if ((PS_AppendToList(v, sub)) < 0) {
-	PS_FreeValue(sub);
-	goto err2;
-      }
+      if (Push(buf, NULL) < 0)
+	goto err;
+      if (ParseValue(buf) < 0)
+	goto err;
+      buf->depth--;
       SKIP_WHITE(goto eof);
       if (*buf->loc == ']')
 	break;
       if (*buf->loc != ',') {
 	PRINT_ERR;
 	fprintf(stderr, "Expected either ',' or ']'\n");
-	goto err2;
+	goto err;
       }
       ADV(goto eof);
     }
   }
 
+  TapeEnd(buf, idx);
   ADV(;);
-  return v;
+  return End(buf, t_list);
   
  eof:
   fprintf(stderr, "Unexpected eof parsing list\n");
- err2:
-  PS_FreeValue(v);
  err:
-  return NULL;
+  return -1;
 }
 
-static struct ps_value_t *ParseObject(struct buffer *buf) {
-  struct ps_value_t *v = NULL, *sub;
+static int ParseObject(struct buffer *buf) {
   struct ps_ostream_t *name;
+  size_t idx;
+  int keep;
 
-  if ((v = PS_NewObject()) == NULL)
-    goto err;
   if ((name = PS_NewStrOStream()) == NULL)
+    goto err;
+  if (TapeBegin(buf, &idx) < 0)
+    goto err2;
+  if (Begin(buf, t_object) < 0)
     goto err2;
   
   ADV(goto eof);
@@ -306,122 +648,436 @@ static struct ps_value_t *ParseObject(struct buffer *buf) {
       if (*buf->loc != '"') {
 	PRINT_ERR;
 	fprintf(stderr, "Expected '\"' to start member name, found '%c'\n", *buf->loc);
-	goto err3;
+	goto err2;
       }
       if (ParseString(buf, name) < 0)
-	goto err3;
+	goto err2;
       
       SKIP_WHITE(goto eof);
       if (*buf->loc != ':') {
 	PRINT_ERR;
 	fprintf(stderr, "Expected ':' to delineate value, found '%c'\n", *buf->loc);
-	goto err3;
+	goto err2;
       }
       ADV(goto eof);
       
-      if ((sub = ParseValue(buf)) == NULL)
-	goto err3;
-      if ((PS_AddMember(v, PS_OStreamContents(name), sub)) < 0) {
-	PS_FreeValue(sub);
-	goto err3;
-      }
+      if (Push(buf, PS_OStreamContents(name)) < 0)
+	goto err2;
+      if ((keep = Filter(buf)) < 0)
+	goto err2;
+      buf->skip += !keep;
+      if (ParseValue(buf) < 0)
+	goto err2;
+      buf->skip -= !keep;
+      buf->depth--;
+      
       SKIP_WHITE(goto eof);
       if (*buf->loc == '}')
 	break;
       if (*buf->loc != ',') {
 	PRINT_ERR;
 	fprintf(stderr, "Expected either ',' or '}', found '%c'\n", *buf->loc);
-	goto err3;
+	goto err2;
       }
       ADV(goto eof);
     }
   }
   
   PS_FreeOStream(name);
+  TapeEnd(buf, idx);
   ADV(;);
-  return v;
+  return End(buf, t_object);
 
  eof:
   fprintf(stderr, "Unexpected eof parsing object\n");
- err3:
-  PS_FreeOStream(name);
  err2:
-  PS_FreeValue(v);
+  PS_FreeOStream(name);
  err:
-  return NULL;
+  return -1;
 }
 
-static struct ps_value_t *ParseValue(struct buffer *buf) {
-  SKIP_WHITE(goto eof);  
-  if (*buf->loc == '"') {
-    if (ParseString(buf, buf->os) < 0)
-      return NULL;
-    return PS_NewString(PS_OStreamContents(buf->os));
+/* Objects below the one being built are left to be parsed when used */
+static int LazyObject(struct buffer *buf) {
+  struct ps_tape_t *tape = buf->tape;
+  struct ps_value_t *v;
+  size_t idx = buf->tape_idx;
+  
+  tape->ref_count++;
+  if ((v = NewLazyObject(tape, idx)) == NULL) {
+    tape->ref_count--;
+    return -1;
   }
+  
+  buf->tape_idx = tape->ent[idx].next;
+  Seek(buf, buf->buf + tape->ent[idx].end);
+  return Value(buf, v);
+}
 
+static int ParseValue(struct buffer *buf) {
+  struct ps_value_t *v;
+  const char *str;
+  size_t len;
+  
+  SKIP_WHITE(goto eof);  
   if (*buf->loc == '[')
     return ParseList(buf);
 
+  if (*buf->loc == '{' && buf->lazy && buf->depth > 0)
+    return LazyObject(buf);
+  
   if (*buf->loc == '{')
     return ParseObject(buf);
   
-  return ParseBare(buf);
+  if (*buf->loc == '"') {
+    if ((str = ScanString(buf, &len)) == NULL) {
+      if (ParseString(buf, buf->os) < 0)
+	return -1;
+      str = PS_OStreamContents(buf->os);
+      len = strlen(str);
+    }
+    
+    /* Skipped strings are never copied out of the buffer */
+    if (buf->skip)
+      return 0;
+    v = PS_NewStringLen(str, len);
+  } else if ((v = ParseBare(buf)) && buf->skip) {
+    PS_FreeValue(v);
+    return 0;
+  }
+  
+  if (v == NULL)
+    return -1;
+  return Value(buf, v);
   
  eof:
   fprintf(stderr, "Unexpected eof parsing value\n");
-  return NULL;
+  return -1;
 }
 
-struct ps_value_t *PS_ParseJsonFile(FILE *in) {
+/* Without a handler for any of the values, they are all skipped */
+static int ParseInput(struct buffer *buf, const struct ps_json_events_t *ev) {
+  int ret;
+  
+  buf->ev = ev;
+  buf->skip = ev->begin == NULL && ev->end == NULL && ev->value == NULL;
+  buf->depth = 0;
+  
+  if ((buf->os = PS_NewStrOStream()) == NULL)
+    return -1;
+  
+  ret = ParseValue(buf);
+  
+  PS_FreeOStream(buf->os);
+  return ret;
+}
+
+static void InitMemBuffer(struct buffer *buf, const char *str, size_t len) {
+  buf->in = NULL;
+  buf->line = 0;
+  buf->line_start = buf->loc = buf->buf = (char *) str;
+  buf->end = buf->buf + len;
+  buf->tape = NULL;
+  buf->lazy = 0;
+  buf->tape_idx = 0;
+}
+
+#ifdef HAVE_MMAP
+/* Parses the rest of a regular file straight from a mapping of it.
+ * Returns 1 if the file cannot be mapped, so it should be read instead. */
+static int ParseMapped(FILE *in, const struct ps_json_events_t *ev, int *ret) {
   struct buffer buf;
-  struct ps_value_t *v = NULL;
+  struct stat st;
+  off_t off;
+  char *map;
   
-  if (in == NULL)
-    goto err;
+  if ((off = ftello(in)) < 0 || fstat(fileno(in), &st) < 0)
+    return 1;
+  if (!S_ISREG(st.st_mode) || st.st_size <= off || (uint64_t) st.st_size > SIZE_MAX)
+    return 1;
+  
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+  if (map == MAP_FAILED)
+    return 1;
+  
+  InitMemBuffer(&buf, map + off, st.st_size - off);
+  *ret = ParseInput(&buf, ev);
+  
+  munmap(map, st.st_size);
+  fseeko(in, 0, SEEK_END);
+  return 0;
+}
+#endif
 
-  memset(&buf, 0, sizeof(buf));
+int PS_ParseJsonEvents(FILE *in, const struct ps_json_events_t *ev) {
+  struct buffer buf;
+  int ret = -1;
+  
+  if (in == NULL || ev == NULL)
+    goto err;
   
-  if ((buf.buf = malloc(BUF_SZ)) == NULL) {
+#ifdef HAVE_MMAP
+  /* Watched files are expected to be edited, and a mapping of a file
+   * that is truncated meanwhile faults */
+  if (!WatchActive() && ParseMapped(in, ev, &ret) == 0)
+    goto err;
+#endif
+
+  if ((buf.buf = MemAlloc(BUF_SZ, mem_other)) == NULL) {
     fprintf(stderr, "Could not allocate memory for Json file buffer\n");
     goto err;
   }
   
+  buf.line = 0;
   buf.line_start = buf.loc = buf.end = buf.buf;
   buf.in = in;
-  if ((buf.os = PS_NewStrOStream()) == NULL)
-    goto err2;
+  buf.tape = NULL;
+  buf.lazy = 0;
   
   FillBuf(&buf);
-  v = ParseValue(&buf);
+  ret = ParseInput(&buf, ev);
   
-  /* Fall through */
-  PS_FreeOStream(buf.os);
- err2:
-  free(buf.buf);
+  MemFree(buf.buf, BUF_SZ, mem_other);
  err:
-  return v;
+  return ret;
 }
 
-struct ps_value_t *PS_ParseJsonString(const char *str) {
+int PS_ParseJsonEventsString(const char *str, const struct ps_json_events_t *ev) {
   struct buffer buf;
-  struct ps_value_t *v = NULL;
   
+  if (str == NULL || ev == NULL)
+    return -1;
+
+  InitMemBuffer(&buf, str, strlen(str));
+  return ParseInput(&buf, ev);
+}
+
+/* Builds values from events.  Objects and lists are added to their
+ * parent when they end, the open ones are kept in stack.  The
+ * outermost object is into, if set. */
+struct builder {
+  int (*filter)(const char *const *path, size_t depth, void *ref);
+  void *ref;
+  struct ps_value_t *into;
+  size_t open;
+  struct ps_value_t *root;
+  struct ps_value_t *stack[MAX_DEPTH + 1];
+};
+
+static int BuildFilter(const char *const *path, size_t depth, void *ref) {
+  struct builder *b = (struct builder *) ref;
+  
+  return b->filter(path, depth, b->ref);
+}
+
+static int BuildValue(const char *const *path, size_t depth, struct ps_value_t *v, void *ref) {
+  struct builder *b = (struct builder *) ref;
+  struct ps_value_t *parent;
+  int ret;
+  
+  if (depth == 0) {
+    b->root = v;
+    return 0;
+  }
+  
+  parent = b->stack[depth - 1];
+  if (path[depth - 1])
+    ret = PS_AddMember(parent, path[depth - 1], v);
+  else
+    ret = PS_AppendToList(parent, v);
+  
+  if (ret < 0)
+    PS_FreeValue(v);
+  return ret;
+}
+
+static int BuildBegin(const char *const *path, size_t depth, enum ps_type_t type, void *ref) {
+  struct builder *b = (struct builder *) ref;
+  struct ps_value_t *v;
+  
+  (void) path;
+  
+  if (depth == 0 && b->into)
+    v = b->into;
+  else if ((v = type == t_object ? PS_NewObject() : PS_NewList()) == NULL)
+    return -1;
+  
+  b->stack[depth] = v;
+  b->open = depth + 1;
+  return 0;
+}
+
+static int BuildEnd(const char *const *path, size_t depth, enum ps_type_t type, void *ref) {
+  struct builder *b = (struct builder *) ref;
+  
+  (void) type;
+  
+  b->open = depth;
+  return BuildValue(path, depth, b->stack[depth], ref);
+}
+
+static void InitBuilder(struct builder *b, struct ps_json_events_t *ev, int (*filter)(const char *const *path, size_t depth, void *ref), void *ref) {
+  b->filter = filter;
+  b->ref = ref;
+  b->into = NULL;
+  b->open = 0;
+  b->root = NULL;
+  
+  ev->filter = filter ? BuildFilter : NULL;
+  ev->begin = BuildBegin;
+  ev->end = BuildEnd;
+  ev->value = BuildValue;
+  ev->ref = b;
+}
+
+static struct ps_value_t *FinishBuilder(struct builder *b, int ret) {
+  struct ps_value_t *v;
+  
+  if (ret < 0) {
+    /* Open values own everything parsed so far */
+    while (b->open > 0) {
+      v = b->stack[--b->open];
+      if (v != b->into)
+	PS_FreeValue(v);
+    }
+    return NULL;
+  }
+  
+  return b->root;
+}
+
+static struct ps_value_t *Build(FILE *in, const char *str, int (*filter)(const char *const *path, size_t depth, void *ref), void *ref) {
+  struct ps_json_events_t ev;
+  struct builder b;
+  int ret;
+  
+  InitBuilder(&b, &ev, filter, ref);
+  
+  if (in)
+    ret = PS_ParseJsonEvents(in, &ev);
+  else
+    ret = PS_ParseJsonEventsString(str, &ev);
+  
+  return FinishBuilder(&b, ret);
+}
+
+struct ps_value_t *PS_ParseJsonFile(FILE *in) {
+  if (in == NULL)
+    return NULL;
+  
+  return Build(in, NULL, NULL, NULL);
+}
+
+struct ps_value_t *PS_ParseJsonFileFiltered(FILE *in, int (*filter)(const char *const *path, size_t depth, void *ref), void *ref) {
+  if (in == NULL)
+    return NULL;
+  
+  return Build(in, NULL, filter, ref);
+}
+
+struct ps_value_t *PS_ParseJsonString(const char *str) {
   if (str == NULL)
-    goto err;
+    return NULL;
+  
+  return Build(NULL, str, NULL, NULL);
+}
 
-  memset(&buf, 0, sizeof(buf));
+void TapeRelease(struct ps_tape_t *tape) {
+  if (tape == NULL || tape->ref_count-- > 1)
+    return;
   
-  buf.line_start = buf.loc = buf.buf = (char *) str;
-  buf.end = buf.buf + strlen(str);
-  buf.in = NULL;
+  MemFree(tape->ent, tape->num_alloc * sizeof(*tape->ent), mem_other);
+  MemFree(tape->text, tape->text_alloc, mem_other);
+  MemFree(tape, sizeof(*tape), mem_other);
+}
+
+/* Reads the rest of the file into a new tape */
+static struct ps_tape_t *ReadTape(FILE *in) {
+  struct ps_tape_t *tape;
+  size_t num, text_alloc;
+  char *text;
   
-  if ((buf.os = PS_NewStrOStream()) == NULL)
+  if ((tape = MemAlloc(sizeof(*tape), mem_other)) == NULL)
     goto err;
+  memset(tape, 0, sizeof(*tape));
+  tape->ref_count = 1;
   
-  v = ParseValue(&buf);
+  do {
+    if (tape->len >= tape->text_alloc) {
+      text_alloc = tape->text_alloc ? 2 * tape->text_alloc : 16 * BUF_SZ;
+      if ((text = MemRealloc(tape->text, tape->text_alloc, text_alloc, mem_other)) == NULL)
+	goto err2;
+      tape->text = text;
+      tape->text_alloc = text_alloc;
+    }
+    
+    num = fread(tape->text + tape->len, 1, tape->text_alloc - tape->len, in);
+    tape->len += num;
+  } while (num > 0);
+  
+  if (ferror(in)) {
+    fprintf(stderr, "Error reading json file\n");
+    goto err2;
+  }
   
-  /* Fall through */
-  PS_FreeOStream(buf.os);
+  return tape;
+  
+ err2:
+  TapeRelease(tape);
  err:
+  fprintf(stderr, "Could not read json file for lazy parsing\n");
+  return NULL;
+}
+
+/* Builds the value starting at entry idx, at the start of the text if
+ * there is none */
+static struct ps_value_t *BuildTape(struct ps_tape_t *tape, size_t idx, struct ps_value_t *into) {
+  struct ps_json_events_t ev;
+  struct builder b;
+  struct buffer buf;
+  
+  InitBuilder(&b, &ev, NULL, NULL);
+  b.into = into;
+  
+  InitMemBuffer(&buf, tape->text, tape->len);
+  if (idx < tape->num)
+    buf.loc = buf.buf + tape->ent[idx].start;
+  buf.tape = tape;
+  buf.lazy = 1;
+  buf.tape_idx = idx;
+  
+  return FinishBuilder(&b, ParseInput(&buf, &ev));
+}
+
+int TapeMaterialize(struct ps_tape_t *tape, size_t idx, struct ps_value_t *obj) {
+  return BuildTape(tape, idx, obj) == NULL ? -1 : 0;
+}
+
+struct ps_value_t *PS_ParseJsonFileLazy(FILE *in) {
+  struct ps_json_events_t ev;
+  struct ps_tape_t *tape;
+  struct ps_value_t *v;
+  struct buffer buf;
+  
+  if (in == NULL)
+    return NULL;
+  
+  /* Lazy objects must not be released with an arena */
+  if (ArenaActive())
+    return PS_ParseJsonFile(in);
+  
+  if ((tape = ReadTape(in)) == NULL)
+    return NULL;
+  
+  /* Checks the whole text and records where its objects are */
+  memset(&ev, 0, sizeof(ev));
+  InitMemBuffer(&buf, tape->text, tape->len);
+  buf.tape = tape;
+  if (ParseInput(&buf, &ev) < 0) {
+    TapeRelease(tape);
+    return NULL;
+  }
+  
+  v = BuildTape(tape, 0, NULL);
+  TapeRelease(tape);
   return v;
 }
@@ -33,11 +33,17 @@
 #include <stdint.h>
 
 #include <string.h>
+#include <dirent.h>
 
+#include "printer_settings.h"
 #include "ps_path.h"
+#include "ps_arena.h"
+#include "ps_watch.h"
 
 #define PATHSEP '/'
 
+static const char sep[] = {PATHSEP, '\0'};
+
 struct ps_value_t *PS_PathFromString(const char *str) {
   struct ps_value_t *p, *v;
   const char *dir, *ext;
@@ -80,32 +86,45 @@ struct ps_value_t *PS_PathFromString(const char *str) {
   return NULL;
 }
 
+/* Joins up to three strings into memory from MemAlloc, which is freed
+ * with strlen + 1 */
+static char *Join(const char *a, const char *b, const char *c) {
+  size_t la, lb, lc;
+  char *str;
+  
+  la = strlen(a);
+  lb = strlen(b);
+  lc = c ? strlen(c) : 0;
+  if ((str = MemAlloc(la + lb + lc + 1, mem_other)) == NULL)
+    return NULL;
+  
+  memcpy(str, a, la);
+  memcpy(str + la, b, lb);
+  memcpy(str + la + lb, c ? c : "", lc + 1);
+  return str;
+}
+
+static void FreeJoined(char *str) {
+  if (str)
+    MemFree(str, strlen(str) + 1, mem_other);
+}
+
 struct ps_value_t *PS_PathToString(const struct ps_value_t *path) {
+  const char *dir, *base, *ext;
   struct ps_value_t *s;
-  const struct ps_value_t *v;
-  const char *str;
+  char *str;
   
-  if ((v = PS_GetMember(path, "directory", NULL)) == NULL ||
-      (str = PS_GetString(v)) == NULL ||
-      (s = PS_NewString(str)) == NULL)
-    goto err;
-
-  if ((v = PS_GetMember(path, "basename", NULL)) == NULL ||
-      (str = PS_GetString(v)) == NULL ||
-      PS_AppendToString(s, str) < 0)
-    goto err2;
+  if ((dir = PS_GetString(PS_GetMember(path, "directory", NULL))) == NULL ||
+      (base = PS_GetString(PS_GetMember(path, "basename", NULL))) == NULL ||
+      (ext = PS_GetString(PS_GetMember(path, "extension", NULL))) == NULL)
+    return NULL;
   
-  if ((v = PS_GetMember(path, "extension", NULL)) == NULL ||
-      (str = PS_GetString(v)) == NULL ||
-      PS_AppendToString(s, str) < 0)
-    goto err2;
+  if ((str = Join(dir, base, ext)) == NULL)
+    return NULL;
   
+  s = PS_NewString(str);
+  FreeJoined(str);
   return s;
-
- err2:
-  PS_FreeValue(s);
- err:
-  return NULL;
 }
 
 int PS_IsPathAbsolute(const struct ps_value_t *path) {
@@ -119,38 +138,125 @@ int PS_IsPathAbsolute(const struct ps_value_t *path) {
   return *str == PATHSEP;
 }
 
-static void EnsureSlash(struct ps_value_t *v) {
-  const char *str;
-  char aa[2];
-  size_t len;
+/* The names in each directory searched, by directory, so a file is
+ * found without trying to open it in every directory */
+static struct ps_value_t *dir_index;
 
-  if ((str = PS_GetString(v)) == NULL)
-    return;
+static struct ps_value_t *ScanDirectory(const char *dir) {
+  struct ps_value_t *names;
+  struct dirent *de;
+  DIR *dd;
+  
+  if ((names = PS_NewObject()) == NULL)
+    goto err;
+  
+  /* A missing directory has no files */
+  if ((dd = opendir(*dir ? dir : ".")) == NULL)
+    return names;
+  
+  while ((de = readdir(dd)))
+    if (PS_AddMember(names, de->d_name, PS_NewNull()) < 0)
+      goto err2;
+  
+  closedir(dd);
+  return names;
+  
+ err2:
+  closedir(dd);
+  PS_FreeValue(names);
+ err:
+  return NULL;
+}
 
-  if (*str == '\0')
-    return;
+/* Returns whether dir has a file called name.  Callers hold
+ * lock_search.  While watching, only directories that are watched are
+ * kept in the index. */
+static int InDirectory(const char *dir, const char *name) {
+  const struct ps_value_t *names;
+  struct ps_value_t *scan;
+  int found, keep;
+  
+  if (dir_index == NULL && (dir_index = PS_NewObject()) == NULL)
+    return 0;
+  
+  if ((names = PS_GetMember(dir_index, dir, NULL)))
+    goto found;
+  
+  keep = !WatchActive() || WatchDirectory(dir) == 0;
+  if ((scan = ScanDirectory(dir)) == NULL)
+    return 0;
+  
+  if (!keep || PS_AddMember(dir_index, dir, scan) < 0) {
+    PS_GetMember(scan, name, &found);
+    PS_FreeValue(scan);
+    return found;
+  }
+  names = scan;
+  
+ found:
+  PS_GetMember(names, name, &found);
+  return found;
+}
 
-  len = strlen(str);
-  if (str[len - 1] == PATHSEP)
-    return;
+static int IsIndexed(const char *dir, const char *name) {
+  int found, depth;
+  
+  depth = ArenaSuspend();
+  LockShared(lock_search);
+  found = InDirectory(dir, name);
+  UnlockShared(lock_search);
+  ArenaResume(depth);
   
-  aa[0] = PATHSEP;
-  aa[1] = '\0';
-  PS_AppendToString(v, aa);
+  return found;
 }
 
-FILE *PS_OpenSearch(const char *filename, const char *mode, const struct ps_value_t *default_ext, const struct ps_value_t *search, struct ps_value_t **final_out) {
-  struct ps_value_t *p, *d, *s;
-  const struct ps_value_t *v;
-  const char *str, *dstr;
+/* Opens dir/name from a search path, or returns NULL without a system
+ * call if the index has no such file */
+static FILE *OpenIndexed(const char *dir, const char *name, const char *mode) {
+  char *full;
   FILE *ff;
-  size_t count;
+  
+  if (!IsIndexed(dir, name) || (full = Join(dir, name, NULL)) == NULL)
+    return NULL;
+  
+  /* If the index is out of date, read the directory again next time */
+  if ((ff = fopen(full, mode)) == NULL)
+    PS_ForgetDirectory(dir);
+  
+  FreeJoined(full);
+  return ff;
+}
 
+void PS_ForgetDirectory(const char *dir) {
+  int depth;
+  
+  depth = ArenaSuspend();
+  LockShared(lock_search);
+  PS_RemoveMember(dir_index, dir);
+  UnlockShared(lock_search);
+  ArenaResume(depth);
+}
+
+void PS_ClearSearchIndex(void) {
+  int depth;
+  
+  depth = ArenaSuspend();
+  LockShared(lock_search);
+  PS_FreeValue(dir_index);
+  dir_index = NULL;
+  UnlockShared(lock_search);
+  ArenaResume(depth);
+}
+
+/* The path of filename, with default_ext if it has no extension */
+static struct ps_value_t *SearchPath(const char *filename, const struct ps_value_t *default_ext) {
+  struct ps_value_t *p, *d;
+  const char *str;
+  
   if ((p = PS_PathFromString(filename)) == NULL)
     goto err;
   
-  if ((v = PS_GetMember(p, "extension", NULL)) == NULL ||
-      (str = PS_GetString(v)) == NULL)
+  if ((str = PS_GetString(PS_GetMember(p, "extension", NULL))) == NULL)
     goto err2;
   
   if (*str == '\0' && default_ext) {
@@ -162,6 +268,50 @@ FILE *PS_OpenSearch(const char *filename, const char *mode, const struct ps_valu
     }
   }
   
+  return p;
+  
+ err2:
+  PS_FreeValue(p);
+ err:
+  return NULL;
+}
+
+static char *SearchName(const struct ps_value_t *p) {
+  return Join(PS_GetString(PS_GetMember(p, "basename", NULL)), PS_GetString(PS_GetMember(p, "extension", NULL)), NULL);
+}
+
+/* The directory dstr, relative to a directory on the search path */
+static char *SearchDir(const char *str, const char *dstr) {
+  if (*str && str[strlen(str) - 1] != PATHSEP)
+    return Join(str, sep, dstr);
+  
+  return Join(str, dstr, NULL);
+}
+
+static int SetDirectory(struct ps_value_t *p, const char *dir) {
+  struct ps_value_t *s;
+  
+  if ((s = PS_NewString(dir)) == NULL)
+    return -1;
+  
+  if (PS_AddMember(p, "directory", s) < 0) {
+    PS_FreeValue(s);
+    return -1;
+  }
+  
+  return 0;
+}
+
+FILE *PS_OpenSearch(const char *filename, const char *mode, const struct ps_value_t *default_ext, const struct ps_value_t *search, struct ps_value_t **final_out) {
+  struct ps_value_t *p, *s;
+  const char *str, *dstr;
+  char *dir, *name;
+  FILE *ff;
+  size_t count;
+
+  if ((p = SearchPath(filename, default_ext)) == NULL)
+    goto err;
+  
   if ((s = PS_PathToString(p)) == NULL)
     goto err2;
   if ((str = PS_GetString(s)) == NULL)
@@ -172,40 +322,25 @@ FILE *PS_OpenSearch(const char *filename, const char *mode, const struct ps_valu
   PS_FreeValue(s);
   
   if (ff == NULL && search && !PS_IsPathAbsolute(p)) {
-    count = 0;
-    if ((v = PS_GetMember(p, "directory", NULL)) == NULL)
-      goto err2;
-    d = PS_CopyValue(v);
-    if ((dstr = PS_GetString(d)) == NULL) {
-      PS_FreeValue(d);
+    if ((dstr = PS_GetString(PS_GetMember(p, "directory", NULL))) == NULL ||
+	(name = SearchName(p)) == NULL)
       goto err2;
-    }
-    while (ff == NULL) {
-      if ((v = PS_GetItem(search, count++)) == NULL) {
-	PS_FreeValue(d);
-	goto err2;
-      }
-      s = PS_CopyValue(v);
-      EnsureSlash(s);
-      if (PS_AppendToString(s, dstr) < 0 ||
-	  PS_AddMember(p, "directory", s) < 0) {
-	PS_FreeValue(d);
-	goto err3;
-      }
-
-      if ((s = PS_PathToString(p)) == NULL) {
-	PS_FreeValue(d);
+    
+    for (count = 0; ff == NULL && (str = PS_GetString(PS_GetItem(search, count))); count++) {
+      if ((dir = SearchDir(str, dstr)) == NULL)
+	break;
+      
+      if ((ff = OpenIndexed(dir, name, mode)) && SetDirectory(p, dir) < 0) {
+	fclose(ff);
+	FreeJoined(dir);
+	FreeJoined(name);
 	goto err2;
       }
-      if ((str = PS_GetString(s)) == NULL) {
-	PS_FreeValue(d);
-	goto err3;
-      }
-      
-      ff = fopen(str, mode);
-      PS_FreeValue(s);
+      FreeJoined(dir);
     }
-    PS_FreeValue(d);
+    FreeJoined(name);
+    if (ff == NULL)
+      goto err2;
   } else if (ff == NULL)
     goto err2;
 
@@ -223,3 +358,108 @@ FILE *PS_OpenSearch(const char *filename, const char *mode, const struct ps_valu
  err:
   return NULL;
 }
+
+struct ps_value_t *PS_FindSearch(const char *filename, const struct ps_value_t *default_ext, const struct ps_value_t *search) {
+  struct ps_value_t *p;
+  const char *str, *dstr;
+  char *dir, *name;
+  size_t count;
+  int found;
+  
+  if ((p = SearchPath(filename, default_ext)) == NULL)
+    goto err;
+  
+  if ((dstr = PS_GetString(PS_GetMember(p, "directory", NULL))) == NULL ||
+      (name = SearchName(p)) == NULL)
+    goto err2;
+  
+  found = IsIndexed(dstr, name);
+  for (count = 0; !found && search && !PS_IsPathAbsolute(p) && (str = PS_GetString(PS_GetItem(search, count))); count++) {
+    if ((dir = SearchDir(str, dstr)) == NULL)
+      break;
+    
+    found = IsIndexed(dir, name);
+    if (found && SetDirectory(p, dir) < 0) {
+      FreeJoined(dir);
+      FreeJoined(name);
+      goto err2;
+    }
+    FreeJoined(dir);
+  }
+  FreeJoined(name);
+  if (!found)
+    goto err2;
+  
+  return p;
+  
+ err2:
+  PS_FreeValue(p);
+ err:
+  return NULL;
+}
+
+struct ps_value_t *PS_SearchMisses(const char *filename, const struct ps_value_t *default_ext, const struct ps_value_t *search, const struct ps_value_t *final) {
+  struct ps_value_t *misses, *p, *f, *s;
+  const char *str, *dstr, *fstr;
+  char *dir, *name, *full;
+  size_t count;
+  
+  if ((misses = PS_NewList()) == NULL)
+    goto err;
+  if ((p = SearchPath(filename, default_ext)) == NULL)
+    goto err2;
+  if ((f = PS_PathToString(final)) == NULL)
+    goto err3;
+  fstr = PS_GetString(f);
+  
+  if ((s = PS_PathToString(p)) == NULL)
+    goto err4;
+  if (strcmp(PS_GetString(s), fstr) == 0 || search == NULL || PS_IsPathAbsolute(p)) {
+    PS_FreeValue(s);
+    goto done;
+  }
+  if (PS_AppendToList(misses, s) < 0) {
+    PS_FreeValue(s);
+    goto err4;
+  }
+  
+  if ((dstr = PS_GetString(PS_GetMember(p, "directory", NULL))) == NULL ||
+      (name = SearchName(p)) == NULL)
+    goto err4;
+  
+  for (count = 0; (str = PS_GetString(PS_GetItem(search, count))); count++) {
+    if ((dir = SearchDir(str, dstr)) == NULL)
+      goto err5;
+    full = Join(dir, name, NULL);
+    FreeJoined(dir);
+    if (full == NULL)
+      goto err5;
+    
+    if (strcmp(full, fstr) == 0) {
+      FreeJoined(full);
+      break;
+    }
+    if (PS_AppendToList(misses, PS_NewString(full)) < 0) {
+      FreeJoined(full);
+      goto err5;
+    }
+    FreeJoined(full);
+  }
+  FreeJoined(name);
+  
+ done:
+  PS_FreeValue(f);
+  PS_FreeValue(p);
+  return misses;
+  
+ err5:
+  FreeJoined(name);
+ err4:
+  PS_FreeValue(f);
+ err3:
+  PS_FreeValue(p);
+ err2:
+  PS_FreeValue(misses);
+ err:
+  return NULL;
+}
@@ -38,5 +38,12 @@ struct ps_value_t *PS_PathToString(const struct ps_value_t *path);
 int PS_IsPathAbsolute(const struct ps_value_t *path);
 
 FILE *PS_OpenSearch(const char *filename, const char *mode, const struct ps_value_t *default_ext, const struct ps_value_t *search, struct ps_value_t **final_out);
+/* Resolves filename as PS_OpenSearch would, but only from the index of
+ * the directories, which is kept up to date while watching */
+struct ps_value_t *PS_FindSearch(const char *filename, const struct ps_value_t *default_ext, const struct ps_value_t *search);
+/* Returns the list of paths tried for filename before it was found at
+ * final, a file added at any of them would be found instead */
+struct ps_value_t *PS_SearchMisses(const char *filename, const struct ps_value_t *default_ext, const struct ps_value_t *search, const struct ps_value_t *final);
+void PS_ForgetDirectory(const char *dir);
 
 #endif
@@ -110,65 +110,58 @@ static void DestroyArgs(struct args_t *args) {
 
 static int AddSettings(struct args_t *args, const struct ps_value_t *settings) {
   struct ps_ostream_t *os;
-  struct ps_value_iterator_t *vi_ext, *vi_set;
+  struct ps_value_iterator_t vi_ext, vi_set;
   struct ps_value_t *val;
   const char *ext, *name;
   
   if ((os = PS_NewStrOStream()) == NULL)
     goto err;
   
-  if ((vi_ext = PS_NewValueIterator(settings)) == NULL)
+  if (PS_InitValueIterator(&vi_ext, settings) < 0)
     goto err2;
   
-  while (PS_ValueIteratorNext(vi_ext)) {
-    ext = PS_ValueIteratorKey(vi_ext);
+  while (PS_ValueIteratorNext(&vi_ext)) {
+    ext = PS_ValueIteratorKey(&vi_ext);
     
     if (strcmp(ext, "#global") != 0) {
       PS_OStreamReset(os);
       if (PS_WriteStr(os, "-e") < 0)
-	goto err3;
+	goto err2;
       if (PS_WriteStr(os, ext) < 0)
-	goto err3;
+	goto err2;
       if (AddArg(args, PS_OStreamContents(os)) < 0)
-	goto err3;
+	goto err2;
     }
 	       
-    if ((vi_set = PS_NewValueIterator(PS_ValueIteratorData(vi_ext))) == NULL)
-      goto err3;
+    if (PS_InitValueIterator(&vi_set, PS_ValueIteratorData(&vi_ext)) < 0)
+      goto err2;
     
-    while (PS_ValueIteratorNext(vi_set)) {
-      name = PS_ValueIteratorKey(vi_set);
-      val = PS_ValueIteratorData(vi_set);
+    while (PS_ValueIteratorNext(&vi_set)) {
+      name = PS_ValueIteratorKey(&vi_set);
+      val = PS_ValueIteratorData(&vi_set);
       
       if (AddArg(args, "-s") < 0)
-	goto err4;
+	goto err2;
       PS_OStreamReset(os);
       if (PS_WriteStr(os, name) < 0)
-	goto err4;
+	goto err2;
       if (PS_WriteChar(os, '=') < 0)
-	goto err4;
+	goto err2;
       if (PS_GetType(val) == t_string) {
 	if (PS_WriteStr(os, PS_GetString(val)) < 0)
-	  goto err4;
+	  goto err2;
       } else {
 	if (PS_WriteValue(os, val) < 0)
-	  goto err4;
+	  goto err2;
       }
       if (AddArg(args, PS_OStreamContents(os)) < 0)
-	goto err4;
+	goto err2;
     }
-    
-    PS_FreeValueIterator(vi_set);
   }
   
-  PS_FreeValueIterator(vi_ext);
   PS_FreeOStream(os);
   return 0;
   
- err4:
-  PS_FreeValueIterator(vi_set);
- err3:
-  PS_FreeValueIterator(vi_ext);
  err2:
   PS_FreeOStream(os);
  err:
@@ -0,0 +1,589 @@
+/*
+  Copyright (C) 2018 Paul Maurer
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+  
+  1. Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+  
+  2. Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+  
+  3. Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from this
+  software without specific prior written permission.
+  
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#include "ps_value.h"
+#include "ps_ostream.h"
+#include "ps_arena.h"
+#include "ps_snapshot.h"
+
+/* A snapshot holds, in native byte order:
+ *
+ *   magic, version and byte order mark
+ *   printer and search, as passed to PS_New
+ *   [path, mtime, size, hash, misses] of every definition file loaded
+ *   the value returned by PS_New
+ *
+ * Values are a tag byte and their contents.  Strings, and object
+ * member names, are a 32 bit length and the bytes, lists and objects
+ * a 32 bit count and the items or members.  misses are a 32 bit count
+ * and the paths searched before the file, which had no file. */
+#define SNAPSHOT_MAGIC "PSSNAP\r\n"
+#define SNAPSHOT_VERSION 2
+#define BYTE_ORDER_MARK 0x01020304
+#define MAX_DEPTH 256
+
+enum {
+  s_null,
+  s_false,
+  s_true,
+  s_integer,
+  s_float,
+  s_string,
+  s_variable,
+  s_builtin_func,
+  s_list,
+  s_function,
+  s_object
+};
+
+struct reader {
+  const char *loc;
+  const char *end;
+  struct ps_ostream_t *key;
+  int check;
+};
+
+static int WriteU32(struct ps_ostream_t *os, size_t val) {
+  uint32_t v = val;
+  
+  if (val > UINT32_MAX) {
+    fprintf(stderr, "Value too large for snapshot\n");
+    return -1;
+  }
+  
+  return PS_WriteBuf(os, (const char *) &v, sizeof(v)) < 0 ? -1 : 0;
+}
+
+static int WriteStr(struct ps_ostream_t *os, const char *str) {
+  size_t len = strlen(str);
+  
+  if (WriteU32(os, len) < 0)
+    return -1;
+  return PS_WriteBuf(os, str, len) < 0 ? -1 : 0;
+}
+
+static int EncodeValue(struct ps_ostream_t *os, const struct ps_value_t *v, int depth) {
+  struct ps_value_iterator_t vi;
+  enum ps_type_t type = PS_GetType(v);
+  size_t count, num;
+  int64_t i;
+  double f;
+  
+  if (depth > MAX_DEPTH) {
+    fprintf(stderr, "Value nested too deeply for snapshot\n");
+    return -1;
+  }
+  
+  switch (type) {
+  case t_null:
+    return PS_WriteChar(os, s_null) < 0 ? -1 : 0;
+    
+  case t_boolean:
+    return PS_WriteChar(os, PS_AsBoolean(v) ? s_true : s_false) < 0 ? -1 : 0;
+    
+  case t_integer:
+    i = PS_AsInteger(v);
+    if (PS_WriteChar(os, s_integer) < 0)
+      return -1;
+    return PS_WriteBuf(os, (const char *) &i, sizeof(i)) < 0 ? -1 : 0;
+    
+  case t_float:
+    f = PS_AsFloat(v);
+    if (PS_WriteChar(os, s_float) < 0)
+      return -1;
+    return PS_WriteBuf(os, (const char *) &f, sizeof(f)) < 0 ? -1 : 0;
+    
+  case t_string:
+  case t_variable:
+  case t_builtin_func:
+    if (PS_WriteChar(os, type == t_string ? s_string : type == t_variable ? s_variable : s_builtin_func) < 0)
+      return -1;
+    return WriteStr(os, PS_GetString(v));
+    
+  case t_list:
+  case t_function:
+    num = PS_ItemCount(v);
+    if (PS_WriteChar(os, type == t_list ? s_list : s_function) < 0 || WriteU32(os, num) < 0)
+      return -1;
+    for (count = 0; count < num; count++)
+      if (EncodeValue(os, PS_GetItem(v, count), depth + 1) < 0)
+	return -1;
+    return 0;
+    
+  case t_object:
+    if (PS_WriteChar(os, s_object) < 0 || WriteU32(os, PS_ItemCount(v)) < 0)
+      return -1;
+    if (PS_InitValueIterator(&vi, v) < 0)
+      return -1;
+    while (PS_ValueIteratorNext(&vi)) {
+      if (WriteStr(os, PS_ValueIteratorKey(&vi)) < 0)
+	return -1;
+      if (EncodeValue(os, PS_ValueIteratorData(&vi), depth + 1) < 0)
+	return -1;
+    }
+    return 0;
+    
+  default:
+    fprintf(stderr, "Cannot save value of type %d in snapshot\n", type);
+    return -1;
+  }
+}
+
+static int Read(struct reader *r, void *data, size_t len) {
+  if ((size_t) (r->end - r->loc) < len)
+    return -1;
+  
+  memcpy(data, r->loc, len);
+  r->loc += len;
+  return 0;
+}
+
+/* Returns the string in place, it is not terminated */
+static const char *ReadStr(struct reader *r, uint32_t *len) {
+  const char *str;
+  
+  if (Read(r, len, sizeof(*len)) < 0 || r->end - r->loc < *len)
+    return NULL;
+  
+  str = r->loc;
+  r->loc += *len;
+  return str;
+}
+
+static struct ps_value_t *DecodeValue(struct reader *r, int depth) {
+  struct ps_value_t *v, *memb;
+  const char *str;
+  uint32_t num, count, len;
+  uint8_t tag;
+  int64_t i;
+  double f;
+  
+  if (depth > MAX_DEPTH || Read(r, &tag, sizeof(tag)) < 0)
+    goto err;
+  
+  switch (tag) {
+  case s_null:
+    return PS_NewNull();
+    
+  case s_false:
+  case s_true:
+    return PS_NewBoolean(tag == s_true);
+    
+  case s_integer:
+    if (Read(r, &i, sizeof(i)) < 0)
+      goto err;
+    return PS_NewInteger(i);
+    
+  case s_float:
+    if (Read(r, &f, sizeof(f)) < 0)
+      goto err;
+    return PS_NewFloat(f);
+    
+  case s_string:
+    if ((str = ReadStr(r, &len)) == NULL)
+      goto err;
+    return PS_NewStringLen(str, len);
+    
+  case s_variable:
+    if ((str = ReadStr(r, &len)) == NULL)
+      goto err;
+    return PS_NewVariableLen(str, len);
+    
+  case s_builtin_func:
+    if ((str = ReadStr(r, &len)) == NULL)
+      goto err;
+    return PS_NewBuiltinFuncLen(str, len);
+    
+  case s_list:
+  case s_function:
+    /* Every item takes at least a byte */
+    if (Read(r, &num, sizeof(num)) < 0 || num > r->end - r->loc)
+      goto err;
+    if ((v = tag == s_list ? PS_NewListCap(num) : PS_NewFunction(NULL)) == NULL)
+      goto err;
+    for (count = 0; count < num; count++) {
+      if ((memb = DecodeValue(r, depth + 1)) == NULL)
+	goto err2;
+      if (PS_AppendToList(v, memb) < 0)
+	goto err3;
+    }
+    return v;
+    
+  case s_object:
+    if (Read(r, &num, sizeof(num)) < 0 || num > r->end - r->loc)
+      goto err;
+    if ((v = PS_NewObject()) == NULL)
+      goto err;
+    for (count = 0; count < num; count++) {
+      if ((str = ReadStr(r, &len)) == NULL)
+	goto err2;
+      if ((memb = DecodeValue(r, depth + 1)) == NULL)
+	goto err2;
+      /* The name is terminated after decoding the member, which may
+       * need the buffer itself */
+      PS_OStreamReset(r->key);
+      if (PS_WriteBuf(r->key, str, len) < 0)
+	goto err3;
+      if (PS_AddMember(v, PS_OStreamContents(r->key), memb) < 0)
+	goto err3;
+    }
+    return v;
+    
+  default:
+    goto err;
+  }
+  
+ err3:
+  PS_FreeValue(memb);
+ err2:
+  PS_FreeValue(v);
+ err:
+  return NULL;
+}
+
+/* FNV-1a */
+static int HashFile(const char *path, uint64_t *hash) {
+  unsigned char buf[4096];
+  size_t num, count;
+  uint64_t h = 0xCBF29CE484222325ULL;
+  FILE *file;
+  
+  if ((file = fopen(path, "rb")) == NULL)
+    return -1;
+  
+  while ((num = fread(buf, 1, sizeof(buf), file)) > 0)
+    for (count = 0; count < num; count++)
+      h = (h ^ buf[count]) * 0x100000001B3ULL;
+  
+  if (ferror(file)) {
+    fclose(file);
+    return -1;
+  }
+  
+  fclose(file);
+  *hash = h;
+  return 0;
+}
+
+static int EncodeMisses(struct ps_ostream_t *os, const char *path, const struct ps_value_t *misses) {
+  const char *miss;
+  struct stat st;
+  size_t count;
+  
+  if (WriteU32(os, PS_ItemCount(misses)) < 0)
+    return -1;
+  
+  for (count = 0; count < PS_ItemCount(misses); count++) {
+    if ((miss = PS_GetString(PS_GetItem(misses, count))) == NULL)
+      return -1;
+    if (stat(miss, &st) == 0) {
+      fprintf(stderr, "Definition file %s is found before %s since it was loaded\n", miss, path);
+      return -1;
+    }
+    if (WriteStr(os, miss) < 0)
+      return -1;
+  }
+  
+  return 0;
+}
+
+/* Writes [path, mtime, size, hash, misses] for each [path, mtime,
+ * size, misses] that is still unchanged */
+static int EncodeFiles(struct ps_ostream_t *os, const struct ps_value_t *files) {
+  const struct ps_value_t *info;
+  const char *path;
+  struct stat st;
+  uint64_t hash;
+  size_t count;
+  int64_t i;
+  
+  if (PS_GetType(files) != t_list) {
+    fprintf(stderr, "Printer settings have no list of definition files\n");
+    return -1;
+  }
+  
+  if (WriteU32(os, PS_ItemCount(files)) < 0)
+    return -1;
+  
+  for (count = 0; count < PS_ItemCount(files); count++) {
+    info = PS_GetItem(files, count);
+    if ((path = PS_GetString(PS_GetItem(info, 0))) == NULL)
+      return -1;
+    
+    if (stat(path, &st) < 0 ||
+	st.st_mtime != PS_AsInteger(PS_GetItem(info, 1)) ||
+	st.st_size != PS_AsInteger(PS_GetItem(info, 2))) {
+      fprintf(stderr, "Definition file %s changed since it was loaded\n", path);
+      return -1;
+    }
+    
+    if (HashFile(path, &hash) < 0) {
+      fprintf(stderr, "Cannot read definition file %s\n", path);
+      return -1;
+    }
+    
+    if (WriteStr(os, path) < 0)
+      return -1;
+    i = st.st_mtime;
+    if (PS_WriteBuf(os, (const char *) &i, sizeof(i)) < 0)
+      return -1;
+    i = st.st_size;
+    if (PS_WriteBuf(os, (const char *) &i, sizeof(i)) < 0)
+      return -1;
+    if (PS_WriteBuf(os, (const char *) &hash, sizeof(hash)) < 0)
+      return -1;
+    if (EncodeMisses(os, path, PS_GetItem(info, 3)) < 0)
+      return -1;
+  }
+  
+  return 0;
+}
+
+/* Reads a path, terminated in r->key */
+static const char *ReadPath(struct reader *r) {
+  const char *str;
+  uint32_t len;
+  
+  if ((str = ReadStr(r, &len)) == NULL)
+    return NULL;
+  
+  PS_OStreamReset(r->key);
+  if (PS_WriteBuf(r->key, str, len) < 0)
+    return NULL;
+  return PS_OStreamContents(r->key);
+}
+
+/* Returns 1 if every file is unchanged and no file was added at the
+ * paths searched before it.  Files with a different mtime are hashed,
+ * so touching a file does not invalidate the snapshot.  Without check
+ * the list is only skipped. */
+static int CheckFiles(struct reader *r) {
+  uint32_t num, count, num_misses, miss;
+  const char *str;
+  struct stat st;
+  uint64_t hash, file_hash;
+  int64_t mtime, size;
+  
+  if (Read(r, &num, sizeof(num)) < 0)
+    return -1;
+  
+  for (count = 0; count < num; count++) {
+    if ((str = ReadPath(r)) == NULL)
+      return -1;
+    if (Read(r, &mtime, sizeof(mtime)) < 0 ||
+	Read(r, &size, sizeof(size)) < 0 ||
+	Read(r, &hash, sizeof(hash)) < 0)
+      return -1;
+    
+    if (r->check) {
+      if (stat(str, &st) < 0 || st.st_size != size)
+	return 0;
+      if (st.st_mtime != mtime && (HashFile(str, &file_hash) < 0 || file_hash != hash))
+	return 0;
+    }
+    
+    if (Read(r, &num_misses, sizeof(num_misses)) < 0)
+      return -1;
+    for (miss = 0; miss < num_misses; miss++) {
+      if ((str = ReadPath(r)) == NULL)
+	return -1;
+      if (r->check && stat(str, &st) == 0)
+	return 0;
+    }
+  }
+  
+  return 1;
+}
+
+static int WriteHeader(struct ps_ostream_t *os, const char *printer, const struct ps_value_t *search) {
+  uint32_t val;
+  
+  if (PS_WriteBuf(os, SNAPSHOT_MAGIC, 8) < 0)
+    return -1;
+  val = SNAPSHOT_VERSION;
+  if (PS_WriteBuf(os, (const char *) &val, sizeof(val)) < 0)
+    return -1;
+  val = BYTE_ORDER_MARK;
+  if (PS_WriteBuf(os, (const char *) &val, sizeof(val)) < 0)
+    return -1;
+  
+  if (WriteStr(os, printer) < 0)
+    return -1;
+  return EncodeValue(os, search, 0);
+}
+
+int SaveSnapshot(const char *file, const struct ps_value_t *ps, const char *printer, const struct ps_value_t *search, const struct ps_value_t *files) {
+  struct ps_ostream_t *os;
+  char tmp[4096];
+  FILE *out;
+  
+  if ((os = PS_NewStrOStream()) == NULL)
+    goto err;
+  
+  if (WriteHeader(os, printer, search) < 0 ||
+      EncodeFiles(os, files) < 0 ||
+      EncodeValue(os, ps, 0) < 0)
+    goto err2;
+  
+  /* Other processes only ever see a complete snapshot */
+#ifdef HAVE_UNISTD_H
+  snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", file, (long) getpid());
+#else
+  snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+#endif
+  
+  if ((out = fopen(tmp, "wb")) == NULL) {
+    perror("Cannot create snapshot file");
+    goto err2;
+  }
+  
+  if (fwrite(PS_OStreamContents(os), 1, PS_OStreamLength(os), out) != PS_OStreamLength(os)) {
+    perror("Cannot write snapshot file");
+    fclose(out);
+    goto err3;
+  }
+  
+  if (fclose(out) != 0) {
+    perror("Cannot write snapshot file");
+    goto err3;
+  }
+  
+  if (rename(tmp, file) < 0 && (remove(file) < 0 || rename(tmp, file) < 0)) {
+    perror("Cannot rename snapshot file");
+    goto err3;
+  }
+  
+  PS_FreeOStream(os);
+  return 0;
+  
+ err3:
+  remove(tmp);
+ err2:
+  PS_FreeOStream(os);
+ err:
+  fprintf(stderr, "Could not save printer snapshot\n");
+  return -1;
+}
+
+static struct ps_value_t *Decode(struct reader *r, const char *printer, const struct ps_value_t *search) {
+  struct ps_ostream_t *os;
+  struct ps_value_t *ps = NULL;
+  size_t len;
+  int ret;
+  
+  if ((os = PS_NewStrOStream()) == NULL)
+    return NULL;
+  
+  /* The header must match the one that would be written */
+  if (WriteHeader(os, printer, search) < 0)
+    goto done;
+  len = PS_OStreamLength(os);
+  if ((size_t) (r->end - r->loc) < len || memcmp(r->loc, PS_OStreamContents(os), len) != 0)
+    goto done;
+  r->loc += len;
+  
+  if ((ret = CheckFiles(r)) <= 0) {
+    if (ret < 0)
+      fprintf(stderr, "Corrupt printer snapshot\n");
+    goto done;
+  }
+  
+  if ((ps = DecodeValue(r, 0)) == NULL || r->loc != r->end) {
+    fprintf(stderr, "Corrupt printer snapshot\n");
+    PS_FreeValue(ps);
+    ps = NULL;
+  }
+  
+ done:
+  PS_FreeOStream(os);
+  return ps;
+}
+
+struct ps_value_t *LoadSnapshot(const char *file, const char *printer, const struct ps_value_t *search, int check) {
+  struct ps_value_t *ps = NULL;
+  struct reader r;
+  struct stat st;
+  char *data;
+  FILE *in;
+  
+  if ((in = fopen(file, "rb")) == NULL)
+    return NULL;
+  if (fstat(fileno(in), &st) < 0 || st.st_size <= 0 || (uint64_t) st.st_size > SIZE_MAX)
+    goto err;
+  
+  if ((r.key = PS_NewStrOStream()) == NULL)
+    goto err;
+  r.check = check;
+  
+#ifdef HAVE_MMAP
+  if ((data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0)) != MAP_FAILED) {
+    r.loc = data;
+    r.end = data + st.st_size;
+    ps = Decode(&r, printer, search);
+    munmap(data, st.st_size);
+    goto done;
+  }
+#endif
+  
+  if ((data = MemAlloc(st.st_size, mem_other)) == NULL)
+    goto done;
+  if (fread(data, 1, st.st_size, in) == (size_t) st.st_size) {
+    r.loc = data;
+    r.end = data + st.st_size;
+    ps = Decode(&r, printer, search);
+  }
+  MemFree(data, st.st_size, mem_other);
+  
+ done:
+  PS_FreeOStream(r.key);
+ err:
+  fclose(in);
+  return ps;
+}
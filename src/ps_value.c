@@ -31,20 +31,63 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 
 #include <string.h>
 
+#include "atom_table.h"
 #include "binary_tree.h"
+#include "ps_arena.h"
 #include "ps_value.h"
+#include "ps_lazy.h"
+#include "ps_frozen.h"
 
+/* Elements are stored right after the head until the list outgrows
+ * the capacity it was created with */
 struct list_head_t {
   struct ps_value_t **v;
   size_t num_alloc;
   size_t num_elem;
+  size_t ref_count;
+  size_t num_inline;
+  int in_arena;
+  int frozen;
+  struct ps_value_t *inline_v[];
+};
+
+/* Short strings are stored inline, right after their value.  Longer
+ * strings live in a buffer that is shared, and never modified, by all
+ * copies. */
+#define INLINE_STR_SZ 32
+
+struct str_buf_t {
+  size_t ref_count;
+  int in_arena;
+  int frozen;
+  char str[];
 };
 
+#define STR_BUF(s) ((struct str_buf_t *) ((s) - offsetof(struct str_buf_t, str)))
+#define IS_INLINE(val) ((val)->v.v_string == (char *) ((val) + 1))
+
+/* Lists and objects are shared between copies until one of them is
+ * modified.  The value that created the storage is its owner and keeps
+ * the original elements when the storage is unshared, so pointers
+ * previously returned by PS_GetItem/PS_GetMember remain valid.
+ *
+ * Values created while an arena is active may borrow the storage of
+ * values created outside of it without taking a reference; the
+ * storage is copied into the arena before it is modified.
+ *
+ * Frozen values, and their storage, are never modified or freed and
+ * their reference counts are never touched, so they can be read by
+ * many threads at once.  Copies borrow frozen storage. */
 struct ps_value_t {
   enum ps_type_t type;
+  char is_owner;
+  char in_arena;
+  char is_frozen;
+  unsigned char extra; /* Bytes allocated after the value */
   size_t ref_count;
   
   union {
@@ -56,19 +99,102 @@ struct ps_value_t {
   } v;
 };
 
-static struct ps_value_t ps_const_null = {t_null, SIZE_MAX >> 1, {0}};
-static struct ps_value_t ps_const_false = {t_boolean, SIZE_MAX >> 1, {0}};
-static struct ps_value_t ps_const_true = {t_boolean, SIZE_MAX >> 1, {1}};
+static struct ps_value_t ps_const_null = {t_null, 0, 0, 1, 0, SIZE_MAX >> 1, {0}};
+static struct ps_value_t ps_const_false = {t_boolean, 0, 0, 1, 0, SIZE_MAX >> 1, {0}};
+static struct ps_value_t ps_const_true = {t_boolean, 0, 0, 1, 0, SIZE_MAX >> 1, {1}};
+
+/* Integers and floats that fit are stored in the pointer itself and
+ * need no allocation or reference counting.  Allocated values are at
+ * least 8 byte aligned, so the low bits are free for a tag:
+ *
+ *   ...xxx1  integer, shifted left by one
+ *   ...x010  float (64 bit pointers only)
+ *
+ * Floats are rotated left by one to move the sign to the bottom and
+ * the exponent is rebased, so floats with a biased exponent from 897
+ * to 1151 (magnitudes between about 1e-38 and 1e38) and zero fit in 61
+ * bits.  Everything else is allocated as before. */
+#define IS_INT(v) (((uintptr_t) (v)) & 1)
+#if UINTPTR_MAX >= UINT64_MAX
+#define IMM_FLOAT
+#define IS_FLOAT(v) ((((uintptr_t) (v)) & 7) == 2)
+#define IS_IMM(v) (((uintptr_t) (v)) & 7)
+#define FLOAT_EXP_BASE ((uint64_t) 896 << 53)
+#else
+#define IS_FLOAT(v) 0
+#define IS_IMM(v) IS_INT(v)
+#endif
+
+static struct ps_value_t *ImmInteger(int64_t v) {
+  if (v < INTPTR_MIN / 2 || v > INTPTR_MAX / 2)
+    return NULL;
+  
+  return (struct ps_value_t *) (((uintptr_t) v << 1) | 1);
+}
+
+static struct ps_value_t *ImmFloat(double v) {
+#ifdef IMM_FLOAT
+  uint64_t bits, exp;
+  
+  memcpy(&bits, &v, sizeof(bits));
+  bits = (bits << 1) | (bits >> 63);
+  exp = bits >> 53;
+  if (bits >> 1 == 0)
+    return (struct ps_value_t *) (uintptr_t) ((bits << 3) | 2);
+  if (exp <= 896 || exp > 1151)
+    return NULL;
+  
+  return (struct ps_value_t *) (uintptr_t) (((bits - FLOAT_EXP_BASE) << 3) | 2);
+#else
+  return NULL;
+#endif
+}
 
-static struct ps_value_t *NewValue(enum ps_type_t type) {
+static enum ps_type_t Type(const struct ps_value_t *v) {
+  if (IS_IMM(v))
+    return IS_INT(v) ? t_integer : t_float;
+  
+  return v->type;
+}
+
+/* Only for integers and booleans */
+static int64_t IntValue(const struct ps_value_t *v) {
+  if (IS_INT(v))
+    return (intptr_t) v >> 1;
+  
+  return v->v.v_integer;
+}
+
+static double FloatValue(const struct ps_value_t *v) {
+#ifdef IMM_FLOAT
+  uint64_t bits;
+  double d;
+  
+  if (IS_FLOAT(v)) {
+    bits = (uint64_t) (uintptr_t) v >> 3;
+    if (bits >> 53)
+      bits += FLOAT_EXP_BASE;
+    bits = (bits >> 1) | (bits << 63);
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+  }
+#endif
+  
+  return v->v.v_float;
+}
+
+static struct ps_value_t *NewValueExtra(enum ps_type_t type, size_t extra) {
   struct ps_value_t *ps;
+  int in_arena = ArenaActive();
 
-  if ((ps = malloc(sizeof(*ps))) == NULL) {
+  if ((ps = AllocMem(sizeof(*ps) + extra, mem_value + type, in_arena)) == NULL) {
     perror("Cannot allocate memory for printer settings value");
     goto err;
   }
   memset(ps, 0, sizeof(*ps));
   ps->type = type;
+  ps->in_arena = in_arena;
+  ps->extra = extra;
 
   return ps;
   
@@ -76,6 +202,46 @@ static struct ps_value_t *NewValue(enum ps_type_t type) {
   return NULL;
 }
 
+static struct ps_value_t *NewValue(enum ps_type_t type) {
+  return NewValueExtra(type, 0);
+}
+
+static size_t ValueSize(const struct ps_value_t *v) {
+  return sizeof(*v) + v->extra;
+}
+
+static void FreeValueMem(struct ps_value_t *v) {
+  FreeMem(v, ValueSize(v), mem_value + v->type, v->in_arena);
+}
+
+/* Memory is accounted by type, so it must move with the value */
+static void SetType(struct ps_value_t *v, enum ps_type_t type) {
+  if (!v->in_arena)
+    MemReclass(ValueSize(v), mem_value + v->type, mem_value + type);
+  v->type = type;
+}
+
+static struct str_buf_t *NewStrBuf(size_t len, int in_arena) {
+  struct str_buf_t *buf;
+  
+  if ((buf = AllocMem(sizeof(*buf) + len + 1, mem_string, in_arena)) == NULL) {
+    perror("Could not allocate memory for printer settings string");
+    return NULL;
+  }
+  buf->ref_count = 0;
+  buf->in_arena = in_arena;
+  buf->frozen = 0;
+  
+  return buf;
+}
+
+static void FreeStrBuf(struct str_buf_t *buf) {
+  if (buf->frozen || buf->ref_count-- > 0 || buf->in_arena)
+    return;
+  
+  MemFree(buf, sizeof(*buf) + strlen(buf->str) + 1, mem_string);
+}
+
 struct ps_value_t *PS_NewNull(void) {
   return &ps_const_null;
 }
@@ -87,6 +253,9 @@ struct ps_value_t *PS_NewBoolean(int v) {
 struct ps_value_t *PS_NewInteger(int64_t v) {
   struct ps_value_t *ps;
   
+  if ((ps = ImmInteger(v)))
+    return ps;
+  
   if ((ps = NewValue(t_integer)) == NULL)
     return NULL;
   
@@ -97,6 +266,9 @@ struct ps_value_t *PS_NewInteger(int64_t v) {
 struct ps_value_t *PS_NewFloat(double v) {
   struct ps_value_t *ps;
   
+  if ((ps = ImmFloat(v)))
+    return ps;
+  
   if ((ps = NewValue(t_float)) == NULL)
     return NULL;
   
@@ -113,16 +285,26 @@ struct ps_value_t *PS_NewString(const char *v) {
 
 struct ps_value_t *PS_NewStringLen(const char *v, size_t len) {
   struct ps_value_t *ps;
+  struct str_buf_t *buf;
+  const char *end;
   
   if (v == NULL)
     goto err;
   
-  if ((ps = NewValue(t_string)) == NULL)
-    goto err;
+  /* Strings end at the first nul */
+  if ((end = memchr(v, '\0', len)))
+    len = end - v;
   
-  if ((ps->v.v_string = malloc(len + 1)) == NULL) {
-    perror("Could not allocate memory for printer settings string");
-    goto err2;
+  if (len < INLINE_STR_SZ) {
+    if ((ps = NewValueExtra(t_string, len + 1)) == NULL)
+      goto err;
+    ps->v.v_string = (char *) (ps + 1);
+  } else {
+    if ((ps = NewValue(t_string)) == NULL)
+      goto err;
+    if ((buf = NewStrBuf(len, ps->in_arena)) == NULL)
+      goto err2;
+    ps->v.v_string = buf->str;
   }
   memcpy(ps->v.v_string, v, len);
   ps->v.v_string[len] = '\0';
@@ -130,7 +312,7 @@ struct ps_value_t *PS_NewStringLen(const char *v, size_t len) {
   return ps;
   
  err2:
-  free(ps);
+  FreeValueMem(ps);
  err:
   return NULL;
 }
@@ -141,7 +323,7 @@ struct ps_value_t *PS_NewVariable(const char *v) {
   if ((ps = PS_NewString(v)) == NULL)
     goto err;
 
-  ps->type = t_variable;
+  SetType(ps, t_variable);
   
   return ps;
   
@@ -155,7 +337,7 @@ struct ps_value_t *PS_NewVariableLen(const char *v, size_t len) {
   if ((ps = PS_NewStringLen(v, len)) == NULL)
     goto err;
 
-  ps->type = t_variable;
+  SetType(ps, t_variable);
   
   return ps;
   
@@ -169,7 +351,7 @@ struct ps_value_t *PS_NewBuiltinFunc(const char *v) {
   if ((ps = PS_NewString(v)) == NULL)
     goto err;
 
-  ps->type = t_builtin_func;
+  SetType(ps, t_builtin_func);
   
   return ps;
   
@@ -183,7 +365,7 @@ struct ps_value_t *PS_NewBuiltinFuncLen(const char *v, size_t len) {
   if ((ps = PS_NewStringLen(v, len)) == NULL)
     goto err;
 
-  ps->type = t_builtin_func;
+  SetType(ps, t_builtin_func);
   
   return ps;
   
@@ -191,32 +373,84 @@ struct ps_value_t *PS_NewBuiltinFuncLen(const char *v, size_t len) {
   return NULL;
 }
 
-#define INIT_LIST_SZ 16
+#define INIT_LIST_SZ 4
+
+static struct list_head_t *NewListHead(size_t num_alloc) {
+  struct list_head_t *head;
+  int in_arena = ArenaActive();
+  
+  if (num_alloc > (SIZE_MAX - sizeof(*head)) / sizeof(struct ps_value_t *)) {
+    fprintf(stderr, "Printer settings list too long\n");
+    goto err;
+  }
+  
+  if ((head = AllocMem(sizeof(*head) + num_alloc * sizeof(struct ps_value_t *), mem_list, in_arena)) == NULL) {
+    perror("Could not allocate memory for printer settings list");
+    goto err;
+  }
+  memset(head, 0, sizeof(*head));
+  head->in_arena = in_arena;
+  head->v = head->inline_v;
+  head->num_alloc = num_alloc;
+  head->num_inline = num_alloc;
+  
+  return head;
+  
+ err:
+  return NULL;
+}
+
+static void FreeListHead(struct list_head_t *head) {
+  struct ps_value_t **cur, **end;
+  
+  if (head->frozen || head->ref_count-- > 0 || head->in_arena)
+    return;
+  
+  cur = head->v;
+  end = cur + head->num_elem;
+  for (; cur < end; cur++)
+    PS_FreeValue(*cur);
+  if (head->v != head->inline_v)
+    MemFree(head->v, head->num_alloc * sizeof(struct ps_value_t *), mem_list);
+  MemFree(head, sizeof(*head) + head->num_inline * sizeof(struct ps_value_t *), mem_list);
+}
+
+static struct list_head_t *CopyListHead(const struct list_head_t *head) {
+  struct list_head_t *copy;
+  
+  if ((copy = NewListHead(head->num_elem)) == NULL)
+    goto err;
+  
+  for (; copy->num_elem < head->num_elem; copy->num_elem++)
+    if ((copy->v[copy->num_elem] = PS_CopyValue(head->v[copy->num_elem])) == NULL)
+      goto err2;
+  
+  return copy;
+  
+ err2:
+  FreeListHead(copy);
+ err:
+  return NULL;
+}
 
 struct ps_value_t *PS_NewList(void) {
+  return PS_NewListCap(INIT_LIST_SZ);
+}
+
+struct ps_value_t *PS_NewListCap(size_t cap) {
   struct ps_value_t *ps;
   
   if ((ps = NewValue(t_list)) == NULL)
     goto err;
   
-  if ((ps->v.v_list = malloc(sizeof(*ps->v.v_list))) == NULL) {
-    perror("Could not allocate memory for printer settings list");
+  if ((ps->v.v_list = NewListHead(cap)) == NULL)
     goto err2;
-  }
-  memset(ps->v.v_list, 0, sizeof(*ps->v.v_list));
-  
-  if ((ps->v.v_list->v = calloc(INIT_LIST_SZ, sizeof(struct ps_value_t *))) == NULL) {
-    perror("Could not allocate memory for printer settings list elements");
-    goto err3;
-  }
-  ps->v.v_list->num_alloc = INIT_LIST_SZ;
+  ps->is_owner = 1;
   
   return ps;
 
- err3:
-  free(ps->v.v_list);
  err2:
-  free(ps);
+  FreeValueMem(ps);
  err:
   return NULL;
 }
@@ -227,7 +461,7 @@ struct ps_value_t *PS_NewFunction(const struct ps_value_t *func) {
   if ((ps = PS_NewList()) == NULL)
     goto err;
 
-  ps->type = t_function;
+  SetType(ps, t_function);
   if (func) {
     if ((nn = PS_CopyValue(func)) == NULL)
       goto err2;
@@ -266,70 +500,255 @@ struct ps_value_t *PS_NewObject(void) {
   return ps;
   
  err2:
-  free(ps);
+  FreeValueMem(ps);
  err:
   return NULL;
 }
 
-void PS_FreeValue(struct ps_value_t *v) {
-  struct ps_value_t **cur, **end;
+/* Lazy objects have no tree until one of their members is first
+ * needed, the tape entry to parse them from is kept after the value.
+ * They are never in an arena, or frozen, and copies of them are made
+ * from the materialized tree.  Since reading one changes it, a lazy
+ * object may only be used by one thread until it is materialized. */
+struct lazy_t {
+  struct ps_tape_t *tape;
+  size_t idx;
+};
+
+#define LAZY(v) ((struct lazy_t *) ((v) + 1))
+
+struct ps_value_t *NewLazyObject(struct ps_tape_t *tape, size_t idx) {
+  struct ps_value_t *ps;
+  
+  if ((ps = NewValueExtra(t_object, sizeof(struct lazy_t))) == NULL)
+    return NULL;
+  
+  LAZY(ps)->tape = tape;
+  LAZY(ps)->idx = idx;
+  return ps;
+}
+
+/* Members are created outside of any active arena, since they belong
+ * to a value from outside of it.  On error the tape is kept, so the
+ * next use tries again. */
+static int Materialize(struct ps_value_t *v) {
+  struct lazy_t *lazy = LAZY(v);
+  int depth;
+  
+  depth = ArenaSuspend();
+  if ((v->v.v_object = NewBinaryTree(CopyVoid, FreeVoid)) == NULL) {
+    perror("Cannot allocate memory for lazy object");
+    goto err;
+  }
+  
+  if (TapeMaterialize(lazy->tape, lazy->idx, v) < 0) {
+    fprintf(stderr, "Could not parse members of lazy object\n");
+    goto err2;
+  }
+  ArenaResume(depth);
   
+  TapeRelease(lazy->tape);
+  lazy->tape = NULL;
+  return 0;
+  
+ err2:
+  FreeBinaryTree(v->v.v_object);
+  v->v.v_object = NULL;
+ err:
+  ArenaResume(depth);
+  return -1;
+}
+
+/* Returns NULL if a lazy object cannot be materialized */
+static struct binary_tree_t *Tree(const struct ps_value_t *v) {
+  if (v->v.v_object == NULL && Materialize((struct ps_value_t *) v) < 0)
+    return NULL;
+  
+  return v->v.v_object;
+}
+
+/* Frozen storage, or storage of a value outside the arena, used
+ * without a reference */
+static int IsBorrowed(const struct ps_value_t *v) {
+  struct str_buf_t *buf;
+  
+  switch (Type(v)) {
+  case t_string:
+  case t_variable:
+  case t_builtin_func:
+    if (IS_INLINE(v))
+      return 0;
+    buf = STR_BUF(v->v.v_string);
+    return buf->frozen || (v->in_arena && !buf->in_arena);
+    
+  case t_list:
+  case t_function:
+    return v->v.v_list->frozen || (v->in_arena && !v->v.v_list->in_arena);
+    
+  case t_object:
+    /* Lazy objects are never in an arena */
+    return v->in_arena && !BinaryTreeInArena(v->v.v_object);
+    
+  default:
+    return 0;
+  }
+}
+
+/* Values from outside the active arena are left alone until it ends,
+ * frozen values are left alone forever */
+static int IsForeign(const struct ps_value_t *v) {
+  return !IS_IMM(v) && (v->is_frozen || (!v->in_arena && ArenaActive()));
+}
+
+void PS_FreeValue(struct ps_value_t *v) {
   if (v == NULL)
     return;
   
-  if (v->type == t_null || v->type == t_boolean)
+  if (IS_IMM(v) || v->type == t_null || v->type == t_boolean)
+    return;
+  
+  if (IsForeign(v))
     return;
   
   if (v->ref_count-- > 0)
     return;
   
-  switch (v->type) {
+  /* Borrowed storage belongs to another value, only v is freed */
+  if (IsBorrowed(v)) {
+    FreeValueMem(v);
+    return;
+  }
+  
+  switch (Type(v)) {
   case t_string:
   case t_variable:
   case t_builtin_func:
-    free(v->v.v_string);
+    if (!IS_INLINE(v))
+      FreeStrBuf(STR_BUF(v->v.v_string));
     break;
     
   case t_list:
   case t_function:
-    cur = v->v.v_list->v;
-    end = cur + v->v.v_list->num_elem;
-    for (; cur < end; cur++)
-      PS_FreeValue(*cur);
-    free(v->v.v_list->v);
-    free(v->v.v_list);
+    FreeListHead(v->v.v_list);
     break;
     
   case t_object:
-    FreeBinaryTree(v->v.v_object);
+    if (v->v.v_object)
+      FreeBinaryTree(v->v.v_object);
+    else
+      TapeRelease(LAZY(v)->tape);
     break;
 
   default:
     break;
   }
   
-  free(v);
+  FreeValueMem(v);
+}
+
+static int IsShared(const struct ps_value_t *v) {
+  switch (Type(v)) {
+  case t_list:
+  case t_function:
+    return v->v.v_list->ref_count > 0 || IsBorrowed(v);
+    
+  default:
+    return 0;
+  }
+}
+
+/* Values that can be modified in place, and so must not be handed out
+ * from storage shared with another copy */
+static int IsMutable(const struct ps_value_t *v) {
+  return v && Type(v) != t_null && Type(v) != t_boolean &&
+    Type(v) != t_integer && Type(v) != t_float;
+}
+
+static int CheckModify(const struct ps_value_t *v) {
+  if (!IS_IMM(v) && v->is_frozen) {
+    fprintf(stderr, "Cannot modify a frozen value\n");
+    return -1;
+  }
+  
+  if (IsForeign(v)) {
+    fprintf(stderr, "Cannot modify a value created outside of the active arena\n");
+    return -1;
+  }
+  
+  return 0;
+}
+
+static int Unshare(struct ps_value_t *v) {
+  struct binary_tree_t *bt;
+  struct list_head_t *head, *copy;
+  struct ps_value_t *elem;
+  size_t count;
+  
+  if (CheckModify(v) < 0)
+    return -1;
+  
+  /* Objects share nodes rather than the whole tree */
+  if (Type(v) == t_object) {
+    if ((bt = Tree(v)) == NULL)
+      return -1;
+    return UnshareBinaryTree(bt);
+  }
+  
+  if (!IsShared(v))
+    return 0;
+  
+  head = v->v.v_list;
+  if ((copy = CopyListHead(head)) == NULL)
+    return -1;
+  
+  if (IsBorrowed(v)) {
+    v->v.v_list = copy;
+    v->is_owner = 1;
+    return 0;
+  }
+  head->ref_count--;
+  
+  if (v->is_owner) {
+    for (count = 0; count < head->num_elem; count++) {
+      elem = copy->v[count];
+      copy->v[count] = head->v[count];
+      head->v[count] = elem;
+    }
+  }
+  
+  v->v.v_list = copy;
+  v->is_owner = 1;
+  return 0;
+}
+
+/* Unshare before handing out modifiable pointers.  Values from outside
+ * the active arena are only read, so they are not unshared. */
+static int UnshareRead(const struct ps_value_t *v) {
+  if (IsForeign(v))
+    return 0;
+  
+  return Unshare((struct ps_value_t *) v);
 }
 
 enum ps_type_t PS_GetType(const struct ps_value_t *v) {
   if (v == NULL)
     return t_null;
   
-  return v->type;
+  return Type(v);
 }
 
 int PS_IsNumeric(const struct ps_value_t *v) {
   if (v == NULL)
     return 0;
 
-  return v->type == t_boolean || v->type == t_integer || v->type == t_float;
+  return Type(v) == t_boolean || Type(v) == t_integer || Type(v) == t_float;
 }
 
 int PS_IsScalar(const struct ps_value_t *v) {
   if (v == NULL)
     return 1;
   
-  return !(v->type == t_list || v->type == t_function || v->type == t_object);
+  return !(Type(v) == t_list || Type(v) == t_function || Type(v) == t_object);
 }
 
 int PS_AsBoolean(const struct ps_value_t *v) {
@@ -340,16 +759,16 @@ int64_t PS_AsInteger(const struct ps_value_t *v) {
   if (v == NULL)
     return 0;
   
-  switch (v->type) {
+  switch (Type(v)) {
   case t_null:
     return 0;
     
   case t_boolean:
   case t_integer:
-    return v->v.v_integer;
+    return IntValue(v);
     
   case t_float:
-    return v->v.v_float;
+    return FloatValue(v);
 
   case t_string:
     return strtod(v->v.v_string, NULL);
@@ -367,9 +786,9 @@ double PS_AsFloat(const struct ps_value_t *v) {
   if (v == NULL)
     return 0.0;
   
-  switch (v->type) {
+  switch (Type(v)) {
   case t_float:
-    return v->v.v_float;
+    return FloatValue(v);
 
   case t_string:
     return strtod(v->v.v_string, NULL);
@@ -383,34 +802,40 @@ const char *PS_GetString(const struct ps_value_t *str_var) {
   if (str_var == NULL)
     return NULL;
   
-  if (str_var->type != t_string &&
-      str_var->type != t_variable &&
-      str_var->type != t_builtin_func)
+  if (Type(str_var) != t_string &&
+      Type(str_var) != t_variable &&
+      Type(str_var) != t_builtin_func)
     return NULL;
 
   return str_var->v.v_string;
 }
 
 size_t PS_ItemCount(const struct ps_value_t *list_func_obj) {
+  struct binary_tree_t *bt;
+  
   if (list_func_obj == NULL)
     return 0;
   
-  if (list_func_obj->type == t_object)
-    return BinaryTreeCount(list_func_obj->v.v_object);
+  if (Type(list_func_obj) == t_object)
+    return (bt = Tree(list_func_obj)) ? BinaryTreeCount(bt) : 0;
   
-  if (list_func_obj->type == t_list || list_func_obj->type == t_function) {
+  if (Type(list_func_obj) == t_list || Type(list_func_obj) == t_function) {
     return list_func_obj->v.v_list->num_elem;
   }
   
-  if (list_func_obj->type == t_null)
+  if (Type(list_func_obj) == t_null)
     return 0;
   
   return 1;
 }
 
+/* Getting a modifiable item out of a shared list or object unshares
+ * it first, so changes to the item cannot be seen by the other copies */
 struct ps_value_t *PS_GetItem(const struct ps_value_t *list, ssize_t pos) {
+  struct ps_value_t *item;
+  
   if (list == NULL ||
-      (list->type != t_list && list->type != t_function))
+      (Type(list) != t_list && Type(list) != t_function))
     return NULL;
   
   if (pos < 0)
@@ -419,48 +844,114 @@ struct ps_value_t *PS_GetItem(const struct ps_value_t *list, ssize_t pos) {
   if (pos < 0 || pos >= list->v.v_list->num_elem)
     return NULL;
 
-  return list->v.v_list->v[pos];
+  item = list->v.v_list->v[pos];
+  if (IsMutable(item) && IsShared(list)) {
+    if (UnshareRead(list) < 0)
+      return NULL;
+    item = list->v.v_list->v[pos];
+  }
+  
+  return item;
 }
 
 struct ps_value_t *PS_GetMember(const struct ps_value_t *obj, const char *name, int *is_present) {
-  if (obj == NULL || name == NULL || obj->type != t_object)
+  struct binary_tree_t *bt;
+  struct ps_value_t *memb;
+  
+  if (obj == NULL || name == NULL || Type(obj) != t_object || (bt = Tree(obj)) == NULL)
     return NULL;
   
-  return (struct ps_value_t *) BinaryTreeLookup(obj->v.v_object, name, is_present);
+  memb = (struct ps_value_t *) BinaryTreeLookup(bt, name, is_present);
+  if (IsMutable(memb) && !IsForeign(obj))
+    memb = BinaryTreeLookupMutable(bt, name, is_present);
+  
+  return memb;
 }
 
-static struct ps_value_t *CopyList(const struct ps_value_t *v) {
-  struct ps_value_t *ps, **cur, **end, *copy;
+const struct ps_value_t *PS_GetMemberConst(const struct ps_value_t *obj, const char *name, int *is_present) {
+  struct binary_tree_t *bt;
   
-  if ((ps = PS_NewList()) == NULL)
-    goto err;
-  ps->type = v->type;
+  if (obj == NULL || name == NULL || Type(obj) != t_object || (bt = Tree(obj)) == NULL)
+    return NULL;
   
-  cur = v->v.v_list->v;
-  end = cur + v->v.v_list->num_elem;
-  for (; cur < end; cur++) {
-    if ((copy = PS_CopyValue(*cur)) == NULL)
-      goto err2;
-    
-    if ((PS_AppendToList(ps, copy)) < 0)
-      goto err3;
+  return BinaryTreeLookup(bt, name, is_present);
+}
+
+/* Members missing from obj are set to NULL */
+size_t PS_GetMembers(const struct ps_value_t *obj, size_t num, const char *const *names, const struct ps_value_t **membs) {
+  struct binary_tree_t *bt;
+  size_t count, found = 0;
+  
+  for (count = 0; count < num; count++)
+    membs[count] = NULL;
+  
+  if (obj == NULL || Type(obj) != t_object || (bt = Tree(obj)) == NULL)
+    return 0;
+  
+  for (count = 0; count < num; count++) {
+    if (names[count] == NULL)
+      continue;
+    if ((membs[count] = BinaryTreeLookup(bt, names[count], NULL)))
+      found++;
   }
   
-  return ps;
+  return found;
+}
+
+const struct ps_value_t *PS_GetLayeredMember(const struct ps_value_t *const *objs, size_t num, const char *name) {
+  struct binary_tree_t *bt;
+  const struct ps_value_t *memb;
+  size_t count;
+  
+  if (name == NULL)
+    return NULL;
+  
+  for (count = 0; count < num; count++) {
+    if (objs[count] == NULL || Type(objs[count]) != t_object || (bt = Tree(objs[count])) == NULL)
+      continue;
+    if ((memb = BinaryTreeLookup(bt, name, NULL)))
+      return memb;
+  }
   
- err3:
-  PS_FreeValue(copy);
- err2:
-  PS_FreeValue(ps);
- err:
   return NULL;
 }
 
+/* Handles are atoms that are never released */
+const struct ps_key_t *PS_KeyHandle(const char *name) {
+  if (name == NULL)
+    return NULL;
+  
+  return (const struct ps_key_t *) AtomIntern(name);
+}
+
+struct ps_value_t *PS_GetMemberKey(const struct ps_value_t *obj, const struct ps_key_t *key, int *is_present) {
+  struct binary_tree_t *bt;
+  struct ps_value_t *memb;
+  
+  if (obj == NULL || key == NULL || Type(obj) != t_object || (bt = Tree(obj)) == NULL)
+    return NULL;
+  
+  memb = (struct ps_value_t *) BinaryTreeLookupAtom(bt, (const char *) key, is_present);
+  if (IsMutable(memb) && !IsForeign(obj))
+    memb = BinaryTreeLookupAtomMutable(bt, (const char *) key, is_present);
+  
+  return memb;
+}
+
+const struct ps_value_t *PS_GetMemberKeyConst(const struct ps_value_t *obj, const struct ps_key_t *key, int *is_present) {
+  struct binary_tree_t *bt;
+  
+  if (obj == NULL || key == NULL || Type(obj) != t_object || (bt = Tree(obj)) == NULL)
+    return NULL;
+  
+  return BinaryTreeLookupAtom(bt, (const char *) key, is_present);
+}
+
 struct ps_value_t *PS_AddRef(const struct ps_value_t *v) {
   if (v == NULL)
     return NULL;
   
-  if (v->type == t_null || v->type == t_boolean)
+  if (IS_IMM(v) || v->type == t_null || v->type == t_boolean || IsForeign(v))
     return (struct ps_value_t *) v;
   
   if (v->ref_count == SIZE_MAX)
@@ -471,34 +962,54 @@ struct ps_value_t *PS_AddRef(const struct ps_value_t *v) {
   return (struct ps_value_t *) v;
 }
 
-/* Deep copy mutable types, add refence to immutable types */
+/* Share storage of lists and objects until modified, share long
+ * strings, copy short strings, add refence to immutable types */
 struct ps_value_t *PS_CopyValue(const struct ps_value_t *v) {
   struct ps_value_t *ps;
+  struct binary_tree_t *bt;
+  struct list_head_t *head;
+  struct str_buf_t *buf;
 
   if (v == NULL)
     return NULL;
   
-  switch (v->type) {
+  switch (Type(v)) {
   case t_string:
   case t_variable:
   case t_builtin_func:
-    if ((ps = NewValue(v->type)) == NULL)
+    if (IS_INLINE(v)) {
+      if ((ps = PS_NewString(v->v.v_string)) == NULL)
+	return NULL;
+      SetType(ps, v->type);
+      break;
+    }
+    buf = STR_BUF(v->v.v_string);
+    if (buf->ref_count == SIZE_MAX)
       return NULL;
-    if ((ps->v.v_string = strdup(v->v.v_string)) == NULL) {
-      free(ps);
+    if ((ps = NewValue(v->type)) == NULL)
       return NULL;
-    }
+    ps->v.v_string = buf->str;
+    if (!IsBorrowed(ps))
+      buf->ref_count++;
     break;
     
   case t_list:
   case t_function:
-    return CopyList(v);
+    head = v->v.v_list;
+    if (head->ref_count == SIZE_MAX)
+      return NULL;
+    if ((ps = NewValue(Type(v))) == NULL)
+      return NULL;
+    ps->v.v_list = head;
+    if (!IsBorrowed(ps))
+      head->ref_count++;
+    break;
     
   case t_object:
-    if ((ps = NewValue(t_object)) == NULL)
+    if ((bt = Tree(v)) == NULL || (ps = NewValue(t_object)) == NULL)
       return NULL;
-    if ((ps->v.v_object = CopyBinaryTree(v->v.v_object)) == NULL) {
-      free(ps);
+    if ((ps->v.v_object = CopyBinaryTree(bt)) == NULL) {
+      FreeValueMem(ps);
       return NULL;
     }
     break;
@@ -512,41 +1023,327 @@ struct ps_value_t *PS_CopyValue(const struct ps_value_t *v) {
   return ps;
 }
 
+/* Copy a value out of the arena.  Storage that was borrowed from
+ * outside of the arena is shared instead of copied. */
+static struct ps_value_t *Export(const struct ps_value_t *v) {
+  struct ps_value_t *ps, *memb;
+  struct binary_tree_t *bt;
+  struct binary_tree_iterator_t bti;
+  size_t count;
+  
+  if (IS_IMM(v) || !v->in_arena)
+    return PS_CopyValue(v);
+  
+  switch (Type(v)) {
+  case t_integer:
+    return PS_NewInteger(IntValue(v));
+    
+  case t_float:
+    return PS_NewFloat(FloatValue(v));
+    
+  case t_string:
+  case t_variable:
+  case t_builtin_func:
+    if ((ps = PS_NewString(v->v.v_string)) == NULL)
+      goto err;
+    SetType(ps, Type(v));
+    return ps;
+    
+  case t_list:
+  case t_function:
+    if (IsBorrowed(v)) {
+      if (v->v.v_list->ref_count == SIZE_MAX || (ps = NewValue(Type(v))) == NULL)
+	goto err;
+      ps->v.v_list = v->v.v_list;
+      if (!IsBorrowed(ps))
+	v->v.v_list->ref_count++;
+      return ps;
+    }
+    
+    if ((ps = PS_NewList()) == NULL)
+      goto err;
+    SetType(ps, Type(v));
+    for (count = 0; count < v->v.v_list->num_elem; count++) {
+      if ((memb = Export(v->v.v_list->v[count])) == NULL)
+	goto err2;
+      if (PS_AppendToList(ps, memb) < 0)
+	goto err3;
+    }
+    return ps;
+    
+  case t_object:
+    if ((bt = Tree(v)) == NULL)
+      goto err;
+    if (IsBorrowed(v)) {
+      if ((ps = NewValue(t_object)) == NULL)
+	goto err;
+      if ((ps->v.v_object = CopyBinaryTree(bt)) == NULL) {
+	FreeValueMem(ps);
+	goto err;
+      }
+      return ps;
+    }
+    
+    if ((ps = PS_NewObject()) == NULL)
+      goto err;
+    BinaryTreeIteratorInit(&bti, bt);
+    while (BinaryTreeIteratorNext(&bti)) {
+      if ((memb = Export(BinaryTreeIteratorData(&bti))) == NULL)
+	goto err2;
+      if (PS_AddMember(ps, BinaryTreeIteratorKey(&bti), memb) < 0)
+	goto err3;
+    }
+    return ps;
+    
+  default:
+    return (struct ps_value_t *) v;
+  }
+  
+ err3:
+  PS_FreeValue(memb);
+ err2:
+  PS_FreeValue(ps);
+ err:
+  fprintf(stderr, "Could not copy value out of arena\n");
+  return NULL;
+}
+
+int PS_ArenaBegin(void) {
+  return ArenaEnter();
+}
+
+struct ps_value_t *PS_ArenaEnd(const struct ps_value_t *keep) {
+  struct ps_value_t *v;
+  
+  if (!ArenaActive()) {
+    fprintf(stderr, "PS_ArenaEnd called without an active arena\n");
+    return NULL;
+  }
+  
+  if (ArenaLeave() > 0)
+    return (struct ps_value_t *) keep;
+  
+  v = keep ? Export(keep) : NULL;
+  ArenaRelease();
+  
+  return v;
+}
+  
+static void FreezeMember(const char *key, void **data, void *ret) {
+  (void) key;
+  
+  if (PS_Freeze((struct ps_value_t *) *data) < 0)
+    *(int *) ret = -1;
+}
+  
+int PS_Freeze(struct ps_value_t *v) {
+  size_t count;
+  int ret = 0;
+  
+  if (v == NULL)
+    return -1;
+  
+  if (IS_IMM(v) || v->is_frozen)
+    return 0;
+  
+  if (v->in_arena) {
+    fprintf(stderr, "Cannot freeze a value in an arena\n");
+    return -1;
+  }
+  
+  if (Unshare(v) < 0)
+    return -1;
+  
+  switch (Type(v)) {
+  case t_string:
+  case t_variable:
+  case t_builtin_func:
+    if (!IS_INLINE(v))
+      STR_BUF(v->v.v_string)->frozen = 1;
+    break;
+  
+  case t_list:
+  case t_function:
+    for (count = 0; count < v->v.v_list->num_elem; count++)
+      if (PS_Freeze(v->v.v_list->v[count]) < 0)
+	ret = -1;
+    v->v.v_list->frozen = 1;
+    break;
+  
+  case t_object:
+    BinaryTreeForeach(Tree(v), FreezeMember, &ret);
+    BinaryTreeFreeze(Tree(v));
+    break;
+  
+  default:
+    break;
+  }
+  
+  v->is_frozen = 1;
+  return ret;
+}
+
+static int IsFrozen(const struct ps_value_t *v) {
+  return !IS_IMM(v) && v->is_frozen && v->type != t_null && v->type != t_boolean;
+}
+
+struct ps_value_t *CopyOutValue(const struct ps_value_t *v) {
+  struct ps_value_t *ps, *memb;
+  struct binary_tree_iterator_t bti;
+  size_t count;
+  
+  if (v == NULL || !IsFrozen(v))
+    return PS_CopyValue(v);
+  
+  switch (Type(v)) {
+  case t_integer:
+    return PS_NewInteger(IntValue(v));
+    
+  case t_float:
+    return PS_NewFloat(FloatValue(v));
+    
+  case t_string:
+  case t_variable:
+  case t_builtin_func:
+    if ((ps = PS_NewString(v->v.v_string)) == NULL)
+      goto err;
+    SetType(ps, Type(v));
+    return ps;
+    
+  case t_list:
+  case t_function:
+    if ((ps = PS_NewListCap(v->v.v_list->num_elem)) == NULL)
+      goto err;
+    SetType(ps, Type(v));
+    for (count = 0; count < v->v.v_list->num_elem; count++) {
+      if ((memb = CopyOutValue(v->v.v_list->v[count])) == NULL)
+	goto err2;
+      if (PS_AppendToList(ps, memb) < 0)
+	goto err3;
+    }
+    return ps;
+    
+  case t_object:
+    if ((ps = PS_NewObject()) == NULL)
+      goto err;
+    BinaryTreeIteratorInit(&bti, v->v.v_object);
+    while (BinaryTreeIteratorNext(&bti)) {
+      if ((memb = CopyOutValue(BinaryTreeIteratorData(&bti))) == NULL)
+	goto err2;
+      if (PS_AddMember(ps, BinaryTreeIteratorKey(&bti), memb) < 0)
+	goto err3;
+    }
+    return ps;
+    
+  default:
+    return (struct ps_value_t *) v;
+  }
+  
+ err3:
+  PS_FreeValue(memb);
+ err2:
+  PS_FreeValue(ps);
+ err:
+  fprintf(stderr, "Could not copy frozen value\n");
+  return NULL;
+}
+
+static void Thaw(struct ps_value_t *v);
+
+static void ThawMember(const char *key, void **data, void *ref) {
+  (void) key;
+  (void) ref;
+  
+  Thaw((struct ps_value_t *) *data);
+}
+
+static void Thaw(struct ps_value_t *v) {
+  size_t count;
+  
+  if (!IsFrozen(v))
+    return;
+  
+  switch (Type(v)) {
+  case t_string:
+  case t_variable:
+  case t_builtin_func:
+    if (!IS_INLINE(v))
+      STR_BUF(v->v.v_string)->frozen = 0;
+    break;
+  
+  case t_list:
+  case t_function:
+    for (count = 0; count < v->v.v_list->num_elem; count++)
+      Thaw(v->v.v_list->v[count]);
+    v->v.v_list->frozen = 0;
+    break;
+  
+  case t_object:
+    BinaryTreeForeach(v->v.v_object, ThawMember, NULL);
+    BinaryTreeThaw(v->v.v_object);
+    break;
+  
+  default:
+    break;
+  }
+  
+  v->is_frozen = 0;
+}
+
+void FreeFrozenValue(struct ps_value_t *v) {
+  if (v == NULL)
+    return;
+  
+  Thaw(v);
+  PS_FreeValue(v);
+}
+
 void PS_StringToVariable(struct ps_value_t *v) {
-  if (v == NULL || v->type != t_string)
+  if (v == NULL || Type(v) != t_string || CheckModify(v) < 0)
     return;
 
-  v->type = t_variable;
+  SetType(v, t_variable);
 }
 void PS_VariableToString(struct ps_value_t *v) {
-  if (v == NULL || v->type != t_variable)
+  if (v == NULL || Type(v) != t_variable || CheckModify(v) < 0)
     return;
 
-  v->type = t_string;
+  SetType(v, t_string);
 }
 
 int PS_AppendToString(struct ps_value_t *str, const char *append) {
+  struct str_buf_t *buf;
   size_t len1, len2, tot;
-  char *nstr;
   
   if (str == NULL || append == NULL)
     return -1;
   
-  if (str->type != t_string &&
-      str->type != t_variable &&
-      str->type != t_builtin_func)
+  if (Type(str) != t_string &&
+      Type(str) != t_variable &&
+      Type(str) != t_builtin_func)
     return -1;
-
+  
+  if (CheckModify(str) < 0)
+    return -1;
+  
   len1 = strlen(str->v.v_string);
   len2 = strlen(append);
   tot  = len1 + len2;
-
-  if ((nstr = realloc(str->v.v_string, tot + 1)) == NULL)
-    return -1;
   
-  memcpy(nstr + len1, append, len2);
-  nstr[tot] = '\0';
-  str->v.v_string = nstr;
+  if (!IS_INLINE(str) && !str->in_arena && !IsBorrowed(str) && STR_BUF(str->v.v_string)->ref_count == 0) {
+    if ((buf = MemRealloc(STR_BUF(str->v.v_string), sizeof(*buf) + len1 + 1, sizeof(*buf) + tot + 1, mem_string)) == NULL)
+      return -1;
+  } else {
+    if ((buf = NewStrBuf(tot, str->in_arena)) == NULL)
+      return -1;
+    memcpy(buf->str, str->v.v_string, len1);
+    if (!IS_INLINE(str) && !IsBorrowed(str))
+      FreeStrBuf(STR_BUF(str->v.v_string));
+  }
+  
+  memcpy(buf->str + len1, append, len2);
+  buf->str[tot] = '\0';
+  str->v.v_string = buf->str;
   
   return 0;
 }
@@ -555,16 +1352,18 @@ static int GrowList(struct list_head_t *list) {
   struct ps_value_t **v;
   size_t new_alloc;
 
-  new_alloc = list->num_alloc << 1;
-  if (new_alloc < list->num_alloc)
+  new_alloc = list->num_alloc < INIT_LIST_SZ ? INIT_LIST_SZ : list->num_alloc << 1;
+  if (new_alloc < list->num_alloc || new_alloc > SIZE_MAX / sizeof(struct ps_value_t *))
     return -1;
 
-  if ((v = calloc(new_alloc, sizeof(struct ps_value_t **))) == NULL)
+  if ((v = AllocMem(new_alloc * sizeof(struct ps_value_t *), mem_list, list->in_arena)) == NULL)
     return -1;
   
-  memcpy(v, list->v, list->num_elem * sizeof(struct ps_value_t **));
-  free(list->v);
+  memcpy(v, list->v, list->num_elem * sizeof(struct ps_value_t *));
+  if (list->v != list->inline_v)
+    FreeMem(list->v, list->num_alloc * sizeof(struct ps_value_t *), mem_list, list->in_arena);
   list->v = v;
+  list->num_alloc = new_alloc;
   
   return 0;
 }
@@ -575,7 +1374,10 @@ int PS_AppendToList(struct ps_value_t *list, struct ps_value_t *v) {
   if (list == NULL || v == NULL)
     return -1;
   
-  if (list->type != t_list && list->type != t_function)
+  if (Type(list) != t_list && Type(list) != t_function)
+    return -1;
+  
+  if (Unshare(list) < 0)
     return -1;
   
   head = list->v.v_list;
@@ -609,12 +1411,15 @@ struct ps_value_t *PS_PopFromList(struct ps_value_t *list) {
   if (list == NULL)
     return NULL;
   
-  if (list->type != t_list && list->type != t_function)
+  if (Type(list) != t_list && Type(list) != t_function)
     return NULL;
   
   if (list->v.v_list->num_elem == 0)
     return NULL;
   
+  if (Unshare(list) < 0)
+    return NULL;
+  
   return list->v.v_list->v[--list->v.v_list->num_elem];
 }
 
@@ -624,7 +1429,10 @@ int PS_PrependToList(struct ps_value_t *list, struct ps_value_t *v) {
   if (list == NULL || v == NULL)
     return -1;
   
-  if (list->type != t_list && list->type != t_function)
+  if (Type(list) != t_list && Type(list) != t_function)
+    return -1;
+  
+  if (Unshare(list) < 0)
     return -1;
   
   head = list->v.v_list;
@@ -645,12 +1453,15 @@ int PS_SetItem(struct ps_value_t *list, size_t pos, struct ps_value_t *v) {
   if (list == NULL || v == NULL)
     return -1;
   
-  if (list->type != t_list && list->type != t_function)
+  if (Type(list) != t_list && Type(list) != t_function)
     return -1;
   
   if (pos >= list->v.v_list->num_elem)
     return -1;
   
+  if (Unshare(list) < 0)
+    return -1;
+  
   head = list->v.v_list;
   PS_FreeValue(head->v[pos]);
   head->v[pos] = v;
@@ -665,12 +1476,15 @@ int PS_ResizeList(struct ps_value_t *list, size_t new_size, const struct ps_valu
   if (list == NULL)
     goto err;
   
-  if (list->type != t_list && list->type != t_function)
+  if (Type(list) != t_list && Type(list) != t_function)
     goto err;
   
   if (fill == NULL && list->v.v_list->num_elem < new_size)
     goto err;
   
+  if (Unshare(list) < 0)
+    goto err;
+  
   head = list->v.v_list;
   
   while (head->num_alloc < new_size)
@@ -696,23 +1510,91 @@ int PS_ResizeList(struct ps_value_t *list, size_t new_size, const struct ps_valu
 }
 
 int PS_AddMember(struct ps_value_t *obj, const char *name, struct ps_value_t *v) {
+  struct binary_tree_t *bt;
+  
   if (obj == NULL || name == NULL || v == NULL)
     return -1;
   
-  if (obj->type != t_object)
+  if (Type(obj) != t_object)
+    return -1;
+  
+  if (CheckModify(obj) < 0 || (bt = Tree(obj)) == NULL)
     return -1;
   
-  return BinaryTreeInsert(obj->v.v_object, name, v);
+  return BinaryTreeInsert(bt, name, v);
 }
 
 int PS_RemoveMember(struct ps_value_t *obj, const char *name) {
+  struct binary_tree_t *bt;
+  
   if (obj == NULL)
     return -1;
   
-  if (obj->type != t_object)
+  if (Type(obj) != t_object)
+    return -1;
+  
+  if (CheckModify(obj) < 0 || (bt = Tree(obj)) == NULL)
+    return -1;
+  
+  return BinaryTreeRemove(bt, name);
+}
+
+struct set_op_t {
+  int (*merge)(const char *, struct ps_value_t **, const struct ps_value_t *, void *);
+  int (*rm)(const char *, struct ps_value_t *, const struct ps_value_t *, void *);
+  void *ref;
+};
+
+static int MergeVoid(const char *key, void **data, const void *src_data, void *ref) {
+  struct set_op_t *op = (struct set_op_t *) ref;
+  struct ps_value_t *memb = (struct ps_value_t *) *data;
+  int ret;
+  
+  ret = op->merge(key, &memb, (const struct ps_value_t *) src_data, op->ref);
+  *data = memb;
+  return ret;
+}
+
+static int RemoveVoid(const char *key, void *data, const void *src_data, void *ref) {
+  struct set_op_t *op = (struct set_op_t *) ref;
+  
+  return op->rm(key, (struct ps_value_t *) data, (const struct ps_value_t *) src_data, op->ref);
+}
+
+int PS_UnionObject(struct ps_value_t *dest, const struct ps_value_t *src, int (*merge)(const char *name, struct ps_value_t **memb, const struct ps_value_t *src_memb, void *ref), void *ref) {
+  struct binary_tree_t *bt, *sbt;
+  struct set_op_t op;
+  
+  if (dest == NULL || src == NULL)
+    return -1;
+  
+  if (Type(dest) != t_object || Type(src) != t_object)
+    return -1;
+  
+  if (CheckModify(dest) < 0 || (bt = Tree(dest)) == NULL || (sbt = Tree(src)) == NULL)
     return -1;
   
-  return BinaryTreeRemove(obj->v.v_object, name);
+  op.merge = merge;
+  op.ref = ref;
+  return BinaryTreeUnion(bt, sbt, merge ? MergeVoid : NULL, &op);
+}
+
+int PS_DifferenceObject(struct ps_value_t *dest, const struct ps_value_t *src, int (*rm)(const char *name, struct ps_value_t *memb, const struct ps_value_t *src_memb, void *ref), void *ref) {
+  struct binary_tree_t *bt, *sbt;
+  struct set_op_t op;
+  
+  if (dest == NULL || src == NULL)
+    return -1;
+  
+  if (Type(dest) != t_object || Type(src) != t_object)
+    return -1;
+  
+  if (CheckModify(dest) < 0 || (bt = Tree(dest)) == NULL || (sbt = Tree(src)) == NULL)
+    return -1;
+  
+  op.rm = rm;
+  op.ref = ref;
+  return BinaryTreeDifference(bt, sbt, rm ? RemoveVoid : NULL, &op);
 }
 
 static ssize_t WriteNewline(struct ps_ostream_t *os, ssize_t indent) {
@@ -734,12 +1616,13 @@ static ssize_t WriteNewline(struct ps_ostream_t *os, ssize_t indent) {
 static ssize_t WriteValueIndent(struct ps_ostream_t *os, const struct ps_value_t *v, ssize_t indent) {
   size_t count, bytes;
   ssize_t len;
-  struct binary_tree_iterator_t *bti;
+  struct binary_tree_t *bt;
+  struct binary_tree_iterator_t bti;
   
   if (v == NULL)
     return PS_WriteStr(os, "null");
   
-  switch (v->type) {
+  switch (Type(v)) {
   case t_null:
     return PS_WriteStr(os, "null");
     
@@ -747,14 +1630,14 @@ static ssize_t WriteValueIndent(struct ps_ostream_t *os, const struct ps_value_t
     return PS_WriteStr(os, v->v.v_integer ? "true" : "false");
 
   case t_integer:
-    return PS_Printf(os, "%lld", (long long) v->v.v_integer);
+    return PS_Printf(os, "%lld", (long long) IntValue(v));
 
   case t_float:
-    return PS_Printf(os, "%.15g", v->v.v_float);
+    return PS_Printf(os, "%.15g", FloatValue(v));
 
   case t_string:
   case t_variable:
-    return PS_WriteJsonStr(os, v->v.v_string, v->type == t_string);
+    return PS_WriteJsonStr(os, v->v.v_string, Type(v) == t_string);
 
   case t_builtin_func:
     if (PS_WriteStr(os, "builtin<") < 0)
@@ -768,7 +1651,7 @@ static ssize_t WriteValueIndent(struct ps_ostream_t *os, const struct ps_value_t
   case t_list:
   case t_function:
     bytes = 0;
-    if (PS_WriteChar(os, v->type == t_list ? '[' : '(') < 0)
+    if (PS_WriteChar(os, Type(v) == t_list ? '[' : '(') < 0)
       return -1;
     bytes++;
     
@@ -787,50 +1670,50 @@ static ssize_t WriteValueIndent(struct ps_ostream_t *os, const struct ps_value_t
       bytes += len;
     }
     
-    if (PS_WriteChar(os, v->type == t_list ? ']' : ')') < 0)
+    if (PS_WriteChar(os, Type(v) == t_list ? ']' : ')') < 0)
       return -1;
     bytes++;
     return bytes;
     
   case t_object:
-    bytes = 0;
-    if ((bti = NewBinaryTreeIterator(v->v.v_object)) == NULL)
+    if ((bt = Tree(v)) == NULL)
       return -1;
+    bytes = 0;
+    BinaryTreeIteratorInit(&bti, bt);
     if (PS_WriteChar(os, '{') < 0)
-      goto objerr;
+      return -1;
     bytes++;
     count = 0;
-    while (BinaryTreeIteratorNext(bti)) {
+    while (BinaryTreeIteratorNext(&bti)) {
       if (count > 0) {
 	if (PS_WriteChar(os, ',') < 0)
-	  goto objerr;
+	  return -1;
 	bytes++;
 	if ((len = WriteNewline(os, indent)) < 0)
 	  return -1;
 	bytes += len;
       }
       
-      if ((len = PS_WriteJsonStr(os, BinaryTreeIteratorKey(bti), 1)) < 0)
-	goto objerr;
+      if ((len = PS_WriteJsonStr(os, BinaryTreeIteratorKey(&bti), 1)) < 0)
+	return -1;
       bytes += len;
       
       if (PS_WriteChar(os, ':') < 0)
-	goto objerr;
+	return -1;
       bytes++;
 
       if (indent > 0) {
 	if (PS_WriteChar(os, ' ') < 0)
-	  goto objerr;
+	  return -1;
 	bytes++;
       }
       
-      if ((len = WriteValueIndent(os, (struct ps_value_t *)BinaryTreeIteratorData(bti), indent < 0 ? indent : indent + len + 3)) < 0)
-	goto objerr;
+      if ((len = WriteValueIndent(os, (struct ps_value_t *)BinaryTreeIteratorData(&bti), indent < 0 ? indent : indent + len + 3)) < 0)
+	return -1;
       bytes += len;
       
       count++;
     }
-    FreeBinaryTreeIterator(bti);
     if (PS_WriteChar(os, '}') < 0)
       return -1;
     bytes++;
@@ -838,10 +1721,6 @@ static ssize_t WriteValueIndent(struct ps_ostream_t *os, const struct ps_value_t
   }
   
   return  0;
-
- objerr:
-  FreeBinaryTreeIterator(bti);
-  return -1;
 }
 
 ssize_t PS_WriteValue(struct ps_ostream_t *os, const struct ps_value_t *v) {
@@ -866,12 +1745,16 @@ static void bt_func(const char *key, void **vv, void *ref_func) {
 
 void PS_ValueForeach(const struct ps_value_t *v, void (*func)(const char *, struct ps_value_t **, void *), void *ref_data) {
   struct ref_func rf;
+  struct binary_tree_t *bt;
   struct ps_value_t **cur, **end;
   
   if (v == NULL || func == NULL)
     return;
   
-  switch (v->type) {
+  if (UnshareRead(v) < 0)
+    return;
+  
+  switch (Type(v)) {
   case t_list:
   case t_function:
     cur = (struct ps_value_t **) v->v.v_list->v;
@@ -882,9 +1765,11 @@ void PS_ValueForeach(const struct ps_value_t *v, void (*func)(const char *, stru
     break;
 
   case t_object:
+    if ((bt = Tree(v)) == NULL)
+      return;
     rf.ref_data = ref_data;
     rf.func = func;
-    BinaryTreeForeach(v->v.v_object, bt_func, &rf);
+    BinaryTreeForeach(bt, bt_func, &rf);
     break;
 
   default:
@@ -892,58 +1777,60 @@ void PS_ValueForeach(const struct ps_value_t *v, void (*func)(const char *, stru
   }
 }
 
-struct ps_value_iterator_t {
-  struct ps_value_t *v;
-  size_t count;
-  int init;
-  struct binary_tree_iterator_t *bti;
-};
+/* The tree iterator is stored in the public iterator */
+typedef char bti_fits_t[sizeof(struct binary_tree_iterator_t) <= sizeof(((struct ps_value_iterator_t *) 0)->bti) ? 1 : -1];
 
-struct ps_value_iterator_t *PS_NewValueIterator(const struct ps_value_t *v) {
-  struct ps_value_iterator_t *vi;
+#define BTI(vi) ((struct binary_tree_iterator_t *) (vi)->bti)
+
+int PS_InitValueIterator(struct ps_value_iterator_t *vi, const struct ps_value_t *v) {
+  struct binary_tree_t *bt;
   
   if (v == NULL)
-    goto err;
+    return -1;
   
-  if ((vi = malloc(sizeof(*vi))) == NULL)
-    goto err;
   memset(vi, 0, sizeof(*vi));
-
   vi->v = (struct ps_value_t *) v;
-
-  switch (v->type) {
+  
+  switch (Type(v)) {
   case t_list:
   case t_function:
-    break;
-
+    return 0;
+    
   case t_object:
-    if ((vi->bti = NewBinaryTreeIterator(v->v.v_object)) == NULL)
-      goto err2;
-    break;
-
+    if ((bt = Tree(v)) == NULL)
+      return -1;
+    BinaryTreeIteratorInit(BTI(vi), bt);
+    return 0;
+    
   default:
-    goto err;
+    return -1;
   }
+}
 
+struct ps_value_iterator_t *PS_NewValueIterator(const struct ps_value_t *v) {
+  struct ps_value_iterator_t *vi;
+  
+  if ((vi = MemAlloc(sizeof(*vi), mem_other)) == NULL)
+    return NULL;
+  
+  if (PS_InitValueIterator(vi, v) < 0) {
+    MemFree(vi, sizeof(*vi), mem_other);
+    return NULL;
+  }
+  
   return vi;
-
- err2:
-  free(vi);
- err:
-  return NULL;
 }
 
 void PS_FreeValueIterator(struct ps_value_iterator_t *vi) {
   if (vi == NULL)
     return;
   
-  FreeBinaryTreeIterator(vi->bti);
-  free(vi);
+  MemFree(vi, sizeof(*vi), mem_other);
 }
 
 int PS_ValueIteratorNext(struct ps_value_iterator_t *vi) {
-  if (vi->v->type == t_object)
-    return BinaryTreeIteratorNext(vi->bti);
+  if (Type(vi->v) == t_object)
+    return BinaryTreeIteratorNext(BTI(vi));
 
   if (vi->init)
     vi->count++;
@@ -953,15 +1840,23 @@ int PS_ValueIteratorNext(struct ps_value_iterator_t *vi) {
 }
 
 const char *PS_ValueIteratorKey(const struct ps_value_iterator_t *vi) {
-  if (vi->v->type == t_object)
-    return BinaryTreeIteratorKey(vi->bti);
+  if (Type(vi->v) == t_object)
+    return BinaryTreeIteratorKey(BTI(vi));
 
   return NULL;
 }
 
+/* Iterating only reads v.  Like PS_GetMember and PS_GetItem, handing
+ * out an item that can be modified unshares what holds it first. */
 struct ps_value_t *PS_ValueIteratorData(const struct ps_value_iterator_t *vi) {
-  if (vi->v->type == t_object)
-    return (struct ps_value_t *)BinaryTreeIteratorData(vi->bti);
-
-  return vi->v->v.v_list->v[vi->count];
+  struct ps_value_t *data;
+  
+  if (Type(vi->v) != t_object)
+    return PS_GetItem(vi->v, vi->count);
+  
+  data = (struct ps_value_t *) BinaryTreeIteratorData(BTI(vi));
+  if (IsMutable(data) && !IsForeign(vi->v))
+    data = BinaryTreeIteratorDataMutable(BTI(vi), Tree(vi->v));
+  
+  return data;
 }
@@ -0,0 +1,233 @@
+/*
+  Copyright (C) 2018 Paul Maurer
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+  
+  1. Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+  
+  2. Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+  
+  3. Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from this
+  software without specific prior written permission.
+  
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <string.h>
+#include <errno.h>
+
+#if defined(HAVE_SYS_INOTIFY_H) && defined(HAVE_INOTIFY_INIT1)
+#include <sys/inotify.h>
+#include <unistd.h>
+#define USE_INOTIFY
+#endif
+
+#include "ps_arena.h"
+#include "ps_watch.h"
+
+/* The watches are changed under lock_watch.  Changes are read under
+ * lock_changes, which is held while changed is called, so only the
+ * thread reading them removes watches. */
+static int active;
+
+#ifdef USE_INOTIFY
+
+#define NAMES_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)
+#define WATCH_MASK (NAMES_MASK | IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB)
+
+/* Several directory names may refer to the same watch */
+struct watch_t {
+  int wd;
+  char *dir;
+};
+
+static int fd = -1;
+static struct watch_t *watches;
+static size_t num_watches;
+static size_t max_watches;
+
+static void FreeStr(char *str) {
+  if (str)
+    MemFree(str, strlen(str) + 1, mem_other);
+}
+
+/* changed takes locks that are held by threads waiting for lock_watch,
+ * so it is called without it.  Watches are only added at the end of
+ * watches meanwhile. */
+static void Event(const struct inotify_event *ev, void (*changed)(const char *dir, const char *name, int names, void *ref), void *ref) {
+  const char *dir;
+  size_t count;
+  
+  if (ev->mask & IN_Q_OVERFLOW) {
+    changed(NULL, NULL, 1, ref);
+    return;
+  }
+  
+  LockShared(lock_watch);
+  for (count = 0; count < num_watches; count++) {
+    if (watches[count].wd != ev->wd)
+      continue;
+    
+    dir = watches[count].dir;
+    UnlockShared(lock_watch);
+    changed(dir, ev->len ? ev->name : NULL, (ev->mask & NAMES_MASK) != 0, ref);
+    LockShared(lock_watch);
+  }
+  
+  if ((ev->mask & IN_IGNORED) == 0)
+    goto out;
+  
+  /* The directory is gone, it is watched again when it is read again */
+  for (count = 0; count < num_watches; ) {
+    if (watches[count].wd == ev->wd) {
+      FreeStr(watches[count].dir);
+      watches[count] = watches[--num_watches];
+    } else {
+      count++;
+    }
+  }
+  
+ out:
+  UnlockShared(lock_watch);
+}
+
+#endif
+
+int WatchStart(void) {
+#ifdef USE_INOTIFY
+  int ret = 0;
+  
+  LockShared(lock_watch);
+  if (active)
+    goto out;
+  
+  if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+    perror("Cannot watch definition files");
+    ret = -1;
+    goto out;
+  }
+  
+  active = 1;
+  
+ out:
+  UnlockShared(lock_watch);
+  return ret;
+#else
+  fprintf(stderr, "Watching definition files is not supported\n");
+  return -1;
+#endif
+}
+
+int WatchActive(void) {
+  int ret;
+  
+  LockShared(lock_watch);
+  ret = active;
+  UnlockShared(lock_watch);
+  
+  return ret;
+}
+
+int WatchDirectory(const char *dir) {
+#ifdef USE_INOTIFY
+  struct watch_t *nw;
+  size_t count, max;
+  int wd, ret = -1;
+  
+  LockShared(lock_watch);
+  if (!active)
+    goto out;
+  
+  for (count = 0; count < num_watches; count++) {
+    if (strcmp(watches[count].dir, dir) == 0) {
+      ret = 0;
+      goto out;
+    }
+  }
+  
+  if (num_watches == max_watches) {
+    max = max_watches ? 2 * max_watches : 16;
+    if ((nw = MemRealloc(watches, max_watches * sizeof(*watches), max * sizeof(*watches), mem_other)) == NULL)
+      goto out;
+    watches = nw;
+    max_watches = max;
+  }
+  
+  if ((wd = inotify_add_watch(fd, *dir ? dir : ".", WATCH_MASK | IN_ONLYDIR)) < 0)
+    goto out;
+  if ((watches[num_watches].dir = MemStrdup(dir, mem_other)) == NULL)
+    goto out;
+  watches[num_watches++].wd = wd;
+  ret = 0;
+  
+ out:
+  UnlockShared(lock_watch);
+  return ret;
+#else
+  return -1;
+#endif
+}
+
+void WatchChanges(void (*changed)(const char *dir, const char *name, int names, void *ref), void *ref) {
+#ifdef USE_INOTIFY
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  ssize_t len, pos;
+  int rfd;
+  
+  LockShared(lock_changes);
+  
+  /* Only the reader of the changes closes fd */
+  LockShared(lock_watch);
+  rfd = active ? fd : -1;
+  UnlockShared(lock_watch);
+  if (rfd < 0)
+    goto out;
+  
+  while ((len = read(rfd, buf, sizeof(buf))) > 0 || (len < 0 && errno == EINTR))
+    for (pos = 0; pos < len; pos += sizeof(*ev) + ev->len) {
+      ev = (const struct inotify_event *) (buf + pos);
+      Event(ev, changed, ref);
+    }
+  
+  if (len < 0 && errno == EAGAIN)
+    goto out;
+  
+  /* Nothing is seen any more, so nothing can be trusted */
+  perror("Cannot read changes to definition files");
+  LockShared(lock_watch);
+  close(fd);
+  fd = -1;
+  while (num_watches > 0)
+    FreeStr(watches[--num_watches].dir);
+  active = 0;
+  UnlockShared(lock_watch);
+  changed(NULL, NULL, 1, ref);
+  
+ out:
+  UnlockShared(lock_changes);
+#endif
+}
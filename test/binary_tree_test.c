@@ -40,11 +40,11 @@ const char *words[] =
   {"hi", "bye", "word", "test", "sequence", "license", "bsd", "3-clause", "best", "verify", "error", "word", "numeric", "alpha", "beta", "twice", "again", "more", "zoo", "the", "quick", "sly", "fox", "jumped", "over", "the", "two", "lazy", "dogs" };
 
 int main(void) {
-  struct binary_tree_t *bt;
-  struct binary_tree_iterator_t *bti;
+  struct binary_tree_t *bt, *bt2, *bt3;
+  struct binary_tree_iterator_t *bti, bti2;
   char buf[256];
   const char *prev, *cur;
-  int count, num;
+  int count, num, found;
 
   if ((bt = NewBinaryTree(NULL, NULL)) == NULL)
     exit(1);
@@ -96,5 +96,116 @@ int main(void) {
     fprintf(stderr, "Incorrect count\n");
   }
   
+  /* Keys are interned, equal keys in different trees share storage */
+  if ((bt2 = NewBinaryTree(NULL, NULL)) == NULL)
+    exit(1);
+  for (count = sizeof(words) / sizeof(char *); count > 0; count--) {
+    snprintf(buf, sizeof(buf), "%s", words[count - 1]);
+    if (BinaryTreeInsert(bt2, buf, NULL) < 0) {
+      fprintf(stderr, "Cannot insert %s\n", buf);
+      exit(1);
+    }
+  }
+  
+  BinaryTreeIteratorInit(&bti2, bt2);
+  while (BinaryTreeIteratorNext(&bti2)) {
+    cur = BinaryTreeIteratorKey(&bti2);
+    BinaryTreeIteratorReset(bti);
+    while (BinaryTreeIteratorNext(bti) && strcmp(BinaryTreeIteratorKey(bti), cur) != 0)
+      ;
+    if (BinaryTreeIteratorKey(bti) != cur)
+      fprintf(stderr, "Key not shared: %s\n", cur);
+  }
+  
+  for (count = 0; count < sizeof(words) / sizeof(char *); count++)
+    BinaryTreeRemove(bt2, words[count]);
+  if (BinaryTreeCount(bt2) != 0)
+    fprintf(stderr, "Incorrect count after remove\n");
+  FreeBinaryTree(bt2);
+
+  /* Copies share nodes, changing one must not change the other */
+  if (BinaryTreeInsert(bt, "shared", NULL) < 0)
+    exit(1);
+  if ((bt2 = CopyBinaryTree(bt)) == NULL)
+    exit(1);
+  for (count = 0; count < sizeof(words) / sizeof(char *); count++)
+    BinaryTreeRemove(bt2, words[count]);
+  for (count = 0; count < 1000; count++) {
+    snprintf(buf, sizeof(buf), "copy%04d", count);
+    if (BinaryTreeInsert(bt2, buf, NULL) < 0) {
+      fprintf(stderr, "Cannot insert %s\n", buf);
+      exit(1);
+    }
+  }
+  BinaryTreeRemove(bt, "shared");
+  if (!BinaryTreeVerify(bt) || !BinaryTreeVerify(bt2))
+    fprintf(stderr, "Tree verification failed after copy\n");
+  if (BinaryTreeCount(bt) != num || BinaryTreeCount(bt2) != num - 27 + 1 + 1000)
+    fprintf(stderr, "Incorrect count after copy\n");
+
+  for (count = 0; count < sizeof(words) / sizeof(char *); count++) {
+    BinaryTreeLookup(bt, words[count], &found);
+    if (!found)
+      fprintf(stderr, "Copy changed original: %s\n", words[count]);
+    BinaryTreeLookup(bt2, words[count], &found);
+    if (found)
+      fprintf(stderr, "Remove from copy failed: %s\n", words[count]);
+  }
+  BinaryTreeLookup(bt2, "shared", &found);
+  if (!found)
+    fprintf(stderr, "Original changed copy\n");
+  FreeBinaryTree(bt2);
+
+  /* Lookups build an index, which must follow inserts and removes */
+  if ((bt2 = NewBinaryTree(NULL, NULL)) == NULL)
+    exit(1);
+  for (count = 0; count < 2000; count++) {
+    snprintf(buf, sizeof(buf), "index%d", count);
+    if (BinaryTreeInsert(bt2, buf, NULL) < 0)
+      exit(1);
+    BinaryTreeLookup(bt2, buf, NULL);
+  }
+  for (count = 0; count < 2000; count += 2) {
+    snprintf(buf, sizeof(buf), "index%d", count);
+    BinaryTreeRemove(bt2, buf);
+  }
+  for (count = 0; count < 2000; count++) {
+    snprintf(buf, sizeof(buf), "index%d", count);
+    BinaryTreeLookup(bt2, buf, &found);
+    if (found != count % 2)
+      fprintf(stderr, "Index lookup failed: %s\n", buf);
+  }
+  if (!BinaryTreeVerify(bt2) || BinaryTreeCount(bt2) != 1000)
+    fprintf(stderr, "Tree verification failed after index\n");
+
+  /* Union and difference relink both trees into a balanced tree */
+  if ((bt3 = NewBinaryTree(NULL, NULL)) == NULL)
+    exit(1);
+  for (count = 0; count < 3000; count += 3) {
+    snprintf(buf, sizeof(buf), "index%d", count);
+    if (BinaryTreeInsert(bt3, buf, NULL) < 0)
+      exit(1);
+  }
+  if (BinaryTreeUnion(bt2, bt3, NULL, NULL) < 0)
+    exit(1);
+  if (!BinaryTreeVerify(bt2) || BinaryTreeCount(bt2) != 1000 + 1000 - 333)
+    fprintf(stderr, "Tree verification failed after union\n");
+  BinaryTreeRemove(bt3, "index3");
+  if (BinaryTreeDifference(bt2, bt3, NULL, NULL) < 0)
+    exit(1);
+  if (!BinaryTreeVerify(bt2) || BinaryTreeCount(bt2) != 1000 - 333 + 1)
+    fprintf(stderr, "Tree verification failed after difference\n");
+  for (count = 0; count < 3000; count++) {
+    snprintf(buf, sizeof(buf), "index%d", count);
+    BinaryTreeLookup(bt2, buf, &found);
+    if (found != (count < 2000 && count % 2 && (count % 3 || count == 3)))
+      fprintf(stderr, "Lookup failed after difference: %s\n", buf);
+  }
+  FreeBinaryTree(bt3);
+
+  FreeBinaryTreeIterator(bti);
+  FreeBinaryTree(bt2);
+  FreeBinaryTree(bt);
+  
   return 0;
 }
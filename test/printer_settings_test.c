@@ -31,14 +31,235 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <utime.h>
+
+#ifdef __WIN32
+#include <direct.h>
+#define mkdir(dir, mode) _mkdir(dir)
+#define rmdir(dir) _rmdir(dir)
+#else
+#include <unistd.h>
+#endif
 
 #include "printer_settings.h"
 #include "ps_ostream.h"
 #include "ps_slice.h"
+#include "ps_path.h"
+
+/* Printer settings loaded another way must match the plain load */
+static void CheckSame(const char *what, struct ps_value_t *ps, const char *expect) {
+  struct ps_ostream_t *os;
+  
+  if (ps == NULL) {
+    fprintf(stderr, "%s: Could not create printer settings\n", what);
+    exit(1);
+  }
+  
+  if ((os = PS_NewStrOStream()) == NULL)
+    exit(1);
+  PS_WriteValue(os, ps);
+  if (strcmp(PS_OStreamContents(os), expect) != 0) {
+    printf("%s: different\n", what);
+    exit(1);
+  }
+  printf("%s: same\n", what);
+  
+  PS_FreeOStream(os);
+  PS_FreeValue(ps);
+}
+
+/* Without thread support extruders load one after another */
+static void TestThreads(const struct ps_value_t *search, const char *expect) {
+  PS_SetLoadThreads(4);
+  CheckSame("Threaded load", PS_New("thread_printer", search), expect);
+  PS_SetLoadThreads(1);
+}
+
+/* Without watching support definition files are checked every load.
+ * The second load uses the definitions kept from the first. */
+static void TestWatch(const struct ps_value_t *search, const char *expect) {
+  PS_WatchDefinitions();
+  CheckSame("Watched load", PS_New("thread_printer", search), expect);
+  CheckSame("Watched reload", PS_New("thread_printer", search), expect);
+}
+
+static void TestSnapshot(const struct ps_value_t *ps, const struct ps_value_t *search, const char *expect) {
+  if (PS_SaveSnapshot(ps, "test.snapshot") < 0) {
+    fprintf(stderr, "Could not save printer settings snapshot\n");
+    exit(1);
+  }
+  CheckSame("Snapshot", PS_LoadSnapshot("test.snapshot", "thread_printer", search), expect);
+  remove("test.snapshot");
+}
+
+/* Writes a copy of thread_printer with the default layer height
+ * replaced, keeping the modification time if keep is set.  The change
+ * time of a kept file still moves on, so the rewrite is seen. */
+static void WriteTestPrinter(const char *file, const char *layer_height, int keep) {
+  static const char find[] = "\"default_value\": 0.1 }";
+  struct stat st;
+  struct utimbuf ut;
+  struct timespec tick = {0, 20000000};
+  char buf[8192], *pos;
+  size_t len;
+  FILE *in, *out;
+  
+  if ((in = fopen("thread_printer.def.json", "rb")) == NULL)
+    exit(1);
+  len = fread(buf, 1, sizeof(buf) - 1, in);
+  fclose(in);
+  buf[len] = '\0';
+  if ((pos = strstr(buf, find)) == NULL)
+    exit(1);
+  
+  if (keep) {
+    if (stat(file, &st) < 0)
+      exit(1);
+    nanosleep(&tick, NULL);
+  }
+  if ((out = fopen(file, "wb")) == NULL)
+    exit(1);
+  fprintf(out, "%.*s\"default_value\": %s }%s", (int) (pos - buf), buf, layer_height, pos + strlen(find));
+  fclose(out);
+  
+  if (keep) {
+    ut.actime = st.st_atime;
+    ut.modtime = st.st_mtime;
+    utime(file, &ut);
+  }
+}
+
+static double LayerHeight(const char *printer, const struct ps_value_t *search) {
+  struct ps_value_t *ps;
+  double height;
+  
+  if ((ps = PS_New(printer, search)) == NULL) {
+    fprintf(stderr, "Could not create printer settings for %s\n", printer);
+    exit(1);
+  }
+  height = PS_AsFloat(PS_GetMember(PS_GetSettingProperties(ps, "#global", "layer_height"), "default_value", NULL));
+  PS_FreeValue(ps);
+  
+  return height;
+}
+
+/* A definition file is parsed again only if its size or modification
+ * time changed, so a change that keeps both is not seen */
+static void TestDefinitionCache(const struct ps_value_t *search) {
+  double first, same, changed;
+  
+  WriteTestPrinter("cache_printer.def.json", "0.1", 0);
+  first = LayerHeight("cache_printer", search);
+  WriteTestPrinter("cache_printer.def.json", "0.2", 1);
+  same = LayerHeight("cache_printer", search);
+  WriteTestPrinter("cache_printer.def.json", "0.25", 0);
+  changed = LayerHeight("cache_printer", search);
+  remove("cache_printer.def.json");
+  
+  printf("Definition cache: %g, kept time %g, changed %g\n", first, same, changed);
+}
+
+static int Loaded(struct ps_value_t *ps) {
+  int found = ps != NULL;
+  
+  PS_FreeValue(ps);
+  return found;
+}
+
+/* A file added to the search path before one a snapshot was loaded
+ * from makes the snapshot stale, also once it is trusted */
+static void TestShadowedSnapshot(void) {
+  struct ps_value_t *search, *ps;
+  int before, trusted, shadowed;
+  
+  mkdir("shadow_a", 0777);
+  mkdir("shadow_b", 0777);
+  if ((search = PS_NewList()) == NULL ||
+      PS_AppendToList(search, PS_NewString("shadow_a")) < 0 ||
+      PS_AppendToList(search, PS_NewString("shadow_b")) < 0)
+    exit(1);
+  
+  WriteTestPrinter("shadow_b/shadow_printer.def.json", "0.1", 0);
+  if ((ps = PS_New("shadow_printer", search)) == NULL || PS_SaveSnapshot(ps, "shadow.snapshot") < 0)
+    exit(1);
+  PS_FreeValue(ps);
+  
+  before = Loaded(PS_LoadSnapshot("shadow.snapshot", "shadow_printer", search));
+  trusted = Loaded(PS_LoadSnapshot("shadow.snapshot", "shadow_printer", search));
+  WriteTestPrinter("shadow_a/shadow_printer.def.json", "0.2", 0);
+  shadowed = Loaded(PS_LoadSnapshot("shadow.snapshot", "shadow_printer", search));
+  
+  remove("shadow.snapshot");
+  remove("shadow_a/shadow_printer.def.json");
+  remove("shadow_b/shadow_printer.def.json");
+  rmdir("shadow_a");
+  rmdir("shadow_b");
+  PS_FreeValue(search);
+  
+  printf("Shadowed snapshot: %d, trusted %d, shadowed %d\n", before, trusted, shadowed);
+}
+
+static void Touch(const char *file) {
+  FILE *out;
+  
+  if ((out = fopen(file, "w")) == NULL)
+    exit(1);
+  fclose(out);
+}
+
+static int Found(const char *file, const struct ps_value_t *search) {
+  FILE *in;
+  
+  if ((in = PS_OpenSearch(file, "r", NULL, search, NULL)) == NULL)
+    return 0;
+  
+  fclose(in);
+  return 1;
+}
+
+/* Files added to a directory after it was indexed are found once the
+ * index or the directory is forgotten.  A removed file makes the
+ * directory be read again. */
+static void TestSearchIndex(void) {
+  struct ps_value_t *search;
+  int before, added, cleared, removed, other, stale, forgot;
+  
+  mkdir("search_test", 0777);
+  if ((search = PS_NewList()) == NULL || PS_AppendToList(search, PS_NewString("search_test")) < 0)
+    exit(1);
+  
+  before = Found("a.json", search);
+  Touch("search_test/a.json");
+  added = Found("a.json", search);
+  PS_ClearSearchIndex();
+  cleared = Found("a.json", search);
+  
+  remove("search_test/a.json");
+  Touch("search_test/b.json");
+  removed = Found("a.json", search);
+  other = Found("b.json", search);
+  
+  Touch("search_test/c.json");
+  stale = Found("c.json", search);
+  PS_ForgetDirectory("search_test/");
+  forgot = Found("c.json", search);
+  
+  remove("search_test/b.json");
+  remove("search_test/c.json");
+  rmdir("search_test");
+  PS_FreeValue(search);
+  
+  printf("Search index: %d, added %d, cleared %d, removed %d %d, added %d, forgotten %d\n",
+	 before, added, cleared, removed, other, stale, forgot);
+}
 
 int main(void) {
-  struct ps_value_t *ps, *search, *ext, *set;
-  struct ps_ostream_t *os, *stl;
+  struct ps_value_t *ps, *thr, *search, *ext, *set;
+  struct ps_ostream_t *os, *stl, *plain;
   FILE *file;
   char buf[4096];
   size_t len;
@@ -46,6 +267,25 @@ int main(void) {
   if ((search = PS_GetDefaultSearch()) == NULL)
     exit(1);
   
+  TestDefinitionCache(search);
+  TestSearchIndex();
+  
+  /* Other ways of loading are checked against thread_printer, which
+   * needs no definitions from outside the test directory */
+  if ((thr = PS_New("thread_printer", search)) == NULL) {
+    fprintf(stderr, "Could not create printer settings\n");
+    exit(1);
+  }
+  if ((plain = PS_NewStrOStream()) == NULL)
+    exit(1);
+  PS_WriteValue(plain, thr);
+  TestThreads(search, PS_OStreamContents(plain));
+  TestWatch(search, PS_OStreamContents(plain));
+  TestSnapshot(thr, search, PS_OStreamContents(plain));
+  TestShadowedSnapshot();
+  PS_FreeOStream(plain);
+  PS_FreeValue(thr);
+  
   if ((ps = PS_New("test.def.json", search)) == NULL) {
     fprintf(stderr, "Could not create printer settings\n");
     exit(1);
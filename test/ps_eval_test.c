@@ -218,5 +218,9 @@ int main(void) {
   EvalTest(v, "#global", PS_NewString("not in list"));
   PS_FreeValue(v);
   
+  v = ParseTest("test * 0.1 + .5e1 + 0x10 + 12345678901234567890", "#global");
+  EvalTest(v, "#global", PS_NewInteger(2));
+  PS_FreeValue(v);
+  
   return 0;
 }
@@ -32,8 +32,25 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include <string.h>
+
 #include "ps_parse_json.h"
 #include "ps_ostream.h"
+#include "ps_memory.h"
+
+static int fail_alloc;
+
+static void *FailingAlloc(void *ptr, size_t old_size, size_t new_size, void *data) {
+  if (new_size == 0) {
+    free(ptr);
+    return NULL;
+  }
+  
+  if (fail_alloc)
+    return NULL;
+  
+  return realloc(ptr, new_size);
+}
 
 void TestStr(const char *str, struct ps_ostream_t *os) {
   struct ps_value_t *v;
@@ -55,9 +72,167 @@ void TestStr(const char *str, struct ps_ostream_t *os) {
   PS_FreeValue(v);
 }
 
+/* Regular files are parsed from a mapping, starting at the file position.
+ * Lazy files are parsed as they are written out. */
+void TestFile(const char *str, struct ps_ostream_t *os, int lazy) {
+  struct ps_value_t *v;
+  FILE *file;
+  
+  if ((file = tmpfile()) == NULL) {
+    perror("Cannot create temporary file");
+    exit(1);
+  }
+  fprintf(file, "skipped %s", str);
+  fseek(file, 8, SEEK_SET);
+  
+  if ((v = lazy ? PS_ParseJsonFileLazy(file) : PS_ParseJsonFile(file)) == NULL) {
+    fprintf(stderr, "Error parsing json file: '%s'\n", str);
+    exit(1);
+  }
+  fclose(file);
+  
+  PS_OStreamReset(os);
+  PS_WriteValue(os, v);
+  
+  printf("%s '%s' -> '%s'\n", lazy ? "lazy" : "file", str, PS_OStreamContents(os));
+  
+  PS_FreeValue(v);
+}
+
+static void PrintPath(const char *event, const char *const *path, size_t depth) {
+  size_t count;
+  
+  printf("%s /", event);
+  for (count = 0; count < depth; count++)
+    printf("%s/", path[count] ? path[count] : "[]");
+}
+
+/* Skips members named label */
+static int Filter(const char *const *path, size_t depth, void *ref) {
+  return strcmp(path[depth - 1], "label") != 0;
+}
+
+static int Begin(const char *const *path, size_t depth, enum ps_type_t type, void *ref) {
+  PrintPath(type == t_object ? "begin object" : "begin list", path, depth);
+  printf("\n");
+  return 0;
+}
+
+static int End(const char *const *path, size_t depth, enum ps_type_t type, void *ref) {
+  PrintPath(type == t_object ? "end object" : "end list", path, depth);
+  printf("\n");
+  return 0;
+}
+
+static int Value(const char *const *path, size_t depth, struct ps_value_t *v, void *ref) {
+  struct ps_ostream_t *os = (struct ps_ostream_t *) ref;
+  
+  PrintPath("value", path, depth);
+  PS_OStreamReset(os);
+  PS_WriteValue(os, v);
+  printf(" %s\n", PS_OStreamContents(os));
+  PS_FreeValue(v);
+  return 0;
+}
+
+void TestEvents(const char *str, struct ps_ostream_t *os) {
+  struct ps_json_events_t ev = {Filter, Begin, End, Value, os};
+  
+  printf("events '%s'\n", str);
+  if (PS_ParseJsonEventsString(str, &ev) < 0) {
+    fprintf(stderr, "Error parsing json events: '%s'\n", str);
+    exit(1);
+  }
+}
+
+/* Strings and white space of every length around the scan blocks of
+ * 16 and 32 bytes, with an escape or newline at every position */
+void TestScanBlocks(void) {
+  static const char *const escapes[] = {"\\\"", "\\\\", "\\n", "\\u0041", "\n"};
+  static const char unescaped[] = {'"', '\\', '\n', 'A', '\n'};
+  char json[256], expect[256], *cur;
+  struct ps_value_t *v;
+  int len, pos, esc, count, checked = 0, wrong = 0;
+  
+  for (len = 0; len < 70; len++) {
+    for (pos = -1; pos < len; pos++) {
+      esc = (len + pos + 1) % 5;
+      cur = json;
+      *cur++ = '"';
+      for (count = 0; count < len; count++) {
+	if (count == pos) {
+	  cur += sprintf(cur, "%s", escapes[esc]);
+	  expect[count] = unescaped[esc];
+	} else {
+	  *cur++ = expect[count] = 'a' + count % 26;
+	}
+      }
+      strcpy(cur, "\"");
+      expect[len] = '\0';
+      
+      v = PS_ParseJsonString(json);
+      if (v == NULL || strcmp(PS_GetString(v), expect) != 0) {
+	fprintf(stderr, "Wrong string parsed from '%s'\n", json);
+	wrong++;
+      }
+      PS_FreeValue(v);
+      checked++;
+    }
+    
+    cur = json;
+    *cur++ = '[';
+    for (count = 0; count < len; count++)
+      *cur++ = " \t\n\r"[count % 4];
+    *cur++ = '7';
+    for (count = 0; count < len; count++)
+      *cur++ = "\n "[count % 2];
+    strcpy(cur, "]");
+    
+    v = PS_ParseJsonString(json);
+    if (PS_ItemCount(v) != 1 || PS_AsInteger(PS_GetItem(v, 0)) != 7) {
+      fprintf(stderr, "Wrong list parsed from '%s'\n", json);
+      wrong++;
+    }
+    PS_FreeValue(v);
+    checked++;
+  }
+  
+  printf("Scan blocks: %d checked, %d wrong\n", checked, wrong);
+}
+
+/* A lazy object that cannot be parsed reads as empty, the next use
+ * tries again */
+void TestLazyError(void) {
+  struct ps_value_t *v;
+  FILE *file;
+  
+  if ((file = tmpfile()) == NULL) {
+    perror("Cannot create temporary file");
+    exit(1);
+  }
+  fprintf(file, "{\"a\": {\"b\": 7}}");
+  rewind(file);
+  
+  if ((v = PS_ParseJsonFileLazy(file)) == NULL) {
+    fprintf(stderr, "Error parsing lazy file\n");
+    exit(1);
+  }
+  fclose(file);
+  
+  fail_alloc = 1;
+  printf("lazy without memory: %d, ", PS_GetMember(PS_GetMember(v, "a", NULL), "b", NULL) == NULL);
+  fail_alloc = 0;
+  printf("retried: %lld\n", (long long) PS_AsInteger(PS_GetMember(PS_GetMember(v, "a", NULL), "b", NULL)));
+  
+  PS_FreeValue(v);
+}
+
 int main(void) {
   struct ps_ostream_t *os;
   
+  if (PS_SetAllocator(FailingAlloc, NULL) < 0)
+    exit(1);
+  
   if ((os = PS_NewStrOStream()) == NULL)
     exit(1);
 
@@ -67,4 +242,12 @@ int main(void) {
   TestStr("[\"list\",2,true]", os);
   TestStr("{\"name\": \"Bob\",\"number\":4,\"list\":[5,6,true,null,{},[]]}", os);
   TestStr("{\"#global\": {\"Bob\": 4,\"poly\":[[3,2],[2,1],[39,91]],\"list\":[5,6,true,null,{\"test\": 4, \"hi\":[]},[]]},\"0\": {\"material_diameter\":3.13}}", os);
+  TestStr("[0.1,-2.5e-3,1E22,1e23,9223372036854775807,-9223372036854775808,9223372036854775808,0x1F,-0.0]", os);
+  TestFile("{\"name\": \"Bob\",\n\"esc\": \"a\\\"b\\u0041\",\"list\":[5,-2.5e1,true,null]}", os, 0);
+  TestFile("12345", os, 0);
+  TestFile("{\"a\": {\"b\": [1, {\"c\": {}}, [{\"d\": 2}]], \"e\": {\"f\": \"g\"}}, \"h\": [{}], \"i\": {}}", os, 1);
+  TestFile("[{\"a\": 1}, {\"b\": {\"c\": 2}}]", os, 1);
+  TestLazyError();
+  TestScanBlocks();
+  TestEvents("{\"a\": {\"label\": \"skipped\", \"value\": [1, {\"label\": [2]}, \"x\"]}, \"label\": {\"b\": 3}}", os);
 }
@@ -0,0 +1,234 @@
+/*
+  Copyright (C) 2018 Paul Maurer
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+  
+  1. Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+  
+  2. Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+  
+  3. Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from this
+  software without specific prior written permission.
+  
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_CREATE)
+#include <pthread.h>
+#define USE_THREADS
+#endif
+
+#include "printer_settings.h"
+
+#define NUM_THREADS 4
+
+#ifdef USE_THREADS
+
+static pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_slot;
+
+static int NextSlot(void) {
+  int slot;
+  
+  pthread_mutex_lock(&slot_lock);
+  slot = next_slot++;
+  pthread_mutex_unlock(&slot_lock);
+  
+  return slot;
+}
+
+/* Member names are interned in one table for all threads, so threads
+ * building their own objects with the same names share atoms.  The
+ * last object of each thread is freed by the main thread. */
+static void *BuildObjects(void *ref) {
+  struct ps_value_t **kept = (struct ps_value_t **) ref;
+  struct ps_value_t *obj;
+  char name[32];
+  int count, memb;
+  
+  for (count = 0; count < 200; count++) {
+    if ((obj = PS_NewObject()) == NULL)
+      return "Cannot create object";
+    for (memb = 0; memb < 50; memb++) {
+      snprintf(name, sizeof(name), "member%d", (memb * 7 + count) % 60);
+      if (PS_AddMember(obj, name, PS_NewInteger(memb)) < 0)
+	return "Cannot add member";
+    }
+    snprintf(name, sizeof(name), "member%d", count % 60);
+    if (PS_GetMember(obj, name, NULL) == NULL)
+      return "Member not found";
+    if (count < 199)
+      PS_FreeValue(obj);
+  }
+  
+  kept[NextSlot()] = obj;
+  return NULL;
+}
+
+/* Threads use arenas of their own, at the same time as other threads
+ * allocate outside of any arena */
+static void *UseArenas(void *ref) {
+  struct ps_value_t *obj, *copy;
+  char name[32];
+  int count, memb, in_arena;
+  
+  (void) ref;
+  for (count = 0; count < 200; count++) {
+    in_arena = (count + NextSlot()) % 2;
+    if (in_arena && PS_ArenaBegin() < 0)
+      return "Cannot begin arena";
+    if ((obj = PS_NewObject()) == NULL)
+      return "Cannot create object";
+    for (memb = 0; memb < 20; memb++) {
+      snprintf(name, sizeof(name), "arena%d", memb);
+      if (PS_AddMember(obj, name, PS_NewString(name)) < 0)
+	return "Cannot add member";
+    }
+    if (in_arena) {
+      copy = PS_ArenaEnd(obj);
+      obj = copy;
+      if (obj == NULL)
+	return "Cannot end arena";
+    }
+    if (strcmp(PS_GetString(PS_GetMember(obj, "arena7", NULL)), "arena7") != 0)
+      return "Wrong member";
+    PS_FreeValue(obj);
+  }
+  
+  return NULL;
+}
+
+struct eval_t {
+  const struct ps_value_t *ps;
+  const struct ps_value_t *set;
+  const char *expect;
+};
+
+/* Every thread evaluates the same frozen printer and settings */
+static void *EvalPrinter(void *ref) {
+  struct eval_t *ev = (struct eval_t *) ref;
+  struct ps_value_t *eval;
+  struct ps_ostream_t *os;
+  const char *err = NULL;
+  int count;
+  
+  if ((os = PS_NewStrOStream()) == NULL)
+    return "Cannot create stream";
+  
+  for (count = 0; count < 50 && err == NULL; count++) {
+    if ((eval = PS_EvalAll(ev->ps, ev->set)) == NULL) {
+      err = "Cannot evaluate settings";
+      break;
+    }
+    PS_OStreamReset(os);
+    PS_WriteValue(os, eval);
+    if (strcmp(PS_OStreamContents(os), ev->expect) != 0)
+      err = "Different evaluation";
+    PS_FreeValue(eval);
+  }
+  
+  PS_FreeOStream(os);
+  return (void *) err;
+}
+
+static void RunThreads(const char *what, void *(*func)(void *), void *ref) {
+  pthread_t threads[NUM_THREADS];
+  void *ret;
+  int count;
+  
+  for (count = 0; count < NUM_THREADS; count++)
+    if (pthread_create(&threads[count], NULL, func, ref) != 0)
+      exit(1);
+  
+  for (count = 0; count < NUM_THREADS; count++) {
+    pthread_join(threads[count], &ret);
+    if (ret)
+      fprintf(stderr, "%s: %s\n", what, (const char *) ret);
+  }
+  
+  printf("%s done\n", what);
+}
+
+static size_t Live(enum ps_mem_t mem) {
+  struct ps_mem_stats_t stats;
+  
+  PS_GetMemStats(mem, &stats);
+  return stats.num;
+}
+
+int main(void) {
+  struct ps_value_t *kept[NUM_THREADS], *search, *ps, *set, *eval;
+  struct ps_ostream_t *os;
+  struct eval_t ev;
+  int count;
+  
+  RunThreads("Build objects", BuildObjects, kept);
+  printf("%zu objects, %zu members\n", Live(mem_value + t_object), Live(mem_node));
+  for (count = 0; count < NUM_THREADS; count++)
+    PS_FreeValue(kept[count]);
+  printf("%zu objects, %zu atoms\n", Live(mem_value + t_object), Live(mem_atom));
+  
+  RunThreads("Use arenas", UseArenas, NULL);
+  printf("%zu objects, %zu strings, %zu atoms\n", Live(mem_value + t_object), Live(mem_value + t_string), Live(mem_atom));
+  
+  if ((search = PS_NewList()) == NULL || PS_AppendToList(search, PS_NewString(".")) < 0)
+    exit(1);
+  if ((ps = PS_New("thread_printer", search)) == NULL) {
+    fprintf(stderr, "Could not create printer settings\n");
+    exit(1);
+  }
+  if ((set = PS_BlankSettings(ps)) == NULL)
+    exit(1);
+  if (PS_AddSetting(set, "0", "infill_sparse_density", PS_NewFloat(30)) < 0)
+    exit(1);
+  if (PS_Freeze(ps) < 0 || PS_Freeze(set) < 0)
+    exit(1);
+  
+  if ((eval = PS_EvalAll(ps, set)) == NULL || (os = PS_NewStrOStream()) == NULL)
+    exit(1);
+  PS_WriteValue(os, eval);
+  puts(PS_OStreamContents(os));
+  
+  ev.ps = ps;
+  ev.set = set;
+  ev.expect = PS_OStreamContents(os);
+  RunThreads("Evaluate", EvalPrinter, &ev);
+  
+  PS_FreeOStream(os);
+  PS_FreeValue(eval);
+  PS_FreeValue(search);
+  return 0;
+}
+
+#else
+
+int main(void) {
+  printf("Threads are not supported\n");
+  return 0;
+}
+
+#endif
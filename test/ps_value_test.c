@@ -31,8 +31,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "ps_value.h"
+#include "ps_memory.h"
 #include "ps_ostream.h"
 
 #define AddMember(type, arg)			\
@@ -47,9 +49,76 @@
     PS_AppendToList(list, v);			\
   } while (0)
 
+/* Checks that the library frees memory with the size it allocated */
+static void *CheckedAlloc(void *ptr, size_t old_size, size_t new_size, void *data) {
+  size_t *p = ptr ? (size_t *) ptr - 2 : NULL;
+  
+  if (p && p[0] != old_size)
+    fprintf(stderr, "Freed %zu bytes, allocated %zu\n", old_size, p[0]);
+  
+  if (new_size == 0) {
+    free(p);
+    return NULL;
+  }
+  
+  if ((p = realloc(p, new_size + 2 * sizeof(size_t))) == NULL)
+    return NULL;
+  p[0] = new_size;
+  
+  return p + 2;
+}
+
+static size_t Live(enum ps_mem_t mem) {
+  struct ps_mem_stats_t stats;
+  
+  PS_GetMemStats(mem, &stats);
+  return stats.num;
+}
+
+/* Drops the member named drop, and fails after making a value for the
+ * one named fail */
+static int DropMember(const char *name, struct ps_value_t **memb, const struct ps_value_t *src_memb, void *ref) {
+  if (strcmp(name, "drop") == 0) {
+    PS_FreeValue(*memb);
+    *memb = NULL;
+    return 0;
+  }
+  
+  if (strcmp(name, "fail") == 0) {
+    *memb = PS_NewString("A string made just before merging fails");
+    return -1;
+  }
+  
+  return 0;
+}
+
+static struct ps_value_t *BuildMembers(int num) {
+  struct ps_value_t *obj;
+  char name[32];
+  int count;
+  
+  if ((obj = PS_NewObject()) == NULL)
+    exit(1);
+  for (count = 0; count < num; count++) {
+    snprintf(name, sizeof(name), "m%d", count);
+    if (PS_AddMember(obj, name, PS_NewInteger(count)) < 0)
+      exit(1);
+  }
+  
+  return obj;
+}
+
 int main(void) {
-  struct ps_value_t *obj, *list, *v;
+  struct ps_value_t *obj, *list, *v, *copy;
   struct ps_ostream_t *os;
+  struct ps_value_iterator_t vi;
+  const char *names[3] = {"String", "missing", "Boolean"};
+  const struct ps_value_t *membs[3], *layers[2];
+  struct ps_mem_stats_t before, after;
+  int count;
+  
+  if (PS_SetAllocator(CheckedAlloc, NULL) < 0)
+    exit(1);
   
   if ((obj = PS_NewObject()) == NULL)
     exit(1);
@@ -72,6 +141,10 @@ int main(void) {
   AddElement(Variable, "foo");
   PS_AddMember(obj, "list", list);
   
+  printf("%zu strings, %zu variables, %zu lists, %zu objects, %zu members\n",
+	 Live(mem_value + t_string), Live(mem_value + t_variable),
+	 Live(mem_value + t_list), Live(mem_value + t_object), Live(mem_node));
+  
   os = PS_NewFileOStream(stdout);
   PS_WriteValue(os, obj);
   PS_FreeOStream(os);
@@ -81,4 +154,192 @@ int main(void) {
   printf("\n\n");
   puts(PS_OStreamContents(os));
   printf("\n");
+  
+  if (PS_InitValueIterator(&vi, obj) < 0)
+    exit(1);
+  while (PS_ValueIteratorNext(&vi))
+    printf("%s ", PS_ValueIteratorKey(&vi));
+  printf("\n");
+  printf("%lld %d\n", (long long) PS_AsInteger(PS_GetMemberKey(obj, PS_KeyHandle("Integer"), NULL)),
+	 PS_GetMemberKeyConst(obj, PS_KeyHandle("missing"), NULL) == NULL);
+  layers[0] = list;
+  layers[1] = obj;
+  printf("%zu ", PS_GetMembers(obj, 3, names, membs));
+  printf("%s %d %d ", PS_GetString(membs[0]), membs[1] == NULL, PS_AsBoolean(membs[2]));
+  printf("%s\n", PS_GetString(PS_GetLayeredMember(layers, 2, "Variable")));
+  
+  /* Copies share storage until one of them is modified */
+  if ((copy = PS_CopyValue(obj)) == NULL)
+    exit(1);
+  
+  PS_AppendToList(PS_GetMember(copy, "list", NULL), PS_NewInteger(7));
+  PS_AddMember(copy, "Integer", PS_NewInteger(8));
+  PS_AddMember(obj, "Float", PS_NewFloat(1.5));
+  PS_FreeValue(copy);
+  
+  PS_OStreamReset(os);
+  PS_WriteValue(os, obj);
+  puts(PS_OStreamContents(os));
+  
+  PS_OStreamReset(os);
+  PS_WriteValue(os, list);
+  puts(PS_OStreamContents(os));
+  
+  /* Values from an arena are released together, except the one kept */
+  if (PS_ArenaBegin() < 0)
+    exit(1);
+  
+  if ((copy = PS_CopyValue(obj)) == NULL)
+    exit(1);
+  PS_AppendToList(PS_GetMember(copy, "list", NULL), PS_NewString("arena"));
+  PS_RemoveMember(copy, "Null");
+  if (PS_AddMember(obj, "Null", PS_NewInteger(0)) == 0)
+    fprintf(stderr, "Modified value from outside of the arena\n");
+  
+  if ((copy = PS_ArenaEnd(copy)) == NULL)
+    exit(1);
+  
+  PS_OStreamReset(os);
+  PS_WriteValue(os, copy);
+  puts(PS_OStreamContents(os));
+  
+  PS_OStreamReset(os);
+  PS_WriteValue(os, obj);
+  puts(PS_OStreamContents(os));
+  
+  PS_FreeValue(copy);
+  
+  /* Small numbers are stored without allocation, large ones are not */
+  if ((list = PS_NewList()) == NULL)
+    exit(1);
+  AddElement(Integer, 0);
+  AddElement(Integer, -1);
+  AddElement(Integer, INT64_MAX);
+  AddElement(Integer, INT64_MIN);
+  AddElement(Float, 0.0);
+  AddElement(Float, -0.0);
+  AddElement(Float, -2.5);
+  AddElement(Float, 1e-40);
+  AddElement(Float, 3e38);
+  AddElement(Float, 1e300);
+  
+  PS_OStreamReset(os);
+  PS_WriteValue(os, list);
+  puts(PS_OStreamContents(os));
+  printf("%g %g\n", 1 / PS_AsFloat(PS_GetItem(list, 5)), PS_AsFloat(PS_GetItem(list, 7)));
+  
+  PS_FreeValue(list);
+  
+  /* Lists grow past the capacity they were created with */
+  if ((list = PS_NewListCap(0)) == NULL)
+    exit(1);
+  for (count = 0; count < 100; count++)
+    AddElement(Integer, count * count);
+  if ((copy = PS_CopyValue(list)) == NULL)
+    exit(1);
+  PS_SetItem(copy, 0, PS_NewString("first"));
+  printf("%zu %lld %lld\n", PS_ItemCount(copy), (long long) PS_AsInteger(PS_GetItem(copy, -1)), (long long) PS_AsInteger(PS_GetItem(list, 0)));
+  PS_FreeValue(copy);
+  PS_FreeValue(list);
+  
+  /* Long strings are shared between copies, appending unshares */
+  if ((v = PS_NewString("A string that is too long to store inline")) == NULL)
+    exit(1);
+  if ((copy = PS_CopyValue(v)) == NULL)
+    exit(1);
+  PS_AppendToString(copy, ", appended");
+  PS_AppendToString(v, " and short");
+  printf("%s\n%s\n", PS_GetString(v), PS_GetString(copy));
+  PS_FreeValue(copy);
+  PS_FreeValue(v);
+
+  /* Union adds and replaces members, difference removes them */
+  if ((copy = PS_NewObject()) == NULL)
+    exit(1);
+  PS_AddMember(copy, "Integer", PS_NewInteger(12));
+  PS_AddMember(copy, "extra", PS_NewString("extra"));
+  if (PS_UnionObject(copy, obj, NULL, NULL) < 0)
+    fprintf(stderr, "Union of objects failed\n");
+  if ((v = PS_NewObject()) == NULL)
+    exit(1);
+  PS_AddMember(v, "list", PS_NewNull());
+  PS_AddMember(v, "Variable", PS_NewNull());
+  if (PS_DifferenceObject(copy, v, NULL, NULL) < 0)
+    fprintf(stderr, "Difference of objects failed\n");
+  PS_FreeValue(v);
+  
+  PS_OStreamReset(os);
+  PS_WriteValue(os, copy);
+  puts(PS_OStreamContents(os));
+  
+  /* Merge removes the members it sets to NULL */
+  if ((v = PS_NewObject()) == NULL)
+    exit(1);
+  PS_AddMember(v, "drop", PS_NewNull());
+  PS_AddMember(v, "fail", PS_NewNull());
+  PS_AddMember(copy, "drop", PS_NewString("A string that is dropped by merging"));
+  before.num = Live(mem_value + t_string);
+  printf("%d ", PS_UnionObject(copy, v, DropMember, NULL));
+  PS_FreeValue(v);
+  PS_OStreamReset(os);
+  PS_WriteValue(os, copy);
+  printf("%zu %s %zu\n", PS_ItemCount(copy), PS_OStreamContents(os), before.num - Live(mem_value + t_string));
+  PS_FreeValue(copy);
+  
+  /* Freed members go back to their pool, so building the same object
+   * again needs no more memory */
+  PS_FreeValue(BuildMembers(500));
+  PS_GetMemStats(mem_total, &before);
+  v = BuildMembers(500);
+  printf("%zu members, ", Live(mem_node));
+  PS_FreeValue(v);
+  PS_GetMemStats(mem_total, &after);
+  printf("%zu after free, reused %d\n", Live(mem_node), after.bytes == before.bytes && after.peak_bytes == before.peak_bytes);
+  
+  /* Iterating a copy leaves its members shared, changing a member
+   * copies only the path to it */
+  v = BuildMembers(100);
+  PS_AddMember(v, "list", PS_NewList());
+  if ((copy = PS_CopyValue(v)) == NULL)
+    exit(1);
+  before.num = Live(mem_node);
+  count = 0;
+  PS_InitValueIterator(&vi, copy);
+  while (PS_ValueIteratorNext(&vi))
+    count += PS_ValueIteratorKey(&vi) != NULL;
+  printf("%d members, %zu copied, ", count, Live(mem_node) - before.num);
+  PS_InitValueIterator(&vi, copy);
+  while (PS_ValueIteratorNext(&vi))
+    if (PS_GetType(PS_ValueIteratorData(&vi)) == t_list)
+      PS_AppendToList(PS_ValueIteratorData(&vi), PS_NewNull());
+  printf("%zu copied, %zu %zu\n", Live(mem_node) - before.num,
+	 PS_ItemCount(PS_GetMember(v, "list", NULL)), PS_ItemCount(PS_GetMember(copy, "list", NULL)));
+  PS_FreeValue(copy);
+  PS_FreeValue(v);
+  
+  /* Frozen values cannot be modified, but their copies can */
+  if (PS_Freeze(obj) < 0)
+    exit(1);
+  if ((copy = PS_CopyValue(obj)) == NULL)
+    exit(1);
+  if (PS_AddMember(obj, "frozen", PS_NewNull()) == 0)
+    fprintf(stderr, "Modified frozen value\n");
+  if (PS_AppendToList(PS_GetMember(obj, "list", NULL), PS_NewNull()) == 0)
+    fprintf(stderr, "Modified frozen value\n");
+  PS_AppendToList(PS_GetMember(copy, "list", NULL), PS_NewString("copy"));
+  PS_AddMember(copy, "frozen", PS_NewBoolean(0));
+
+  PS_OStreamReset(os);
+  PS_WriteValue(os, copy);
+  puts(PS_OStreamContents(os));
+
+  PS_OStreamReset(os);
+  PS_WriteValue(os, obj);
+  puts(PS_OStreamContents(os));
+
+  PS_FreeValue(copy);
+
+  PS_FreeOStream(os);
+  PS_FreeValue(obj);
+  return 0;
 }